@@ -0,0 +1,288 @@
+/*
+ *  alignment.h
+ *  Part of ClonalFrameML
+ *
+ *
+ *  ClonalFrameML is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ClonalFrameML is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with ClonalFrameML. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _ALIGNMENT_H_
+#define _ALIGNMENT_H_
+
+#include <vector>
+#include <string>
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+#include "myutils/DNA.h"
+#include "threadpool.h"
+#include "infile.h"
+
+/*	Every character allowed in an alignment is given a 4-bit code. The original character can be recovered exactly
+	(for writing filtered FASTA files), codes 0-3 are A,G,C,T as in the Nucleotide enumeration, and the characters
+	that FASTA_to_nucleotide treats alike (upper and lower case, U and T, and the symbols for missing data) map
+	to the same nucleotide through alignment_code_nucleotide. */
+static const char alignment_code_base[16] = {'A','G','C','T','U','N','X','-','?','a','g','c','t','u','n','x'};
+// Nucleotide for each code: 0-3 = A,G,C,T and 4 = N, as in the Nucleotide enumeration
+static const unsigned char alignment_code_nucleotide[16] = {0,1,2,3,3,4,4,4,4,0,1,2,3,3,4,4};
+// Codes treated as missing data by compute_compatibility ('N','X','-','?')
+static const unsigned int alignment_code_missing = (1<<5)|(1<<6)|(1<<7)|(1<<8);
+// Lookup results for characters that are not bases
+static const unsigned char alignment_code_space = 0xFE;
+static const unsigned char alignment_code_invalid = 0xFF;
+
+/*	An alignment stored site-major, with each base encoded in 4 bits and two sequences per byte, so that all the
+	sequences at one site are contiguous. Sequence i at site j is in the low (i even) or high (i odd) nibble of
+	byte j*site_bytes+i/2. This takes half the memory of the text and gives the per-site scans (compatibility,
+	patterns, nucleotide frequencies) sequential access.											*/
+class EncodedAlignment {
+public:
+	vector<string> label;
+	int nseq;
+	int lseq;
+	size_t site_bytes;
+	vector<unsigned char> data;
+protected:
+	// Code for each character, alignment_code_space for whitespace that is skipped within sequences or alignment_code_invalid
+	unsigned char base_code[256];
+	// Report a problem with an input file in *err, if given, or stop the program
+	EncodedAlignment& failed(const string &msg, string *err) {
+		if(err==NULL) error(msg.c_str());
+		*err = msg;
+		return *this;
+	}
+public:
+	EncodedAlignment() : nseq(0), lseq(0), site_bytes(0) {
+		int c;
+		for(c=0;c<256;c++) base_code[c] = alignment_code_invalid;
+		for(c=0;c<16;c++) base_code[(unsigned char)alignment_code_base[c]] = (unsigned char)c;
+		base_code[(unsigned char)' '] = base_code[(unsigned char)'\r'] = base_code[(unsigned char)'\n'] = alignment_code_space;
+	}
+	inline const unsigned char* site(const int pos) const {
+		return &data[(size_t)pos*site_bytes];
+	}
+	inline unsigned char code(const int i, const int pos) const {
+		const unsigned char b = data[(size_t)pos*site_bytes+i/2];
+		return (i%2) ? (b>>4) : (b&15);
+	}
+	inline char base(const int i, const int pos) const {
+		return alignment_code_base[code(i,pos)];
+	}
+	// The text of sequence i
+	string sequence(const int i) const {
+		string s(lseq,' ');
+		int pos;
+		for(pos=0;pos<lseq;pos++) s[pos] = base(i,pos);
+		return s;
+	}
+protected:
+	/*	First pass over the text of a FASTA file: append the label of each record, the start of its sequence text and its number of bases.
+		As for DNA::readFASTA_1pass, spaces are removed from every line and a line beginning with '>' starts a new record.	*/
+	bool index_FASTA(const char *text, const size_t len, const char *where, const char *filename, vector<string> &labels, vector<const char*> &seq_text, vector<long long> &seq_length, string &msg) const {
+		const size_t nseq0 = labels.size();
+		size_t pos = 0;
+		while(pos<len) {
+			const char *eol = (const char*)memchr(text+pos,'\n',len-pos);
+			const size_t end = (eol==NULL) ? len : (size_t)(eol-text);
+			size_t first = pos;
+			while(first<end && text[first]==' ') first++;
+			if(first<end && text[first]=='>') {
+				string s(text+first+1,end-first-1);
+				if(!s.empty() && *s.rbegin()=='\r') s.erase(s.length()-1,1);
+				s.erase(remove(s.begin(),s.end(),' '),s.end());
+				labels.push_back(s);
+				seq_text.push_back(text+end);
+				seq_length.push_back(0);
+			} else if(labels.size()==nseq0) {
+				if(first<end && !(end==first+1 && text[first]=='\r')) {
+					stringstream errTxt;
+					errTxt << where << ": File " << filename << " did not begin with '>'";
+					msg = errTxt.str();
+					return false;
+				}
+			} else {
+				long long n = 0;
+				size_t p;
+				for(p=first;p<end;p++) n += (text[p]!=' ' && text[p]!='\r');
+				seq_length.back() += n;
+			}
+			pos = end+1;
+		}
+		if(labels.size()==nseq0) {
+			stringstream errTxt;
+			errTxt << where << ": File " << filename << " contained no sequences";
+			msg = errTxt.str();
+			return false;
+		}
+		return true;
+	}
+	/*	Second pass: allocate the site-major buffer for nseq sequences of lseq sites and decode into it the bases of every sequence, whose text
+		begins at seq_text. The text is read in tiles of 64 sequences by 4096 sites so that the buffer is written contiguously, and tiles are
+		shared among nthreads threads. The tiles begin at even sequences, so no byte of the buffer is written by two threads.	*/
+	bool decode_FASTA(const vector<const char*> &seq_text, const char *where, const int nthreads, string &msg) {
+		site_bytes = (nseq+1)/2;
+		data = vector<unsigned char>(site_bytes*(size_t)lseq,0);
+		const int tile_seqs = 64;
+		const int tile_sites = 4096;
+		const int ngroups = (nseq+tile_seqs-1)/tile_seqs;
+		vector<int> bad_seq(ngroups,-1), bad_pos(ngroups,-1);
+		vector<char> bad_base(ngroups,0);
+		parallel_for(ngroups,nthreads,[&](const int group) {
+			const int i0 = group*tile_seqs;
+			const int ni = (i0+tile_seqs<nseq) ? tile_seqs : nseq-i0;
+			vector<const char*> cursor(seq_text.begin()+i0,seq_text.begin()+i0+ni);
+			vector<unsigned char> tile((size_t)tile_seqs*tile_sites,0);
+			int j0,i,j;
+			for(j0=0;j0<lseq;j0+=tile_sites) {
+				const int nj = (j0+tile_sites<lseq) ? tile_sites : lseq-j0;
+				for(i=0;i<ni;i++) {
+					unsigned char *t = &tile[(size_t)i*tile_sites];
+					const char *p = cursor[i];
+					for(j=0;j<nj;p++) {
+						const unsigned char c = base_code[(unsigned char)*p];
+						if(c<16) {
+							t[j++] = c;
+						} else if(c==alignment_code_invalid) {
+							bad_seq[group] = i0+i;
+							bad_pos[group] = j0+j;
+							bad_base[group] = *p;
+							return;
+						}
+					}
+					cursor[i] = p;
+				}
+				for(j=0;j<nj;j++) {
+					unsigned char *row = &data[(size_t)(j0+j)*site_bytes+i0/2];
+					for(i=0;i+1<ni;i+=2) row[i/2] = tile[(size_t)i*tile_sites+j] | (tile[(size_t)(i+1)*tile_sites+j]<<4);
+					if(i<ni) row[i/2] = tile[(size_t)i*tile_sites+j];
+				}
+			}
+		});
+		int i;
+		for(i=0;i<ngroups;i++) {
+			if(bad_seq[i]!=-1) {
+				stringstream errTxt;
+				errTxt << where << ": unsupported base " << bad_base[i] << " in sequence " << bad_seq[i];
+				errTxt << " (" << label[bad_seq[i]] << ") position " << bad_pos[i];
+				msg = errTxt.str();
+				return false;
+			}
+		}
+		return true;
+	}
+public:
+	// Read a FASTA file by mapping it (or, if compressed, decompressing it) into memory, encoding the bases directly into the site-major buffer
+	// (see decode_FASTA). If err is not NULL, a problem with the file is described in *err, and the alignment left incomplete, rather than stopping the program.
+	EncodedAlignment& read_FASTA(const char* filename, const int nthreads=1, string *err=NULL) {
+		static const char *where = "EncodedAlignment::read_FASTA()";
+		InputFile file;
+		string msg;
+		if(!file.open(filename,nthreads,msg)) {
+			if(!msg.empty()) return failed(msg,err);
+			stringstream errTxt;
+			errTxt << where << ": File " << filename << " not found";
+			return failed(errTxt.str(),err);
+		}
+		label = vector<string>(0);
+		vector<const char*> seq_text(0);
+		vector<long long> seq_length(0);
+		if(!index_FASTA(file.text,file.len,where,filename,label,seq_text,seq_length,msg)) return failed(msg,err);
+		nseq = label.size();
+		int i;
+		for(i=1;i<nseq;i++) {
+			if(seq_length[i]!=seq_length[0]) {
+				stringstream errTxt;
+				errTxt << where << ": File " << filename << " sequences had different lengths";
+				return failed(errTxt.str(),err);
+			}
+		}
+		lseq = seq_length[0];
+		if(!decode_FASTA(seq_text,where,nthreads,msg)) return failed(msg,err);
+		file.close();
+		return *this;
+	}
+	/*	Read the FASTA files in a list, the sequences of each file following those of the previous one. In a first pass, the files are
+		opened and indexed concurrently by nthreads threads, and their sequence counts and lengths checked. The site-major buffer is then
+		allocated once for all the files and the bases decoded straight into it, as by read_FASTA, with tiles that may span files.	*/
+	EncodedAlignment& read_FASTA_list(const vector<string> &filenames, const int nthreads=1) {
+		static const char *where = "EncodedAlignment::read_FASTA_list()";
+		const int nfiles = filenames.size();
+		if(nfiles==0) error("EncodedAlignment::read_FASTA_list(): no files listed");
+		vector<InputFile> file(nfiles);
+		vector< vector<string> > file_label(nfiles);
+		vector< vector<const char*> > file_seq_text(nfiles);
+		vector< vector<long long> > file_seq_length(nfiles);
+		vector<string> err(nfiles);
+		// Threads left over when there are fewer files than threads go to decompressing each file
+		const int file_threads = (nfiles<nthreads) ? nthreads/nfiles : 1;
+		parallel_for(nfiles,nthreads,[&](const int f) {
+			if(!file[f].open(filenames[f].c_str(),file_threads,err[f])) {
+				if(!err[f].empty()) return;
+				stringstream errTxt;
+				errTxt << where << ": File " << filenames[f] << " not found";
+				err[f] = errTxt.str();
+				return;
+			}
+			index_FASTA(file[f].text,file[f].len,where,filenames[f].c_str(),file_label[f],file_seq_text[f],file_seq_length[f],err[f]);
+		});
+		int f;
+		for(f=0;f<nfiles;f++) {
+			if(!err[f].empty()) error(err[f].c_str());
+		}
+		label = vector<string>(0);
+		vector<const char*> seq_text(0);
+		lseq = file_seq_length[0][0];
+		for(f=0;f<nfiles;f++) {
+			int i;
+			for(i=0;i<file_seq_length[f].size();i++) {
+				if(file_seq_length[f][i]!=lseq) {
+					stringstream errTxt;
+					errTxt << where << ": listed file " << filenames[f] << " had sequence length " << file_seq_length[f][i] << " expecting " << lseq;
+					error(errTxt.str().c_str());
+				}
+			}
+			label.insert(label.end(),file_label[f].begin(),file_label[f].end());
+			seq_text.insert(seq_text.end(),file_seq_text[f].begin(),file_seq_text[f].end());
+		}
+		nseq = label.size();
+		string msg;
+		if(!decode_FASTA(seq_text,where,nthreads,msg)) error(msg.c_str());
+		return *this;
+	}
+	// Encode an alignment that has already been read as text
+	EncodedAlignment& encode(const DNA &fa) {
+		label = fa.label;
+		nseq = fa.nseq;
+		lseq = fa.lseq;
+		site_bytes = (nseq+1)/2;
+		data = vector<unsigned char>(site_bytes*(size_t)lseq,0);
+		int i,j;
+		for(i=0;i<nseq;i++) {
+			const string &s = fa.sequence[i];
+			for(j=0;j<lseq;j++) {
+				const unsigned char c = base_code[(unsigned char)s[j]];
+				if(c>=16) {
+					stringstream errTxt;
+					errTxt << "EncodedAlignment::encode(): unsupported base " << s[j] << " in sequence " << i;
+					errTxt << " (" << label[i] << ") position " << j;
+					error(errTxt.str().c_str());
+				}
+				data[(size_t)j*site_bytes+i/2] |= (i%2) ? (c<<4) : c;
+			}
+		}
+		return *this;
+	}
+};
+
+#endif // _ALIGNMENT_H_
@@ -0,0 +1,366 @@
+/*
+ *  bench.cpp
+ *  Part of ClonalFrameML
+ *
+ *  ClonalFrameML is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ClonalFrameML is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with ClonalFrameML. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+/*	cfml_bench: time the main kernels of ClonalFrameML in isolation on a given tree and alignment (for example one
+	produced by cfml_simulate), so that the effect of a change can be measured without a full analysis. Every kernel
+	is repeated and the median and variance of its wall time are reported, together with its throughput in units of
+	sites x branches per second and the size of its principal data in bytes per alignment site. The results are written
+	to a JSON file, and if a baseline file from an earlier run is given, any kernel whose throughput has fallen by more
+	than the threshold is flagged as a regression.																	*/
+// main.h defines globals and xmfa.h non-inline functions, so the analysis routines are compiled into this translation unit
+#define CFML_NO_MAIN
+#include "main.cpp"
+#include <stdio.h>
+#include <sys/stat.h>
+
+struct BenchResult {
+	string name;
+	double units;				// sites x branches processed per call
+	double bytes_per_site;
+	vector<double> seconds;
+	double median;
+	double variance;
+	double throughput;			// units per second, at the median time
+};
+
+// Call f() repeats times, recording the wall time of each call
+template<typename F>
+BenchResult benchmark_kernel(const char* name, const double units, const double bytes_per_site, const int repeats, F f) {
+	BenchResult res;
+	res.name = name;
+	res.units = units;
+	res.bytes_per_site = bytes_per_site;
+	int r;
+	for(r=0;r<repeats;r++) {
+		const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		f();
+		res.seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count());
+	}
+	vector<double> sorted = res.seconds;
+	std::sort(sorted.begin(),sorted.end());
+	res.median = (repeats%2) ? sorted[repeats/2] : 0.5*(sorted[repeats/2-1]+sorted[repeats/2]);
+	double mean = 0.0;
+	for(r=0;r<repeats;r++) mean += res.seconds[r]/(double)repeats;
+	res.variance = 0.0;
+	if(repeats>1) {
+		for(r=0;r<repeats;r++) res.variance += (res.seconds[r]-mean)*(res.seconds[r]-mean)/(double)(repeats-1);
+	}
+	res.throughput = (res.median>0.0) ? units/res.median : 0.0;
+	return res;
+}
+
+void print_bench_result(const BenchResult &res) {
+	cout << setw(48) << std::left << res.name << std::right << " median " << setw(12) << res.median << " s  sd " << setw(12) << sqrt(res.variance);
+	cout << " s  " << setw(12) << res.throughput << " sites.branches/s  " << setw(10) << res.bytes_per_site << " bytes/site" << endl;
+}
+
+/*	The linear scan that find_alignment_patterns replaced, in which every site is compared with each pattern seen before
+	it, taking time O(L x P x n). It is kept as the reference against which the speed-up of the hashed index is measured.	*/
+void find_alignment_patterns_linear_scan(const EncodedAlignment &fa, const vector<bool> &usesite, vector<string> &pat, vector<int> &pat1, vector<int> &cpat, vector<int> &ipat) {
+	pat = vector<string>(0);
+	pat1 = vector<int>(0);
+	cpat = vector<int>(0);
+	ipat = vector<int>(0);
+	static const char AGCTN[5] = {'A','G','C','T','N'};
+	int i,j,pos;
+	for(pos=0;pos<fa.lseq;pos++) {
+		if(usesite[pos]) {
+			string pospat(fa.nseq,'N');
+			for(i=0;i<fa.nseq;i++) {
+				pospat[i] = AGCTN[alignment_code_nucleotide[fa.code(i,pos)]];
+			}
+			for(j=0;j<pat.size();j++) {
+				if(pospat==pat[j]) break;
+			}
+			if(j==pat.size()) {
+				pat.push_back(pospat);
+				pat1.push_back(pos);
+				cpat.push_back(1);
+			} else {
+				++cpat[j];
+			}
+			ipat.push_back(j);
+		}
+	}
+}
+
+double file_size(const string &file_name) {
+	struct stat st;
+	if(stat(file_name.c_str(),&st)!=0) return 0.0;
+	return (double)st.st_size;
+}
+
+// Read the throughput of each kernel from a JSON file written by write_bench_json(), which puts one kernel per line
+map<string,double> read_bench_baseline(const char* file_name) {
+	ifstream fin(file_name);
+	if(!fin) {
+		stringstream errTxt;
+		errTxt << "Could not open baseline file " << file_name;
+		error(errTxt.str().c_str());
+	}
+	map<string,double> baseline;
+	string line;
+	while(getline(fin,line)) {
+		const size_t name_pos = line.find("\"name\": \"");
+		const size_t tp_pos = line.find("\"throughput\": ");
+		if(name_pos==string::npos || tp_pos==string::npos) continue;
+		const size_t name_beg = name_pos+9;
+		const size_t name_end = line.find('"',name_beg);
+		if(name_end==string::npos) continue;
+		baseline[line.substr(name_beg,name_end-name_beg)] = atof(line.c_str()+tp_pos+14);
+	}
+	return baseline;
+}
+
+void write_bench_json(const vector<BenchResult> &results, const EncodedAlignment &fa, const int nbranches, const int npatterns, const int repeats, const int nthreads, const char* file_name) {
+	ofstream fout(file_name);
+	if(!fout) {
+		stringstream errTxt;
+		errTxt << "Could not open " << file_name << " for writing";
+		error(errTxt.str().c_str());
+	}
+	fout << setprecision(9);
+	fout << "{" << endl;
+	fout << "  \"version\": \"" << ClonalFrameML_version << "\"," << endl;
+	fout << "  \"threads\": " << nthreads << "," << endl;
+	fout << "  \"repeats\": " << repeats << "," << endl;
+	fout << "  \"sequences\": " << fa.nseq << ", \"sites\": " << fa.lseq << ", \"branches\": " << nbranches << ", \"patterns\": " << npatterns << "," << endl;
+	fout << "  \"kernels\": [" << endl;
+	int i,r;
+	for(i=0;i<results.size();i++) {
+		const BenchResult &res = results[i];
+		fout << "    {\"name\": \"" << res.name << "\", \"units\": " << res.units << ", \"median_s\": " << res.median << ", \"variance_s2\": " << res.variance;
+		fout << ", \"throughput\": " << res.throughput << ", \"bytes_per_site\": " << res.bytes_per_site << ", \"seconds\": [";
+		for(r=0;r<res.seconds.size();r++) fout << ((r>0) ? ", " : "") << res.seconds[r];
+		fout << "]}" << ((i+1<results.size()) ? "," : "") << endl;
+	}
+	fout << "  ]" << endl;
+	fout << "}" << endl;
+	fout.close();
+}
+
+int main(const int argc, const char* argv[]) {
+	cout << "cfml_bench " << ClonalFrameML_version << endl;
+	if(argc<4) {
+		stringstream errTxt;
+		errTxt << "Syntax: cfml_bench newick_file fasta_file output_prefix [OPTIONS]" << endl;
+		errTxt << endl;
+		errTxt << "Writes the results to output_prefix.bench.json" << endl;
+		errTxt << endl;
+		errTxt << "Options:" << endl;
+		errTxt << "-repeats                       value > 0 (default 5)        Number of times to run each kernel." << endl;
+		errTxt << "-threads                       value > 0 (default 1)        Number of threads for the kernels that use them." << endl;
+		errTxt << "-kappa                         value > 0 (default 2.0)      Relative rate of transitions vs transversions." << endl;
+		errTxt << "-initial_values                default \"0.1 0.001 0.05\"  Values of R/theta, 1/delta and nu for the HMM kernels." << endl;
+		errTxt << "-baseline                      file name (default none)     A .bench.json file from an earlier run to compare against." << endl;
+		errTxt << "-threshold                     0 to 1 (default 0.1)         Fall in throughput relative to the baseline reported as a regression." << endl;
+		errTxt << "-linear_scan                   true (default) or false      Also time the linear scan for site patterns, to report the speed-up of find_alignment_patterns." << endl;
+		cout << errTxt.str().c_str() << endl;
+		return 0;
+	}
+	const char* newick_file = argv[1];
+	const char* fasta_file = argv[2];
+	const char* out_prefix = argv[3];
+	string bench_out_file = string(out_prefix) + ".bench.json";
+	string writer_out_prefix = string(out_prefix) + ".bench_output";
+	ArgumentWizard arg;
+	arg.case_sensitive = false;
+	int repeats = 5, nthreads = 1;
+	double kappa = 2.0, threshold = 0.1;
+	string string_initial_values = "0.1 0.001 0.05", baseline_file = "", linear_scan = "true";
+	arg.add_item("repeats",			TP_INT,		&repeats);
+	arg.add_item("threads",			TP_INT,		&nthreads);
+	arg.add_item("kappa",			TP_DOUBLE,	&kappa);
+	arg.add_item("initial_values",	TP_STRING,	&string_initial_values);
+	arg.add_item("baseline",		TP_STRING,	&baseline_file);
+	arg.add_item("threshold",		TP_DOUBLE,	&threshold);
+	arg.add_item("linear_scan",		TP_STRING,	&linear_scan);
+	arg.read_input(argc-3,argv+3);
+	const bool LINEAR_SCAN = string_to_bool(linear_scan,"linear_scan");
+	if(repeats<1) error("-repeats must be positive");
+	if(nthreads<1) error("-threads must be positive");
+	if(kappa<=0.0) error("-kappa must be positive");
+	if(threshold<0.0 || threshold>1.0) error("-threshold must be between 0 and 1");
+	vector<double> initial_values(0);
+	stringstream sstream_initial_values;
+	sstream_initial_values << string_initial_values;
+	int i;
+	for(i=0;i<3;i++) {
+		double elem;
+		sstream_initial_values >> elem;
+		if(sstream_initial_values.fail() || elem<=0.0) error("Could not interpret value specified by initial_values");
+		initial_values.push_back(elem);
+	}
+	const double rho_over_theta = initial_values[0];
+	const double mean_import_length = 1.0/initial_values[1];
+	const double import_divergence = initial_values[2];
+
+	// Load the data as ClonalFrameML does
+	EncodedAlignment fa;
+	fa.read_FASTA(fasta_file,nthreads);
+	NewickTree newick = read_Newick(newick_file);
+	vector<string> ctree_node_labels;
+	const bool is_rooted = (newick.root.dec.size()==2);
+	marginal_tree ctree = (is_rooted) ? convert_rooted_NewickTree_to_marginal_tree(newick,fa.label,ctree_node_labels) : convert_unrooted_NewickTree_to_marginal_tree(newick,fa.label,ctree_node_labels);
+	const int root_node = (is_rooted) ? ctree.size-1 : ctree.size-2;
+	const double nbranches = (double)root_node;
+	const double nsites = (double)fa.lseq;
+	cout << "Benchmarking " << repeats << " repeats with " << nthreads << " threads on " << fa.nseq << " sequences of length " << fa.lseq << " and " << root_node << " branches" << endl;
+	vector<BenchResult> results;
+
+	// Compatibility: reads the whole encoded alignment and writes one int per site
+	vector<bool> anyN;
+	vector<int> compat;
+	results.push_back(benchmark_kernel("compute_compatibility",nsites*nbranches,(double)fa.site_bytes+sizeof(int),repeats,[&]() {
+		compat = compute_compatibility(fa,ctree,anyN,false,nthreads);
+	}));
+	vector<bool> isBLC(fa.lseq,false);
+	int nBLC = 0;
+	for(i=0;i<fa.lseq;i++) {
+		if(compat[i]<=0) {
+			isBLC[i] = true;
+			++nBLC;
+		}
+	}
+	if(nBLC==0) error("cfml_bench: the alignment has no compatible sites");
+
+	// Patterns: reads the alignment at the sites in use and writes one int per site
+	vector<string> pat;
+	vector<int> pat1, cpat, ipat;
+	results.push_back(benchmark_kernel("find_alignment_patterns",(double)nBLC*nbranches,(double)fa.site_bytes+sizeof(int),repeats,[&]() {
+		find_alignment_patterns(fa,isBLC,pat,pat1,cpat,ipat);
+	}));
+	const int npatterns = pat1.size();
+	// The linear scan it replaced, which must find the same patterns
+	double pattern_speedup = 0.0;
+	if(LINEAR_SCAN) {
+		vector<string> scan_pat;
+		vector<int> scan_pat1, scan_cpat, scan_ipat;
+		results.push_back(benchmark_kernel("find_alignment_patterns_linear_scan",(double)nBLC*nbranches,(double)fa.site_bytes+sizeof(int),repeats,[&]() {
+			find_alignment_patterns_linear_scan(fa,isBLC,scan_pat,scan_pat1,scan_cpat,scan_ipat);
+		}));
+		if(scan_pat!=pat || scan_pat1!=pat1 || scan_cpat!=cpat || scan_ipat!=ipat) error("cfml_bench: find_alignment_patterns and the linear scan found different patterns");
+		const BenchResult &hashed = results[results.size()-2];
+		const BenchResult &scan = results[results.size()-1];
+		if(hashed.median>0.0) pattern_speedup = scan.median/hashed.median;
+	}
+
+	// Ancestral reconstruction: one pattern per unique site, and a nucleotide per node per pattern
+	vector<bool> ispat1(fa.lseq,false);
+	for(i=0;i<pat1.size();i++) ispat1[pat1[i]] = true;
+	vector<double> pi(4,0.25);
+	Matrix<Nucleotide> nuc = FASTA_to_nucleotide(fa,pi,ispat1);
+	Matrix<Nucleotide> node_nuc;
+	results.push_back(benchmark_kernel("maximum_likelihood_ancestral_sequences",(double)nBLC*nbranches,(double)ctree.size*npatterns*sizeof(Nucleotide)/(double)nBLC,repeats,[&]() {
+		maximum_likelihood_ancestral_sequences(nuc,ctree,kappa,pi,cpat,node_nuc,nthreads);
+	}));
+
+	// Marginal reconstruction: the most probable base and its posterior probability per node per pattern
+	Matrix<Nucleotide> max_base;
+	Matrix<float> max_posterior;
+	vector<double> pattern_loglik;
+	results.push_back(benchmark_kernel("marginal_ancestral_posteriors",(double)nBLC*nbranches,(double)ctree.size*npatterns*(sizeof(Nucleotide)+sizeof(float))/(double)nBLC,repeats,[&]() {
+		marginal_ancestral_posteriors(nuc,ctree,kappa,pi,cpat,max_base,max_posterior,pattern_loglik,nthreads);
+	}));
+
+	// Branch summaries: reads two nucleotides and a count per pattern for every branch
+	vector<BranchSummary> branch_summary;
+	results.push_back(benchmark_kernel("summarize_branches",(double)nBLC*nbranches,(double)npatterns*(2*sizeof(Nucleotide)+sizeof(int))/(double)nBLC,repeats,[&]() {
+		branch_summary = summarize_branches(ctree,node_nuc,cpat,root_node,nthreads);
+	}));
+
+	// One Baum-Welch iteration: the forward-backward expectations on every informative branch at the initial values
+	vector< vector<ImportedInterval> > is_imported(root_node);
+	vector<double> prior_a(4,1.0), prior_b(4,1.0);
+	ClonalFrameBaumWelch cff(ctree,node_nuc,isBLC,ipat,branch_summary,kappa,pi,is_imported,prior_a,prior_b,root_node,false,false,nthreads);
+	vector<double> rho_over_theta_br(root_node,rho_over_theta), mean_import_length_br(root_node,mean_import_length), import_divergence_br(root_node,import_divergence);
+	vector<BranchExpectations> expectations(root_node);
+	const double emission_bytes_per_site = (double)ctree.size*npatterns/(double)nBLC+sizeof(int)+sizeof(double);
+	results.push_back(benchmark_kernel("Baum_Welch_iteration",(double)nBLC*nbranches,emission_bytes_per_site,repeats,[&]() {
+		forward_backward_expectations_ClonalFrame_allbranches(ctree,cff.emission_class,cff.which_compat,ipat,kappa,pi,cff.informative,cff.initial_branch_length,rho_over_theta_br,mean_import_length_br,import_divergence_br,nthreads,HMMKernelScaled,expectations);
+	}));
+
+	// Viterbi importation status over all sites of every branch
+	results.push_back(benchmark_kernel("maximum_likelihood_ClonalFrame_branch_allsites",(double)nBLC*nbranches,emission_bytes_per_site,repeats,[&]() {
+		parallel_for(root_node,nthreads,[&](const int i) {
+			maximum_likelihood_ClonalFrame_branch_allsites(ctree.node[i].id,cff.emission_class,cff.which_compat,fa.lseq,ipat,kappa,pi,cff.initial_branch_length[i],rho_over_theta,mean_import_length,import_divergence,is_imported[i]);
+		});
+	}));
+
+	// The output writers, with bytes per site measured from the files written
+	const string fasta_out = writer_out_prefix + ".ML_sequence.fasta";
+	const string xref_out = writer_out_prefix + ".position_cross_reference.txt";
+	const string import_out = writer_out_prefix + ".importation_status.txt";
+	const string tree_out = writer_out_prefix + ".labelled_tree.newick";
+	const double writer_units = (double)nBLC*nbranches;
+	BenchResult res;
+	res = benchmark_kernel("write_ancestral_fasta",writer_units,0.0,repeats,[&]() {
+		write_ancestral_fasta(node_nuc,ctree_node_labels,fasta_out.c_str(),nthreads);
+	});
+	res.bytes_per_site = file_size(fasta_out)/(double)nBLC;
+	results.push_back(res);
+	res = benchmark_kernel("write_position_cross_reference",writer_units,0.0,repeats,[&]() {
+		write_position_cross_reference(isBLC,ipat,xref_out.c_str());
+	});
+	res.bytes_per_site = file_size(xref_out)/nsites;
+	results.push_back(res);
+	res = benchmark_kernel("write_importation_status",writer_units,0.0,repeats,[&]() {
+		write_importation_status_intervals(is_imported,ctree_node_labels,isBLC,compat,import_out.c_str(),root_node,"");
+	});
+	res.bytes_per_site = file_size(import_out)/nsites;
+	results.push_back(res);
+	res = benchmark_kernel("write_newick",writer_units,0.0,repeats,[&]() {
+		write_newick(ctree,ctree_node_labels,tree_out.c_str());
+	});
+	res.bytes_per_site = file_size(tree_out)/nsites;
+	results.push_back(res);
+	remove(fasta_out.c_str());
+	remove(xref_out.c_str());
+	remove(import_out.c_str());
+	remove(tree_out.c_str());
+
+	for(i=0;i<results.size();i++) print_bench_result(results[i]);
+	if(LINEAR_SCAN) cout << "find_alignment_patterns speed-up over the linear scan: " << pattern_speedup << "x (" << npatterns << " patterns)" << endl;
+	write_bench_json(results,fa,root_node,npatterns,repeats,nthreads,bench_out_file.c_str());
+	cout << "Wrote benchmark results to " << bench_out_file << endl;
+
+	// Compare against the baseline
+	if(baseline_file!="") {
+		map<string,double> baseline = read_bench_baseline(baseline_file.c_str());
+		int nregressions = 0;
+		cout << "Comparison with baseline " << baseline_file << ":" << endl;
+		for(i=0;i<results.size();i++) {
+			map<string,double>::const_iterator it = baseline.find(results[i].name);
+			if(it==baseline.end() || it->second<=0.0) {
+				cout << setw(48) << std::left << results[i].name << std::right << " not in baseline" << endl;
+				continue;
+			}
+			const double change = results[i].throughput/it->second-1.0;
+			const bool regression = (change < -threshold);
+			if(regression) ++nregressions;
+			cout << setw(48) << std::left << results[i].name << std::right << " throughput " << setw(8) << round(1000.0*change)/10.0 << "%";
+			cout << ((regression) ? "  REGRESSION" : "") << endl;
+		}
+		if(nregressions>0) {
+			cout << nregressions << " kernels regressed by more than " << 100.0*threshold << "% relative to the baseline" << endl;
+			return 1;
+		}
+		cout << "No kernels regressed by more than " << 100.0*threshold << "% relative to the baseline" << endl;
+	}
+	return 0;
+}
@@ -63,6 +63,7 @@ public:
 	BrentFunction & BrentFunc;
 
 	bool coutput;
+	ostream *outstream;			// where the progress is written if coutput is true
 	double evala_BrentFunc, evalb_BrentFunc, evalc_BrentFunc;
 	double pointa,pointb,pointc;
 	double GLIMIT, TINY, tolerance;
@@ -74,7 +75,7 @@ public:
 	bool fail;
 
 public:
-	Brent(BrentFunction &BrentFunc_in) : BrentFunc(BrentFunc_in), GLIMIT(100.), TINY(1.e-20), ITMAX(100), coutput(false), EPS(3.0e-8) {}
+	Brent(BrentFunction &BrentFunc_in) : BrentFunc(BrentFunc_in), GLIMIT(100.), TINY(1.e-20), ITMAX(100), coutput(false), outstream(&cout), EPS(3.0e-8) {}
 	double minimize(const double pointa_in, const double pointb_in, const double tol) {
 		fail = false;
 		ZEPS=numeric_limits<double>::epsilon()*1.0e-3;
@@ -84,15 +85,15 @@ public:
 		tolerance = tol;
 		mnbrak(pointa, pointb, pointc, evala_BrentFunc, evalb_BrentFunc, evalc_BrentFunc);
 		if(coutput) {
-			cout << "Function is bracketed by:" << endl;
-			cout << "f(" << pointa << ") = " << evala_BrentFunc << endl;
-			cout << "f(" << pointb << ") = " << evalb_BrentFunc << endl;
-			cout << "f(" << pointc << ") = " << evalc_BrentFunc << endl;
+			*outstream << "Function is bracketed by:" << endl;
+			*outstream << "f(" << pointa << ") = " << evala_BrentFunc << endl;
+			*outstream << "f(" << pointb << ") = " << evalb_BrentFunc << endl;
+			*outstream << "f(" << pointc << ") = " << evalc_BrentFunc << endl;
 		}
 		double result = 0.0;
 		function_minimum = brent(pointa, pointb, pointc, result);
 		if(coutput)
-			cout << "Function is minimized at f(" << result << ") = " << function_minimum << endl;
+			*outstream << "Function is minimized at f(" << result << ") = " << function_minimum << endl;
 		return result;
 	};
 
@@ -105,7 +106,7 @@ public:
 	  bracketed = true;
 	  if ((fa > 0.0 && fb > 0.0) || (fa < 0.0 && fb < 0.0)) {
 	    if(coutput)
-	      cout << "f(" << x1 << ") = " << fa << "\tf(" << x2 << ") = " << fb << endl;
+	      *outstream << "f(" << x1 << ") = " << fa << "\tf(" << x2 << ") = " << fb << endl;
 	    //myutils::warning("Root must be bracketed in rootfind");
 	    bracketed = false;
 	    return 0.0;
@@ -311,6 +312,7 @@ public:
 	BrentFunction & BrentFunc;
 
 	bool coutput;
+	ostream *outstream;			// where the progress is written if coutput is true
 	double evala_BrentFunc, evalb_BrentFunc, evalc_BrentFunc;
 	double pointa,pointb,pointc;
 	double GLIMIT, TINY, tolerance;
@@ -320,7 +322,7 @@ public:
 	double min_x,max_x;
 
 public:
-	ConstrainedBrent(BrentFunction &BrentFunc_in) : BrentFunc(BrentFunc_in), GLIMIT(100.), TINY(1.e-20), ITMAX(100), coutput(false) {}
+	ConstrainedBrent(BrentFunction &BrentFunc_in) : BrentFunc(BrentFunc_in), GLIMIT(100.), TINY(1.e-20), ITMAX(100), coutput(false), outstream(&cout) {}
 	double minimize(const double pointa_in, const double pointb_in, const double tol, const double min_x_in, const double max_x_in) {
 		min_x = min_x_in;
 		max_x = max_x_in;
@@ -335,15 +337,15 @@ public:
 		tolerance = tol;
 		mnbrak(pointa, pointb, pointc, evala_BrentFunc, evalb_BrentFunc, evalc_BrentFunc);
 		if(coutput) {
-			cout << "Function is bracketed by:" << endl;
-			cout << "f(" << pointa << ") = " << evala_BrentFunc << endl;
-			cout << "f(" << pointb << ") = " << evalb_BrentFunc << endl;
-			cout << "f(" << pointc << ") = " << evalc_BrentFunc << endl;
+			*outstream << "Function is bracketed by:" << endl;
+			*outstream << "f(" << pointa << ") = " << evala_BrentFunc << endl;
+			*outstream << "f(" << pointb << ") = " << evalb_BrentFunc << endl;
+			*outstream << "f(" << pointc << ") = " << evalc_BrentFunc << endl;
 		}
 		double result = 0.0;
 		function_minimum = brent(pointa, pointb, pointc, result);
 		if(coutput)
-			cout << "Function is minimized at f(" << result << ") = " << function_minimum << endl;
+			*outstream << "Function is minimized at f(" << result << ") = " << function_minimum << endl;
 		return result;
 	};
 protected:
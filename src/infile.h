@@ -0,0 +1,301 @@
+/*
+ *  infile.h
+ *  Part of ClonalFrameML
+ *
+ *
+ *  ClonalFrameML is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ClonalFrameML is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with ClonalFrameML. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _INFILE_H_
+#define _INFILE_H_
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <sstream>
+#include <streambuf>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef CFML_ZSTD
+#include <zstd.h>
+#endif
+#include "threadpool.h"
+
+enum InputCompression {InputCompressionNone=0, InputCompressionGzip, InputCompressionBGZF, InputCompressionZstd};
+
+// Identify the compression of a file from its first bytes, whatever its name. BGZF is gzip whose header carries a 'BC' extra field.
+inline InputCompression input_compression(const unsigned char *data, const size_t len) {
+	if(len>=4 && data[0]==0x28 && data[1]==0xB5 && data[2]==0x2F && data[3]==0xFD) return InputCompressionZstd;
+	if(len>=2 && data[0]==0x1F && data[1]==0x8B) {
+		if(len>=18 && (data[3]&4) && data[10]==6 && data[11]==0 && data[12]=='B' && data[13]=='C' && data[14]==2 && data[15]==0) return InputCompressionBGZF;
+		return InputCompressionGzip;
+	}
+	return InputCompressionNone;
+}
+
+// Inflate gzip data, which may consist of several concatenated members, into text. Returns false, with the problem described in msg, if the data are invalid
+inline bool gunzip_input(const char* filename, const unsigned char *data, const size_t len, string &text, string &msg) {
+	z_stream zs;
+	memset(&zs,0,sizeof(zs));
+	// 15+32 window bits: the largest window, with automatic detection of the gzip header
+	if(inflateInit2(&zs,15+32)!=Z_OK) {
+		msg = "gunzip_input(): could not initialize gzip decompression";
+		return false;
+	}
+	text.resize((len<((size_t)1<<28)) ? 4*len+(1<<16) : len);
+	size_t in = 0, out = 0;
+	int ret = Z_OK;
+	while(true) {
+		if(out==text.size()) text.resize(2*text.size());
+		const size_t avail_in = (len-in<((size_t)1<<30)) ? len-in : ((size_t)1<<30);
+		const size_t avail_out = (text.size()-out<((size_t)1<<30)) ? text.size()-out : ((size_t)1<<30);
+		zs.next_in = (Bytef*)(data+in);
+		zs.avail_in = avail_in;
+		zs.next_out = (Bytef*)&text[out];
+		zs.avail_out = avail_out;
+		ret = inflate(&zs,Z_NO_FLUSH);
+		in += avail_in-zs.avail_in;
+		out += avail_out-zs.avail_out;
+		if(ret==Z_STREAM_END) {
+			// Skip any padding and continue with the next member, if any
+			while(in<len && data[in]==0) in++;
+			if(in==len) break;
+			inflateReset(&zs);
+		} else if(ret!=Z_OK && !(ret==Z_BUF_ERROR && zs.avail_out==0)) {
+			break;
+		} else if(in==len && zs.avail_out>0) {
+			break;
+		}
+	}
+	inflateEnd(&zs);
+	if(ret!=Z_STREAM_END) {
+		stringstream errTxt;
+		errTxt << "gunzip_input(): file " << filename << " is not valid or complete gzip data";
+		msg = errTxt.str();
+		return false;
+	}
+	text.resize(out);
+	return true;
+}
+
+/*	Inflate BGZF data. Every block is a gzip member of at most 64 kb, whose header gives its compressed size and whose
+	trailer gives its uncompressed size, so the blocks are located in one pass and then inflated in parallel. Returns false,
+	with the problem described in msg, if a block is invalid.	*/
+inline bool bgzf_input(const char* filename, const unsigned char *data, const size_t len, string &text, const int nthreads, string &msg) {
+	vector<size_t> block_in(0), block_out(0);
+	size_t in = 0, out = 0;
+	while(in<len) {
+		if(in+18>len || input_compression(data+in,len-in)!=InputCompressionBGZF) {
+			stringstream errTxt;
+			errTxt << "bgzf_input(): file " << filename << " has an invalid BGZF block at byte " << in;
+			msg = errTxt.str();
+			return false;
+		}
+		// BSIZE, the size of the block less one, follows the 'BC' subfield
+		const size_t block_len = (size_t)data[in+16]+((size_t)data[in+17]<<8)+1;
+		if(block_len<26 || in+block_len>len) {
+			stringstream errTxt;
+			errTxt << "bgzf_input(): file " << filename << " has a truncated BGZF block at byte " << in;
+			msg = errTxt.str();
+			return false;
+		}
+		const unsigned char *t = data+in+block_len-4;
+		const size_t isize = (size_t)t[0]|((size_t)t[1]<<8)|((size_t)t[2]<<16)|((size_t)t[3]<<24);
+		block_in.push_back(in);
+		block_out.push_back(out);
+		in += block_len;
+		out += isize;
+	}
+	const int nblocks = block_in.size();
+	block_in.push_back(len);
+	block_out.push_back(out);
+	text.resize(out);
+	vector<char> bad(nblocks,0);
+	parallel_for(nblocks,nthreads,[&](const int b) {
+		const unsigned char *block = data+block_in[b];
+		const size_t block_len = block_in[b+1]-block_in[b];
+		const size_t isize = block_out[b+1]-block_out[b];
+		// The compressed data follow the 12-byte header and 6-byte extra field, and precede the CRC and size
+		z_stream zs;
+		memset(&zs,0,sizeof(zs));
+		if(inflateInit2(&zs,-15)!=Z_OK) {
+			bad[b] = 1;
+			return;
+		}
+		zs.next_in = (Bytef*)(block+18);
+		zs.avail_in = block_len-26;
+		// zlib rejects a null output pointer, even for the empty block that ends a file
+		unsigned char empty;
+		zs.next_out = (isize>0) ? (Bytef*)&text[block_out[b]] : (Bytef*)&empty;
+		zs.avail_out = isize;
+		const int ret = inflate(&zs,Z_FINISH);
+		inflateEnd(&zs);
+		const unsigned char *t = block+block_len-8;
+		const unsigned long crc = (unsigned long)t[0]|((unsigned long)t[1]<<8)|((unsigned long)t[2]<<16)|((unsigned long)t[3]<<24);
+		if(ret!=Z_STREAM_END || zs.total_out!=isize || crc32(crc32(0L,Z_NULL,0),(const Bytef*)text.data()+block_out[b],isize)!=crc) bad[b] = 1;
+	});
+	int b;
+	for(b=0;b<nblocks;b++) {
+		if(bad[b]) {
+			stringstream errTxt;
+			errTxt << "bgzf_input(): file " << filename << " has a corrupt BGZF block at byte " << block_in[b];
+			msg = errTxt.str();
+			return false;
+		}
+	}
+	return true;
+}
+
+// Decompress Zstandard data, which may consist of several concatenated frames, into text. Returns false, with the problem described in msg, if the data are invalid
+inline bool unzstd_input(const char* filename, const unsigned char *data, const size_t len, string &text, string &msg) {
+#ifdef CFML_ZSTD
+	ZSTD_DStream *zds = ZSTD_createDStream();
+	if(zds==NULL) {
+		msg = "unzstd_input(): could not initialize Zstandard decompression";
+		return false;
+	}
+	text.resize(4*len+(1<<16));
+	ZSTD_inBuffer zin = {data,len,0};
+	size_t out = 0, ret = 0;
+	while(zin.pos<zin.size) {
+		if(out==text.size()) text.resize(2*text.size());
+		ZSTD_outBuffer zout = {&text[0],text.size(),out};
+		ret = ZSTD_decompressStream(zds,&zout,&zin);
+		out = zout.pos;
+		if(ZSTD_isError(ret)) {
+			ZSTD_freeDStream(zds);
+			stringstream errTxt;
+			errTxt << "unzstd_input(): file " << filename << " is not valid Zstandard data: " << ZSTD_getErrorName(ret);
+			msg = errTxt.str();
+			return false;
+		}
+	}
+	// Flush any output still held by the decoder
+	while(ret!=0) {
+		if(out==text.size()) text.resize(2*text.size());
+		ZSTD_outBuffer zout = {&text[0],text.size(),out};
+		const size_t before = out;
+		ret = ZSTD_decompressStream(zds,&zout,&zin);
+		out = zout.pos;
+		if(ZSTD_isError(ret) || (ret!=0 && out==before && out<text.size())) {
+			ZSTD_freeDStream(zds);
+			stringstream errTxt;
+			errTxt << "unzstd_input(): file " << filename << " is not complete Zstandard data";
+			msg = errTxt.str();
+			return false;
+		}
+	}
+	ZSTD_freeDStream(zds);
+	text.resize(out);
+	return true;
+#else
+	stringstream errTxt;
+	errTxt << "unzstd_input(): file " << filename << " is Zstandard compressed, which this build of ClonalFrameML does not support (make ZSTD=1)";
+	msg = errTxt.str();
+	return false;
+#endif
+}
+
+/*	The text of an input file, mapped into memory or, if the file is gzip, BGZF or Zstandard compressed, decompressed
+	into memory. BGZF files are decompressed by nthreads threads.	*/
+class InputFile {
+public:
+	const char *text;
+	size_t len;
+	InputCompression compression;
+protected:
+	void *map;
+	size_t map_len;
+	string decompressed;
+public:
+	InputFile() : text(NULL), len(0), compression(InputCompressionNone), map(NULL), map_len(0) {}
+	~InputFile() {
+		close();
+	}
+	/*	Returns false if the file cannot be opened, leaving msg empty, or cannot be read or decompressed, with the problem
+		described in msg. Nothing stops the program, so files may be opened by several threads at once.	*/
+	bool open(const char* filename, const int nthreads, string &msg) {
+		close();
+		msg = "";
+		const int fd = ::open(filename,O_RDONLY);
+		if(fd<0) return false;
+		struct stat st;
+		if(fstat(fd,&st)!=0) {
+			::close(fd);
+			stringstream errTxt;
+			errTxt << "InputFile::open(): could not determine the size of file " << filename;
+			msg = errTxt.str();
+			return false;
+		}
+		map_len = st.st_size;
+		if(map_len>0) {
+			map = mmap(NULL,map_len,PROT_READ,MAP_PRIVATE,fd,0);
+			if(map==MAP_FAILED) {
+				::close(fd);
+				map = NULL;
+				map_len = 0;
+				stringstream errTxt;
+				errTxt << "InputFile::open(): could not map file " << filename << " into memory";
+				msg = errTxt.str();
+				return false;
+			}
+		}
+		::close(fd);
+		const unsigned char *data = (const unsigned char*)map;
+		compression = input_compression(data,map_len);
+		if(compression==InputCompressionNone) {
+			text = (const char*)map;
+			len = map_len;
+			return true;
+		}
+		bool ok;
+		if(compression==InputCompressionGzip) ok = gunzip_input(filename,data,map_len,decompressed,msg);
+		else if(compression==InputCompressionBGZF) ok = bgzf_input(filename,data,map_len,decompressed,nthreads,msg);
+		else ok = unzstd_input(filename,data,map_len,decompressed,msg);
+		// The compressed file is no longer needed
+		munmap(map,map_len);
+		map = NULL;
+		map_len = 0;
+		if(!ok) {
+			close();
+			return false;
+		}
+		text = decompressed.data();
+		len = decompressed.size();
+		return true;
+	}
+	void close() {
+		if(map!=NULL) munmap(map,map_len);
+		map = NULL;
+		map_len = 0;
+		decompressed = string();
+		text = NULL;
+		len = 0;
+		compression = InputCompressionNone;
+	}
+};
+
+// A read-only stream buffer over text in memory, so that the text of an InputFile can be read through an istream
+class MemoryStreamBuffer : public std::streambuf {
+public:
+	MemoryStreamBuffer(const char *text, const size_t len) {
+		char *p = const_cast<char*>(text);
+		setg(p,p,p+len);
+	}
+};
+
+#endif // _INFILE_H_
@@ -18,8 +18,11 @@
  */
 #include "main.h"
 
+// cfml_bench includes this file to use the routines below without the program entry point
+#ifndef CFML_NO_MAIN
 int main (const int argc, const char* argv[]) {
-	clock_t start_time = clock();
+	// Start the wall and CPU clocks for the whole run
+	phase_timings();
 	cout << "ClonalFrameML " << ClonalFrameML_version << endl;
 	if (argc==2 && (strcmp(argv[1],"-version")==0||strcmp(argv[1],"-v")==0)) return 0;
 	// Process the command line arguments	
@@ -43,7 +46,11 @@ int main (const int argc, const char* argv[]) {
 		errTxt << "-chromosome_name               name, eg \"chr\"            Output importation status file in BED format using given chromosome name." << endl;
 		errTxt << "-min_branch_length             value > 0 (default 1e-7)  Minimum branch length." << endl;
 		errTxt << "-reconstruct_invariant_sites   true or false (default)   Reconstruct the ancestral states at invariant sites." << endl;
+		errTxt << "-output_posteriors             true or false (default)   Output the most probable base at every node and pattern with its marginal posterior probability, and the log-likelihood of every site." << endl;
 		errTxt << "-label_uncorrected_tree        true or false (default)   Regurgitate the uncorrected Newick tree with internal nodes labelled." << endl;
+		errTxt << "-threads                       value >= 1 (default 1)    Number of threads used by the parallelized routines." << endl;
+		errTxt << "-cache_file                    file                      Keep the preprocessed alignment in a binary file reused by later runs." << endl;
+		errTxt << "-compress_output               none (default), gzip or zstd   Compress the sequence and cross-reference output files (.gz or .zst)." << endl;
 		errTxt << "Options affecting -em and -embranch:" << endl;
 		errTxt << "-prior_mean                    df \"0.1 0.001 0.1 0.0001\" Prior mean for R/theta, 1/delta, nu and M." << endl;
 		errTxt << "-prior_sd                      df \"0.1 0.001 0.1 0.0001\" Prior standard deviation for R/theta, 1/delta, nu and M." << endl;
@@ -52,9 +59,15 @@ int main (const int argc, const char* argv[]) {
 		errTxt << "-emsim                         value >= 0  (default 0)   Number of simulations to estimate uncertainty in the EM results." << endl;
 		errTxt << "-embranch_dispersion           value > 0 (default .01)   Dispersion in parameters among branches in the -embranch model." << endl;
 		errTxt << "-output_filtered               true of false (default)   Output a filtered alignment including only non-recombinant sites." << endl;
+		errTxt << "-hmm_kernel                    scaled (default), mydouble or check   Arithmetic used by the forward-backward algorithm (check compares both)." << endl;
+		errTxt << "-em_accel                      squarem (default) or none Accelerate the EM algorithms by SQUAREM extrapolation, or use plain EM." << endl;
+		errTxt << "-checkpoint_steps              value >= 0 (default 0)    Save the state of the EM algorithm every so many steps (0: never)." << endl;
+		errTxt << "-checkpoint_seconds            value >= 0 (default 0)    Save the state of the EM algorithm every so many seconds (0: never)." << endl;
+		errTxt << "-resume                        true or false (default)   Resume the EM algorithm from the state saved by an interrupted run." << endl;
 		errTxt << "Options affecting -rescale_no_recombination:" << endl;
-		errTxt << "-brent_tolerance               tolerance (default .001)  Set the tolerance of the Brent routine for -rescale_no_recombination." << endl;
-		errTxt << "-powell_tolerance              tolerance (default .001)  Set the tolerance of the Powell routine for -rescale_no_recombination." << endl;
+		errTxt << "-branch_optimizer              newton (default) or powell   Maximize the likelihood of each branch by Newton-Raphson or by Powell's method." << endl;
+		errTxt << "-brent_tolerance               tolerance (default .001)  Set the tolerance of the Brent routine for -branch_optimizer powell." << endl;
+		errTxt << "-powell_tolerance              tolerance (default .001)  Set the tolerance of the Powell routine for -branch_optimizer powell." << endl;
 		cout << errTxt.str().c_str()<<endl;
 		return 0;
 	}
@@ -67,9 +80,13 @@ int main (const int argc, const char* argv[]) {
 	string fasta_out_file = string(out_file) + ".ML_sequence.fasta";
 	string fasta_filtered_file = string(out_file) + ".filtered.fasta";
 	string xref_out_file = string(out_file) + ".position_cross_reference.txt";
+	string posterior_out_file = string(out_file) + ".marginal_posterior.txt";
+	string site_loglik_out_file = string(out_file) + ".site_loglik.txt";
 	string import_out_file = string(out_file) + ".importation_status.txt";
 	string em_out_file = string(out_file) + ".em.txt";
 	string emsim_out_file = string(out_file) + ".emsim.txt";
+	string timings_out_file = string(out_file) + ".timings.json";
+	string em_checkpoint_file = string(out_file) + ".em_checkpoint";
 	// Set default options
 	ArgumentWizard arg;
 	arg.case_sensitive = false;
@@ -77,11 +94,19 @@ int main (const int argc, const char* argv[]) {
 	string use_incompatible_sites="true", rescale_no_recombination="false";
 	string show_progress="false";
 	string output_filtered="false";
+	string output_posteriors="false";
+	string string_hmm_kernel="scaled";
+	string string_em_accel="squarem";
+	string string_branch_optimizer="newton";
+	string cache_file="";
+	string resume="false";
+	string compress_output="none";
 	string string_prior_mean="0.1 0.001 0.1 0.0001", string_prior_sd="0.1 0.001 0.1 0.0001", string_initial_values = "0.1 0.001 0.05";
 	string guess_initial_m="true", em="true", embranch="false", label_original_tree="false", chr_name="";
 	double brent_tolerance = 1.0e-3, powell_tolerance = 1.0e-3, global_min_branch_length = 1.0e-7;
 	double embranch_dispersion = 0.01, kappa = 2.0;
-	int emsim = 0;
+	double checkpoint_seconds = 0.0;
+	int emsim = 0, nthreads = 1, checkpoint_steps = 0;
 	// Process options
 	arg.add_item("fasta_file_list",				TP_STRING, &fasta_file_list);
 	arg.add_item("xmfa_file",					TP_STRING, &xmfa_file);
@@ -107,6 +132,16 @@ int main (const int argc, const char* argv[]) {
 	arg.add_item("kappa",						TP_DOUBLE, &kappa);
 	arg.add_item("label_uncorrected_tree",		TP_STRING, &label_original_tree);
 	arg.add_item("output_filtered",				TP_STRING, &output_filtered);
+	arg.add_item("output_posteriors",			TP_STRING, &output_posteriors);
+	arg.add_item("threads",						TP_INT,	   &nthreads);
+	arg.add_item("hmm_kernel",					TP_STRING, &string_hmm_kernel);
+	arg.add_item("em_accel",					TP_STRING, &string_em_accel);
+	arg.add_item("branch_optimizer",			TP_STRING, &string_branch_optimizer);
+	arg.add_item("cache_file",					TP_STRING, &cache_file);
+	arg.add_item("checkpoint_steps",			TP_INT,	   &checkpoint_steps);
+	arg.add_item("checkpoint_seconds",			TP_DOUBLE, &checkpoint_seconds);
+	arg.add_item("resume",						TP_STRING, &resume);
+	arg.add_item("compress_output",				TP_STRING, &compress_output);
 	arg.read_input(argc-3,argv+3);
 	bool FASTA_FILE_LIST				= string_to_bool(fasta_file_list,				"fasta_file_list");
 	bool XMFA_FILE						= string_to_bool(xmfa_file,						"xmfa_file");
@@ -121,7 +156,9 @@ int main (const int argc, const char* argv[]) {
 	bool EMBRANCH						= string_to_bool(embranch,						"embranch");
 	bool LABEL_ORIGINAL_TREE			= string_to_bool(label_original_tree,			"label_uncorrected_tree");
 	bool OUTPUT_FILTERED				= string_to_bool(output_filtered,				"output_filtered");
-	bool MULTITHREAD = false;
+	bool OUTPUT_POSTERIORS				= string_to_bool(output_posteriors,				"output_posteriors");
+	bool USE_CACHE						= (cache_file!="");
+	bool RESUME							= string_to_bool(resume,						"resume");
 	if(brent_tolerance<=0.0 || brent_tolerance>=0.1) {
 		stringstream errTxt;
 		errTxt << "brent_tolerance value out of range (0,0.1], default 0.001";
@@ -146,12 +183,40 @@ int main (const int argc, const char* argv[]) {
 	if(CORRECT_BRANCH_LENGTHS && !(RESCALE_NO_RECOMBINATION || EM || EMBRANCH)) {
 		error("One of -em, -embranch or -rescale_no_recombination must be specified when imputation_only=false");
 	}
-	if(MULTITHREAD) {
-		cout << "WARNING: multithreaded version not implemented, ignoring." << endl;
-	}
 	if(global_min_branch_length<=0.0) {
 		error("Minimum branch length must be positive");
 	}
+	if(nthreads<1) error("-threads must be at least 1");
+	HMMKernel hmm_kernel;
+	if(string_hmm_kernel=="scaled") hmm_kernel = HMMKernelScaled;
+	else if(string_hmm_kernel=="mydouble") hmm_kernel = HMMKernelMydouble;
+	else if(string_hmm_kernel=="check") hmm_kernel = HMMKernelCheck;
+	else error("-hmm_kernel must be scaled, mydouble or check");
+	EMAccelerator em_accel;
+	if(string_em_accel=="squarem") em_accel = EMAcceleratorSQUAREM;
+	else if(string_em_accel=="none") em_accel = EMAcceleratorNone;
+	else error("-em_accel must be squarem or none");
+	BranchOptimizer branch_optimizer;
+	if(string_branch_optimizer=="newton") branch_optimizer = BranchOptimizerNewton;
+	else if(string_branch_optimizer=="powell") branch_optimizer = BranchOptimizerPowell;
+	else error("-branch_optimizer must be newton or powell");
+	// The large output files are compressed according to the extension added to their names
+	OutputCompression output_compression_mode;
+	if(compress_output=="none") output_compression_mode = OutputCompressionNone;
+	else if(compress_output=="gzip") output_compression_mode = OutputCompressionGzip;
+	else if(compress_output=="zstd") output_compression_mode = OutputCompressionZstd;
+	else error("-compress_output must be none, gzip or zstd");
+	if(!output_compression_available(output_compression_mode)) error("-compress_output zstd requires ClonalFrameML to be built with Zstandard support (make ZSTD=1)");
+	fasta_out_file += output_compression_extension(output_compression_mode);
+	xref_out_file += output_compression_extension(output_compression_mode);
+	fasta_filtered_file += output_compression_extension(output_compression_mode);
+	posterior_out_file += output_compression_extension(output_compression_mode);
+	site_loglik_out_file += output_compression_extension(output_compression_mode);
+	if(checkpoint_steps<0) error("-checkpoint_steps cannot be negative");
+	if(checkpoint_seconds<0.0) error("-checkpoint_seconds cannot be negative");
+	// The state of the EM algorithms is saved to, and resumed from, a file next to the output
+	EMCheckpoint em_checkpoint(em_checkpoint_file,checkpoint_steps,checkpoint_seconds,RESUME);
+	const bool EM_CHECKPOINT			= (checkpoint_steps>0 || checkpoint_seconds>0.0 || RESUME);
 	// Process the prior mean and standard deviation
 	vector<double> prior_mean(0), prior_sd(0);
 	stringstream sstream_prior_mean;
@@ -195,65 +260,58 @@ int main (const int argc, const char* argv[]) {
 	if(emsim>0 && !(EM || EMBRANCH)) error("-emsim only applicable with -em or -embranch");
 	if(embranch_dispersion<=0.0) error("-embranch_dispersion must be positive");
 	if(kappa<=0.0) error("-kappa must be positive");
+	if(USE_CACHE && FASTA_FILE_LIST) error("-cache_file cannot be used with -fasta_file_list");
 	
 	// Open the FASTA file(s)
-	vector<int> sites_to_ignore;
-	DNA fa;
-	if(FASTA_FILE_LIST) {
+	vector<SiteInterval> sites_to_ignore;
+	EncodedAlignment fa;
+	// If requested, take the alignment and the results of compute_compatibility from the cache file
+	AlignmentCache cache(cache_file,(XMFA_FILE) ? 1 : 0);
+	vector<bool> anyN;
+	vector<int> compat;
+	TimedPhase timed_read("read_alignment");
+	const bool CACHED = USE_CACHE && cache.read(fasta_file,newick_file,fa,sites_to_ignore,compat,anyN);
+	if(CACHED) {
+		// The alignment has been read from the cache file
+	} else if(FASTA_FILE_LIST) {
 		ifstream file_list(fasta_file);
 		if(!file_list.is_open()) {
 			stringstream errTxt;
 			errTxt << "could not find file " << fasta_file;
 			error(errTxt.str().c_str());
 		}
-		int n = 0;
-		int L = -1;
-		while(!file_list.eof()) {
-			string filename;
-			file_list >> filename;
-			// Pre-check: does it exist?
-			ifstream file_list1(filename.c_str());
-			if(!file_list1.is_open()) {
-				stringstream errTxt;
-				errTxt << "could not find listed file " << fasta_file;
-				error(errTxt.str().c_str());
-			}
-			// Read the file
-			DNA fa1(filename.c_str());
-			n += fa1.nseq;
-			if(L==-1) L = fa1.lseq;
-			if(fa1.lseq!=L) {
-				stringstream errTxt;
-				errTxt << "listed file " << fasta_file << " had sequence length " << fa1.lseq << " expecting " << L;
-				error(errTxt.str().c_str());
-			}
-			// Add to list
-			int ni;
-			for(ni=0;ni<fa1.nseq;ni++) {
-				fa.label.push_back(fa1.label[ni]);
-				fa.sequence.push_back(fa1.sequence[ni]);
-				fa.nseq++;
-				fa.ntimes.push_back(fa1.ntimes[ni]);
-			}
-		}
-	} else if (XMFA_FILE) readXMFA(fasta_file,&fa,&sites_to_ignore);
-	else {
-		fa.readFASTA_1pass(fasta_file);
+		// Whitespace, including a trailing newline, separates the listed files
+		vector<string> filenames(0);
+		string filename;
+		while(file_list >> filename) filenames.push_back(filename);
+		fa.read_FASTA_list(filenames,nthreads);
+	} else if (XMFA_FILE) {
+		DNA fatext;
+		readXMFA(fasta_file,&fatext,&sites_to_ignore,nthreads);
+		fa.encode(fatext);
+	} else {
+		// Map (or decompress) the file and encode it directly, without holding the sequences as text
+		fa.read_FASTA(fasta_file,nthreads);
 	}
-	cout << "Read " << fa.nseq << " sequences of length " << fa.lseq << " sites from " << fasta_file << endl;
+	timed_read.stop();
+	cout << "Read " << fa.nseq << " sequences of length " << fa.lseq << " sites from " << ((CACHED) ? cache_file.c_str() : fasta_file) << endl;
 	// Open the Newick file and convert to internal rooted tree format, outputting the names of the tips and internal nodes
+	TimedPhase timed_newick("read_newick");
 	NewickTree newick = read_Newick(newick_file);
 	vector<string> ctree_node_labels;
 	const bool is_rooted = (newick.root.dec.size()==2);
 	marginal_tree ctree = (is_rooted) ? convert_rooted_NewickTree_to_marginal_tree(newick,fa.label,ctree_node_labels) : convert_unrooted_NewickTree_to_marginal_tree(newick,fa.label,ctree_node_labels);
 	const int root_node = (is_rooted) ? ctree.size-1 : ctree.size-2;
+	timed_newick.stop();
 	// If requested, regurgitate the input tree with the internal nodes labelled, before anything is done to the branch lengths
 	if(LABEL_ORIGINAL_TREE) {
 		write_newick(ctree,ctree_node_labels,oritree_out_file.c_str());
 	}
 	// Open the list of sites to ignore
 	vector<bool> ignore_site(fa.lseq,false);
-	for (int i=0;i<sites_to_ignore.size();i++) ignore_site[sites_to_ignore[i]]=true;
+	for (int i=0;i<sites_to_ignore.size();i++) {
+		for (int j=sites_to_ignore[i].beg;j<sites_to_ignore[i].end;j++) ignore_site[j]=true;
+	}
 	if(ignore_user_sites!="") {
 		ifstream user_sites(ignore_user_sites.c_str());
 		int debug_last_elem = -1;
@@ -273,8 +331,10 @@ int main (const int argc, const char* argv[]) {
 	
 	// Compute compatibility and test every site for any sequences with 'N','-','X' or '?'
 	// Key to results: -1: invariant, 0: compatible biallelic (including singletons), 1: incompatible biallelic, 2: more than two alleles
-	vector<bool> anyN;
-	vector<int> compat = compute_compatibility(fa,ctree,anyN,false);
+	if(!CACHED) {
+		TimedPhase timed("compute_compatibility");
+		compat = compute_compatibility(fa,ctree,anyN,false,nthreads);
+	}
 	if(IGNORE_INCOMPLETE_SITES) {
 		for(i=0;i<fa.lseq;i++) {
 			if(anyN[i]) ignore_site[i] = true;
@@ -302,16 +362,6 @@ int main (const int argc, const char* argv[]) {
 	}
 	
 	// IMPUTATION AND RECONSTRUCTION OF ANCESTRAL STATES
-	// Convert FASTA file to internal representation of nucleotides for Branch Length Correction
-	vector<double> empirical_nucleotide_frequencies(4,0.25);
-	Matrix<Nucleotide> nuc = FASTA_to_nucleotide(fa,empirical_nucleotide_frequencies,isIRAS);
-	// Identify and count unique patterns
-	vector<string> pat;				// Pattern as string of AGCTNs
-	vector<int> pat1, cpat, ipat;	// First example of each pattern, number of sites with that pattern, the pattern at each (compatible) site (-1 otherwise)
-	vector<bool> nuc_ispoly(nuc.ncols(),true);
-	find_alignment_patterns(nuc,nuc_ispoly,pat,pat1,cpat,ipat);
-	// Storage for the MLE of the nucleotide sequence at every node
-	Matrix<Nucleotide> node_nuc;
 	// Sanity check: are all branch lengths non-negative
 	for(i=0;i<ctree_node_labels.size();i++) {
 		if(ctree.node[i].edge_time<0.0) {
@@ -320,8 +370,17 @@ int main (const int argc, const char* argv[]) {
 			error(errTxt.str().c_str());
 		}
 	}
+	vector<int> pat1, cpat, ipat;	// First example of each pattern (alignment position), number of sites with that pattern, the pattern at each site in use
+	vector<double> empirical_nucleotide_frequencies(4,0.25);
+	// Storage for the MLE of the nucleotide sequence at every node
+	Matrix<Nucleotide> node_nuc;
 	// Begin by computing the joint maximum likelihood ancestral sequences
-	mydouble ML = maximum_likelihood_ancestral_sequences(nuc,ctree,kappa,empirical_nucleotide_frequencies,pat1,cpat,node_nuc);
+	mydouble ML = reconstruct_ancestral_sequences(fa,isIRAS,ctree,kappa,USE_CACHE ? &cache : NULL,pat1,cpat,ipat,empirical_nucleotide_frequencies,node_nuc,nthreads);
+	if(USE_CACHE && !CORRECT_BRANCH_LENGTHS && cache.modified) {
+		TimedPhase timed("write_cache");
+		cache.write(fa,sites_to_ignore,compat,anyN);
+		cout << "Wrote preprocessed alignment to cache file " << cache_file << endl;
+	}
 	
 	cout << "IMPUTATION AND RECONSTRUCTION OF ANCESTRAL STATES:" << endl;
 	cout << "Analysing " << nIRAS << " sites" << endl;
@@ -332,26 +391,52 @@ int main (const int argc, const char* argv[]) {
 	cout << "Maximum log-likelihood for imputation and ancestral state reconstruction = " << ML.LOG() << endl;
 	
 	// Output the ML reconstructed sequences
-	write_ancestral_fasta(node_nuc, ctree_node_labels, fasta_out_file.c_str());
+	TimedPhase timed_ancestral_fasta("write_ancestral_fasta");
+	write_ancestral_fasta(node_nuc, ctree_node_labels, fasta_out_file.c_str(), nthreads);
+	timed_ancestral_fasta.stop();
 	// For every position in the original FASTA file, output the corresponding position in the output FASTA file, or -1 (not included)
+	TimedPhase timed_xref("write_position_cross_reference");
 	write_position_cross_reference(isIRAS, ipat, xref_out_file.c_str());
+	timed_xref.stop();
 	cout << "Wrote imputed and reconstructed ancestral states to " << fasta_out_file << endl;
 	cout << "Wrote position cross-reference file to " << xref_out_file << endl;
+	// If requested, compute the marginal posterior probabilities of the ancestral states, pattern by pattern as for the joint reconstruction
+	if(OUTPUT_POSTERIORS) {
+		TimedPhase timed_marginal("marginal_reconstruction");
+		vector<bool> ispat1(fa.lseq,false);
+		for(i=0;i<pat1.size();i++) ispat1[pat1[i]] = true;
+		vector<double> pattern_frequencies(4);
+		const Matrix<Nucleotide> nuc = FASTA_to_nucleotide(fa,pattern_frequencies,ispat1);
+		Matrix<Nucleotide> max_base;
+		Matrix<float> max_posterior;
+		vector<double> pattern_loglik;
+		const mydouble marginal_ML = marginal_ancestral_posteriors(nuc,ctree,kappa,empirical_nucleotide_frequencies,cpat,max_base,max_posterior,pattern_loglik,nthreads);
+		timed_marginal.stop();
+		cout << "Marginal log-likelihood for imputation and ancestral state reconstruction = " << marginal_ML.LOG() << endl;
+		TimedPhase timed("write_marginal_posteriors");
+		write_marginal_posteriors(max_base,max_posterior,ctree_node_labels,posterior_out_file.c_str());
+		write_site_loglik(isIRAS,ipat,pattern_loglik,site_loglik_out_file.c_str());
+		cout << "Wrote marginal posterior probabilities to " << posterior_out_file << endl;
+		cout << "Wrote per-site marginal log-likelihoods to " << site_loglik_out_file << endl;
+	}
 	
 	// BRANCH LENGTH CORRECTION
 	if(CORRECT_BRANCH_LENGTHS) {
-		// Convert FASTA file to internal representation of nucleotides for Branch Length Correction
+		TimedPhase timed_blc("branch_length_correction");
+		vector<int> pat1, cpat, ipat;	// First example of each pattern (alignment position), number of sites with that pattern, the pattern at each site in use
 		vector<double> empirical_nucleotide_frequencies(4,0.25);
-		Matrix<Nucleotide> nuc = FASTA_to_nucleotide(fa,empirical_nucleotide_frequencies,isBLC);
-		// Identify and count unique patterns
-		vector<string> pat;				// Pattern as string of AGCTNs
-		vector<int> pat1, cpat, ipat;	// First example of each pattern, number of sites with that pattern, the pattern at each (compatible) site (-1 otherwise)
-		vector<bool> nuc_ispoly(nuc.ncols(),true);
-		find_alignment_patterns(nuc,nuc_ispoly,pat,pat1,cpat,ipat);
 		// Storage for the MLE of the nucleotide sequence at every node
 		Matrix<Nucleotide> node_nuc;
 		// Begin by computing the joint maximum likelihood ancestral sequences
-		mydouble ML = maximum_likelihood_ancestral_sequences(nuc,ctree,kappa,empirical_nucleotide_frequencies,pat1,cpat,node_nuc);
+		mydouble ML = reconstruct_ancestral_sequences(fa,isBLC,ctree,kappa,USE_CACHE ? &cache : NULL,pat1,cpat,ipat,empirical_nucleotide_frequencies,node_nuc,nthreads);
+		if(USE_CACHE && cache.modified) {
+			TimedPhase timed("write_cache");
+			cache.write(fa,sites_to_ignore,compat,anyN);
+			cout << "Wrote preprocessed alignment to cache file " << cache_file << endl;
+		}
+
+		// Summarize every branch once for all the analyses
+		const vector<BranchSummary> branch_summary = summarize_branches(ctree,node_nuc,cpat,root_node,nthreads);
 
 		cout << "BRANCH LENGTH CORRECTION/RECOMBINATION ANALYSIS:" << endl;
 		cout << "Analysing " << nBLC << " sites" << endl;
@@ -365,40 +450,52 @@ int main (const int argc, const char* argv[]) {
 			cout << "B   uncorrected branch length" << endl;
 			cout << "L   maximum log-likelihood per branch" << endl;
 			cout << "M   corrected branch length/expected number of mutations     (> 0)" << endl;
-			double ML = 0.0;
-			for(i=0;i<root_node;i++) {
+			// The branches are independent, so they are optimized concurrently, each with its own objective function and
+			// optimizer, and the progress of each is buffered so that it is reported in the order of the branches
+			vector<double> initial_branch_length(root_node), final_branch_length(root_node), branch_ML(root_node);
+			vector<string> branch_progress(root_node);
+			// Beyond this branch length the transition probabilities are indistinguishable from the equilibrium frequencies
+			const double max_branch_length = 100.0;
+			parallel_for(root_node,nthreads,[&](const int i) {
+				// The likelihood depends on the data only through the counts of ancestral and descendant nucleotide pairs
+				const Matrix<double> &count = branch_summary[i].count;
 				// Crudely re-estimate branch length
-				double pd = 1.0, pd_den = 2.0;
-				const int dec_id = ctree.node[i].id;
-				const int anc_id = ctree.node[i].ancestor->id;
-				int j,k;
-				for(j=0,k=0;j<isBLC.size();j++) {
-					if(isBLC[j]) {
-						Nucleotide dec = node_nuc[dec_id][ipat[k]];
-						Nucleotide anc = node_nuc[anc_id][ipat[k]];
-						if(dec!=anc) ++pd;
-						++pd_den;
-						++k;
-					}
-				}
-				const double initial_branch_length = pd/pd_den;
+				initial_branch_length[i] = branch_summary[i].initial_branch_length;
 				// Minimum branch length
 				const double min_branch_length = global_min_branch_length;
-				ClonalFrameRescaleBranchFunction cff(ctree.node[i],node_nuc,pat1,cpat,kappa,empirical_nucleotide_frequencies,MULTITHREAD,initial_branch_length,min_branch_length);
+				if(branch_optimizer==BranchOptimizerNewton) {
+					int niter;
+					final_branch_length[i] = maximum_likelihood_branch_length(count,kappa,empirical_nucleotide_frequencies,initial_branch_length[i],min_branch_length,max_branch_length,branch_ML[i],niter);
+					if(SHOW_PROGRESS) {
+						stringstream progress;
+						progress << "Newton-Raphson maximized the log-likelihood at M = " << final_branch_length[i] << " in " << niter << " iterations" << endl;
+						branch_progress[i] = progress.str();
+					}
+					return;
+				}
+				ClonalFrameRescaleBranchFunction cff(ctree.node[i],count,kappa,empirical_nucleotide_frequencies,nthreads>1,initial_branch_length[i],min_branch_length);
 				// Setup optimization function
 				Powell Pow(cff);
+				stringstream progress;
 				Pow.coutput = Pow.brent.coutput = SHOW_PROGRESS;
+				Pow.outstream = Pow.brent.outstream = &progress;
 				Pow.TOL = brent_tolerance;
 				// Estimate parameter
-				vector<double> param(1,log10(initial_branch_length));
+				vector<double> param(1,log10(initial_branch_length[i]));
 				param = Pow.minimize(param,powell_tolerance);
-				double final_branch_length = pow(10.,param[0]);
-				if(final_branch_length<min_branch_length) final_branch_length = min_branch_length;
+				final_branch_length[i] = pow(10.,param[0]);
+				if(final_branch_length[i]<min_branch_length) final_branch_length[i] = min_branch_length;
+				branch_ML[i] = -Pow.function_minimum;
+				branch_progress[i] = progress.str();
+			});
+			double ML = 0.0;
+			for(i=0;i<root_node;i++) {
 				// Update branch length in the output tree
 				// Note this is unsafe in general because the corresponding node times are not adjusted
-				ctree.node[i].edge_time = final_branch_length;
-				cout << "Branch " << ctree_node_labels[i] << " B = " << initial_branch_length << " L = " << -Pow.function_minimum << " M = " << final_branch_length << endl;
-				ML += -Pow.function_minimum;
+				ctree.node[i].edge_time = final_branch_length[i];
+				cout << branch_progress[i];
+				cout << "Branch " << ctree_node_labels[i] << " B = " << initial_branch_length[i] << " L = " << branch_ML[i] << " M = " << final_branch_length[i] << endl;
+				ML += branch_ML[i];
 			}
 			cout << "Log-likelihood after branch optimization is " << ML << endl;
 		} else if(EM) {
@@ -413,7 +510,7 @@ int main (const int argc, const char* argv[]) {
 			cout << "D   divergence of DNA imported by recombination              (> 0)" << endl;			
 			cout << "M   expected number of mutations per branch                  (> 0)" << endl;
 			double ML = 0.0;
-			vector< vector<ImportationState> > is_imported(root_node);
+			vector< vector<ImportedInterval> > is_imported(root_node);
 			// Calculate the a and b parameters of the priors
 			vector<double> prior_a(4), prior_b(4);
 			for(i=0;i<4;i++) {
@@ -430,11 +527,16 @@ int main (const int argc, const char* argv[]) {
 			param[1] = 1.0/initial_values[1];
 			param[2] = initial_values[2];
 			// Do inference
-			clock_t pow_start_time = clock();
-			ClonalFrameBaumWelch cff(ctree,node_nuc,isBLC,ipat,kappa,empirical_nucleotide_frequencies,is_imported,prior_a,prior_b,root_node,GUESS_INITIAL_M,SHOW_PROGRESS);
+			const double pow_start_time = phase_timings().wall_time();
+			ClonalFrameBaumWelch cff(ctree,node_nuc,isBLC,ipat,branch_summary,kappa,empirical_nucleotide_frequencies,is_imported,prior_a,prior_b,root_node,GUESS_INITIAL_M,SHOW_PROGRESS,nthreads,hmm_kernel,em_accel);
+			if(EM_CHECKPOINT) cff.checkpoint = &em_checkpoint;
 			param = cff.maximize_likelihood(param);
 			ML = cff.ML;
-			cout << " L = " << ML << " P = " << cff.priorL << " R = " << param[0] << " I = " << param[1] << " D = " << param[2] << " in " << (double)(clock()-pow_start_time)/CLOCKS_PER_SEC << " s and " << cff.neval << " evaluations" << endl;
+			if(EM_CHECKPOINT) em_checkpoint.remove();
+			cout << " L = " << ML << " P = " << cff.priorL << " R = " << param[0] << " I = " << param[1] << " D = " << param[2] << " in " << (phase_timings().wall_time()-pow_start_time) << " s and " << cff.neval << " evaluations" << endl;
+			cout << " EM steps: " << cff.em_iterations.steps;
+			if(em_accel==EMAcceleratorSQUAREM) cout << " (SQUAREM extrapolations: " << cff.em_iterations.extrapolations << " accepted, " << cff.em_iterations.rejected << " rejected)";
+			cout << endl;
 			cout << " Posterior alphas: R = " << cff.posterior_a[0] << " I = " << cff.posterior_a[1] << " D = " << cff.posterior_a[2] << endl;
 			const double cfmlLLR = ML-cff.priorL-cff.ML0;
 			if(cfmlLLR>6.0) {
@@ -466,10 +568,13 @@ int main (const int argc, const char* argv[]) {
 			}
 			vout.close();
 			// Output the importation status
+			TimedPhase timed_import("write_importation_status");
 			write_importation_status_intervals(is_imported,ctree_node_labels,isBLC,compat,import_out_file.c_str(),root_node,chr_name.c_str());
+			timed_import.stop();
 			cout << "Wrote inferred importation status to " << import_out_file << endl;
 			if (OUTPUT_FILTERED) {			
 				// Output the filtered alignment
+				TimedPhase timed("write_filtered_fasta");
 				write_filtered_fasta(is_imported, &fa, ignore_site, fasta_filtered_file.c_str());
 				cout << "Wrote filtered alignment to " << fasta_filtered_file << endl;
 			}
@@ -497,7 +602,7 @@ int main (const int argc, const char* argv[]) {
 			cout << "D   divergence of DNA imported by recombination              (> 0)" << endl;			
 			cout << "M   expected number of mutations per branch                  (> 0)" << endl;
 			double ML = 0.0;
-			vector< vector<ImportationState> > is_imported(root_node);
+			vector< vector<ImportedInterval> > is_imported(root_node);
 			// Calculate the a and b parameters of the priors
 			vector<double> prior_a(5), prior_b(5);
 			for(i=0;i<4;i++) {
@@ -518,12 +623,17 @@ int main (const int argc, const char* argv[]) {
 			param[2] = initial_values[2];
 			param[3] = 1.0e-5;
 			// Do inference
-			clock_t pow_start_time = clock();
-			ClonalFrameBaumWelchRhoPerBranch cff(ctree,node_nuc,isBLC,ipat,kappa,empirical_nucleotide_frequencies,is_imported,prior_a,prior_b,root_node,GUESS_INITIAL_M,SHOW_PROGRESS);
+			const double pow_start_time = phase_timings().wall_time();
+			ClonalFrameBaumWelchRhoPerBranch cff(ctree,node_nuc,isBLC,ipat,branch_summary,kappa,empirical_nucleotide_frequencies,is_imported,prior_a,prior_b,root_node,GUESS_INITIAL_M,SHOW_PROGRESS,nthreads,hmm_kernel,em_accel);
+			if(EM_CHECKPOINT) cff.checkpoint = &em_checkpoint;
 			cff.maximize_likelihood(param);
 			ML = cff.ML;
+			if(EM_CHECKPOINT) em_checkpoint.remove();
 			cout << "Mean parameters:" << endl;
-			cout << " L = " << ML << " R = " << cff.mean_param[0] << " I = " << 1.0/cff.mean_param[1] << " D = " << cff.mean_param[2] << " M = " << cff.mean_param[3] << " in " << (double)(clock()-pow_start_time)/CLOCKS_PER_SEC << " s and " << cff.neval << " evaluations" << endl;
+			cout << " L = " << ML << " R = " << cff.mean_param[0] << " I = " << 1.0/cff.mean_param[1] << " D = " << cff.mean_param[2] << " M = " << cff.mean_param[3] << " in " << (phase_timings().wall_time()-pow_start_time) << " s and " << cff.neval << " evaluations" << endl;
+			cout << " EM steps: " << cff.em_iterations.steps;
+			if(em_accel==EMAcceleratorSQUAREM) cout << " (SQUAREM extrapolations: " << cff.em_iterations.extrapolations << " accepted, " << cff.em_iterations.rejected << " rejected)";
+			cout << endl;
 			cout << "Parameters per branch:" << endl;
 			for(i=0;i<root_node;i++) {
 				if(cff.informative[i]) {
@@ -553,10 +663,13 @@ int main (const int argc, const char* argv[]) {
 			}
 			vout.close();
 			// Output the importation status
+			TimedPhase timed_import("write_importation_status");
 			write_importation_status_intervals(is_imported,ctree_node_labels,isBLC,compat,import_out_file.c_str(),root_node,chr_name.c_str());
+			timed_import.stop();
 			cout << "Wrote inferred importation status to " << import_out_file << endl;
 			if (OUTPUT_FILTERED) {
 				// Output the filtered alignment
+				TimedPhase timed("write_filtered_fasta");
 				write_filtered_fasta(is_imported, &fa, ignore_site, fasta_filtered_file.c_str());
 				cout << "Wrote filtered alignment to " << fasta_filtered_file << endl;
 			}
@@ -579,12 +692,24 @@ int main (const int argc, const char* argv[]) {
 	}
 	
 	// Output the tree with internal nodes automatically labelled, for cross-referencing with the reconstructed sequences
+	TimedPhase timed_newick_out("write_newick");
 	write_newick(ctree,ctree_node_labels,tree_out_file.c_str());
+	timed_newick_out.stop();
 	cout << "Wrote processed tree to " << tree_out_file << endl;
 	
-	cout << "All done in " << (double)(clock()-start_time)/CLOCKS_PER_SEC/60.0 << " minutes." << endl;
+	// Output the wall time, CPU time, peak memory and number of calls of every phase
+	if(!phase_timings().write_json(timings_out_file.c_str(),ClonalFrameML_version,nthreads)) {
+		stringstream wrnTxt;
+		wrnTxt << "could not open file " << timings_out_file << " for writing";
+		warning(wrnTxt.str().c_str());
+	} else {
+		cout << "Wrote timings to " << timings_out_file << endl;
+	}
+	
+	cout << "All done in " << phase_timings().wall_time()/60.0 << " minutes." << endl;
 	return 0;
 }
+#endif // CFML_NO_MAIN
 
 marginal_tree convert_rooted_NewickTree_to_marginal_tree(NewickTree &newick, vector<string> &tip_labels, vector<string> &all_node_labels) {
 	size_t i;
@@ -976,7 +1101,7 @@ marginal_tree convert_unrooted_NewickTree_to_marginal_tree(NewickTree &newick, v
 }
 
 
-vector<int> compute_compatibility(DNA &fa, marginal_tree &ctree, vector<bool> &anyN, bool purge_singletons) {
+vector<int> compute_compatibility(const EncodedAlignment &fa, marginal_tree &ctree, vector<bool> &anyN, bool purge_singletons, const int nthreads) {
 	// Sample size
 	const int n = fa.nseq;
 	// Sequence length
@@ -984,119 +1109,94 @@ vector<int> compute_compatibility(DNA &fa, marginal_tree &ctree, vector<bool> &a
 	
 	// Results of initial incompatibility test: -1 (invariant or singleton, compatible), 0 (2 alleles, not tested), 2 (>2 alleles, incompatible)
 	vector<int> iscompat(L,0);
-	anyN = vector<bool>(L,false);
-	// Convert FASTA file to binary: if more than two alleles mark as incompatible: -1 (uninitialized), 0 (reference allele), 1 (first non-reference allele), 2 (second non-reference allele)
-	// Let -2 be a no-call (N)
-	Matrix<int> bip(n,L,-1);
-	int i,pos;
-	for(pos=0;pos<L;pos++) {		
-		char* allele0 = NULL;
-		int nallele0 = 0;
-		char* allele1 = NULL;
-		int nallele1 = 0;
-		for(i=0;i<n;i++) {
-			if(fa[i][pos]!='N' && fa[i][pos]!='-' && fa[i][pos]!='X' && fa[i][pos]!='?') {
-				// If not an N
-				if(allele0==NULL) {
-					allele0 = new char(fa[i][pos]);
-					bip[i][pos] = 0;
-					++nallele0;
-				} else {
-					if(fa[i][pos]==*allele0) {
-						bip[i][pos] = 0;
+	// Record sites with any N per site as chars so that threads can write to them independently
+	vector<char> siteN(L,0);
+	
+	// Encode the branches of the clonal frame as bitsets over the tips: bit j of branch k is set if tip j descends from node k
+	// Nodes are ordered tips first, then in ascending time order towards the root, so descendants are always encoded before ancestors
+	const int nwords = (n+63)/64;
+	const int nnodes = 2*n-1;
+	vector<unsigned long long> treebip((size_t)nnodes*nwords,0ULL);
+	int i,k,w;
+	for(i=0;i<n;i++) treebip[(size_t)i*nwords+i/64] |= 1ULL << (i%64);
+	for(k=n;k<nnodes;k++) {
+		const mt_node* d0 = ctree.node[k].descendant[0];
+		const mt_node* d1 = ctree.node[k].descendant[1];
+		if(d0==NULL || d1==NULL) {
+			stringstream errTxt;
+			errTxt << "compute_compatibility(): null pointer to descendant of node " << k;
+			error(errTxt.str().c_str());
+		}
+		for(w=0;w<nwords;w++) treebip[(size_t)k*nwords+w] = treebip[(size_t)d0->id*nwords+w] | treebip[(size_t)d1->id*nwords+w];
+	}
+	
+	// Process the alignment in blocks of sites in parallel
+	const int block_size = 4096;
+	const int nblocks = (L+block_size-1)/block_size;
+	parallel_for(nblocks,nthreads,[&](const int block) {
+		// Bitsets of the tips carrying the reference allele (0) and the first non-reference allele (1). No-calls (N) are in neither.
+		vector<unsigned long long> allele0_bits(nwords), allele1_bits(nwords);
+		const int beg = block*block_size;
+		const int end = (beg+block_size<L) ? beg+block_size : L;
+		int i,k,w,pos;
+		for(pos=beg;pos<end;pos++) {
+			for(w=0;w<nwords;w++) allele0_bits[w] = allele1_bits[w] = 0ULL;
+			// Alleles are compared by their codes, which correspond one-to-one with the characters in the alignment
+			const unsigned char *row = fa.site(pos);
+			unsigned char allele0 = 0, allele1 = 0;
+			int nallele0 = 0, nallele1 = 0;
+			for(i=0;i<n;i++) {
+				const unsigned char base = (i%2) ? (row[i/2]>>4) : (row[i/2]&15);
+				if(!((alignment_code_missing>>base)&1)) {
+					// If not an N
+					if(nallele0==0 || base==allele0) {
+						allele0 = base;
+						allele0_bits[i/64] |= 1ULL << (i%64);
 						++nallele0;
+					} else if(nallele1==0 || base==allele1) {
+						allele1 = base;
+						allele1_bits[i/64] |= 1ULL << (i%64);
+						++nallele1;
 					} else {
-						if(allele1==NULL) {
-							allele1 = new char(fa[i][pos]);
-							bip[i][pos] = 1;
-							++nallele1;
-						} else {
-							if(fa[i][pos]==*allele1) {
-								bip[i][pos] = 1;
-								++nallele1;
-							} else {
-								bip[i][pos] = 2;
-								iscompat[pos] = 2;
-								break;
-							}
-						}
+						iscompat[pos] = 2;
+						break;
 					}
+				} else {
+					// If an N
+					siteN[pos] = 1;
 				}
-			} else {
-				// If an N
-				anyN[pos] = true;
-				bip[i][pos] = -2;
 			}
-		}
-		if(iscompat[pos]==0) {
-			if(allele0==NULL || allele1==NULL) {
+			if(iscompat[pos]!=0) continue;
+			if(nallele0==0 || nallele1==0) {
 				// Invariant site (or all Ns): must be compatible
 				iscompat[pos] = -1;
 			} else if(nallele0==1 || nallele1==1) {
 				// Singleton: must be compatible
-				iscompat[pos] = (purge_singletons) ? -1 : -2;
-			}
-		}
-		if(allele0!=NULL) delete allele0;
-		if(allele1!=NULL) delete allele1;
-	}
-	// Create a bip file for the internal branches of the tree, of which there will be n-2
-	Matrix<int> treebip(n,n-2,-1);
-	
-	// Add "mutations" encoding the branches of the clonal frame
-	// The first index is for the sequence (including internal sequences) and the second is for the branch encoded (equivalent to the site)
-	Matrix<int> cstate(2*n-1,2*n-1,-1);
-	int j,k;
-	// Assign 0 to the root node for every site
-	for(k=0;k<2*n-1;k++) cstate[2*n-2][k] = 0;
-	// Work from root to tips inheriting the state or, if the focal branch, introducing the mutated state
-	for(j=2*n-3;j>=0;j--) {
-		for(k=0;k<2*n-1;k++) {
-			if(j==k) {
-				cstate[j][k] = 1;
+				if(purge_singletons) iscompat[pos] = -1;
 			} else {
-				const mt_node *node = &(ctree.node[j]);
-				const mt_node *parent = node->ancestor;
-				const int parentState = cstate[parent->id][k];
-				cstate[j][k] = parentState;
-			}
-		}
-	}
-	
-	// Determine compatibility with the clonal frame
-	// Test whether the observed partitions in the FASTA file are incompatible with any branches in the Newick tree
-	// by tracking whether each of the four possible "haplotypes" has been observed. 
-	// pos is the position in the FASTA file, j is the individual in the FASTA file and k is the branch in the Newick tree
-	for(pos=0;pos<L;pos++) {
-		// First index is for the branches in the tree. Second and third indices are for the four possible
-		// "haplotypes" (00, 01, 10 and 11).
-		vector< Matrix<bool> > hap(2*n-1, Matrix<bool>(2,2,false));
-		if(iscompat[pos]==0) {
-			for(j=0;j<n;j++) {
-				const int jallele = bip[j][pos];
-				if(jallele!=-2) {
-					for(k=0;k<2*n-1;k++) {
-						const int kallele = cstate[j][k];
-						if(kallele!=-2) {
-							hap[k][jallele][kallele] = true;
-						}
+				// Determine compatibility with the clonal frame by the four-gamete test:
+				// the site is incompatible with branch k if both alleles are found both inside and outside the subtree below k.
+				// Only internal non-root branches can be incompatible with a biallelic site.
+				for(k=n;k<nnodes-1;k++) {
+					const unsigned long long *branch_bits = &treebip[(size_t)k*nwords];
+					unsigned long long h00 = 0ULL, h01 = 0ULL, h10 = 0ULL, h11 = 0ULL;
+					for(w=0;w<nwords;w++) {
+						h00 |= allele0_bits[w] & ~branch_bits[w];
+						h01 |= allele0_bits[w] & branch_bits[w];
+						h10 |= allele1_bits[w] & ~branch_bits[w];
+						h11 |= allele1_bits[w] & branch_bits[w];
+					}
+					if(h00 && h01 && h10 && h11) {
+						iscompat[pos] = 1;
+						break;
 					}
 				}
 			}
-			bool allcompat = true;
-			for(k=0;k<2*n-1;k++) {
-				if(hap[k][0][0] && hap[k][0][1] && hap[k][1][0] && hap[k][1][1]) {
-					allcompat = false;
-					break;
-				}
-			}
-			if(!allcompat) {
-				iscompat[pos] = 1;
-			}
-		} else if(iscompat[pos]==-2) {
-			iscompat[pos] = 0;
 		}
-	}
+	});
+	anyN = vector<bool>(L,false);
+	int pos;
+	for(pos=0;pos<L;pos++) anyN[pos] = (siteN[pos]!=0);
 	
 	return iscompat;
 }
@@ -1124,112 +1224,128 @@ NewickTree read_Newick(const char* newick_file) {
 	return NewickTree(snewick);
 }
 
-Matrix<Nucleotide> FASTA_to_nucleotide(DNA &fa, vector<double> &empirical_nucleotide_frequencies, vector<bool> usesite) {
+// Convert the sites in use to the internal representation of nucleotides, and compute the empirical nucleotide frequencies from all sites
+Matrix<Nucleotide> FASTA_to_nucleotide(const EncodedAlignment &fa, vector<double> &empirical_nucleotide_frequencies, const vector<bool> &usesite) {
 	int i,j,k;
 	int nsites = 0;
 	for(j=0;j<usesite.size();j++) {
 		if(usesite[j]) ++nsites;
 	}
 	Matrix<Nucleotide> nuc(fa.nseq,nsites,N_ambiguous);
-	empirical_nucleotide_frequencies = vector<double>(4,0.0);
-	double total_empirical_count = 0.0;
+	// Count the occurrences of each code over the whole alignment, two sequences per byte
+	vector<long long> ncode(16,0);
 	for(j=0,k=0;j<fa.lseq;j++) {
+		const unsigned char *row = fa.site(j);
+		size_t b;
+		for(b=0;b<fa.site_bytes;b++) {
+			++ncode[row[b]&15];
+			++ncode[row[b]>>4];
+		}
 		if(usesite[j]) {
 			for(i=0;i<fa.nseq;i++) {
-				switch(toupper(fa[i][j])) {
-					case 'A':
-						nuc[i][k] = Adenine;
-						++empirical_nucleotide_frequencies[Adenine];
-						++total_empirical_count;
-						break;
-					case 'G':
-						nuc[i][k] = Guanine;
-						++empirical_nucleotide_frequencies[Guanine];
-						++total_empirical_count;
-						break;					
-					case 'C':
-						nuc[i][k] = Cytosine;
-						++empirical_nucleotide_frequencies[Cytosine];
-						++total_empirical_count;
-						break;					
-					case 'T': case 'U':
-						nuc[i][k] = Thymine;
-						++empirical_nucleotide_frequencies[Thymine];
-						++total_empirical_count;
-						break;
-					case 'N': case 'X': case '-': case '?':
-						nuc[i][k] = N_ambiguous;
-						break;
-					default:
-						stringstream errTxt;
-						errTxt << "FASTA_to_nucleotide(): unsupported base " << fa[i][j] << " in sequence " << i;
-						errTxt << " ("<< fa.label[i] << ") position " << j;
-						error(errTxt.str().c_str());
-				}
+				nuc[i][k] = (Nucleotide)alignment_code_nucleotide[fa.code(i,j)];
 			}
 			++k;
-		} else {
-			for(i=0;i<fa.nseq;i++) {
-				switch(toupper(fa[i][j])) {
-					case 'A':
-						++empirical_nucleotide_frequencies[Adenine];
-						++total_empirical_count;
-						break;
-					case 'G':
-						++empirical_nucleotide_frequencies[Guanine];
-						++total_empirical_count;
-						break;					
-					case 'C':
-						++empirical_nucleotide_frequencies[Cytosine];
-						++total_empirical_count;
-						break;					
-					case 'T': case 'U':
-						++empirical_nucleotide_frequencies[Thymine];
-						++total_empirical_count;
-						break;
-					case 'N': case 'X': case '-': case '?':
-						break;
-					default:
-						stringstream errTxt;
-						errTxt << "FASTA_to_nucleotide(): unsupported base " << fa[i][j] << " in sequence " << i;
-						errTxt << " ("<< fa.label[i] << ") position " << j;
-						error(errTxt.str().c_str());
-				}
-			}
+		}
+	}
+	// With an odd number of sequences, the unused high nibble of the last byte of every site is zero
+	if(fa.nseq%2) ncode[0] -= fa.lseq;
+	empirical_nucleotide_frequencies = vector<double>(4,0.0);
+	double total_empirical_count = 0.0;
+	int c;
+	for(c=0;c<16;c++) {
+		const int nt = alignment_code_nucleotide[c];
+		if(nt!=N_ambiguous) {
+			empirical_nucleotide_frequencies[nt] += (double)ncode[c];
+			total_empirical_count += (double)ncode[c];
 		}
 	}
 	for(i=0;i<4;i++) empirical_nucleotide_frequencies[i] /= total_empirical_count;
 	return nuc;
 }
 
-void find_alignment_patterns(Matrix<Nucleotide> &nuc, vector<bool> &iscompat, vector<string> &pat, vector<int> &pat1, vector<int> &cpat, vector<int> &ipat) {
+// FNV-1a over the packed words of a site pattern, followed by a final avalanche mix
+unsigned long long hash_pattern_key(const unsigned long long *key, const int nwords) {
+	unsigned long long h = 14695981039346656037ULL;
+	int w;
+	for(w=0;w<nwords;w++) h = (h ^ key[w]) * 1099511628211ULL;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+void find_alignment_patterns(const EncodedAlignment &fa, const vector<bool> &usesite, vector<string> &pat, vector<int> &pat1, vector<int> &cpat, vector<int> &ipat) {
 	pat = vector<string>(0);
 	pat1 = vector<int>(0);
 	cpat = vector<int>(0);
-	ipat = vector<int>(nuc.ncols());
+	ipat = vector<int>(0);
 	static const char AGCTN[5] = {'A','G','C','T','N'};
-	int i,j,pos;
-	for(pos=0;pos<nuc.ncols();pos++) {
-		if(iscompat[pos]) {
-			string pospat = "";
-			for(i=0;i<nuc.nrows();i++) {
-				pospat += AGCTN[nuc[i][pos]];
+	// Each site is packed into a key of 3 bits per sequence, 20 sequences (10 bytes of the encoded alignment) per 64-bit word.
+	// Keys of the unique patterns are stored contiguously and indexed by an open-addressing
+	// hash table (linear probing, kept at most half full) so that each site is looked up in
+	// O(n) time rather than compared against every previously seen pattern.
+	const int nseq = fa.nseq;
+	const int nbytes = fa.site_bytes;
+	const int nwords = (nbytes+9)/10;
+	// Key bits for each byte of the encoded alignment, i.e. the nucleotides of two sequences
+	unsigned long long byte_key[256];
+	int i,j,pos,w;
+	for(i=0;i<256;i++) byte_key[i] = alignment_code_nucleotide[i&15] | (alignment_code_nucleotide[i>>4]<<3);
+	vector<unsigned long long> key(nwords);
+	vector<unsigned long long> patkey(0);
+	vector<int> table(1024,-1);
+	unsigned long long mask = table.size()-1;
+	for(pos=0;pos<fa.lseq;pos++) {
+		if(usesite[pos]) {
+			// Pack the site
+			const unsigned char *row = fa.site(pos);
+			int b;
+			for(w=0,b=0;w<nwords;w++) {
+				unsigned long long word = 0;
+				int shift;
+				for(shift=0;shift<60 && b<nbytes;shift+=6,b++) {
+					word |= byte_key[row[b]] << shift;
+				}
+				key[w] = word;
 			}
-			for(j=0;j<pat.size();j++) {
-				if(pospat==pat[j]) break;
+			// Probe for the pattern
+			unsigned long long slot = hash_pattern_key(&key[0],nwords) & mask;
+			for(;;slot=(slot+1)&mask) {
+				j = table[slot];
+				if(j==-1) break;
+				const unsigned long long *pk = &patkey[(size_t)j*nwords];
+				for(w=0;w<nwords;w++) {
+					if(pk[w]!=key[w]) break;
+				}
+				if(w==nwords) break;
 			}
-			if(j==pat.size()) {
+			if(j==-1) {
+				j = pat.size();
+				string pospat(nseq,'N');
+				for(i=0;i<nseq;i++) {
+					pospat[i] = AGCTN[alignment_code_nucleotide[fa.code(i,pos)]];
+				}
 				pat.push_back(pospat);
 				pat1.push_back(pos);
 				cpat.push_back(1);
-				ipat[pos] = j;
+				patkey.insert(patkey.end(),key.begin(),key.end());
+				table[slot] = j;
+				// Grow the table and rehash when it becomes half full
+				if(2*pat.size()>table.size()) {
+					table = vector<int>(2*table.size(),-1);
+					mask = table.size()-1;
+					int p;
+					for(p=0;p<pat.size();p++) {
+						unsigned long long s = hash_pattern_key(&patkey[(size_t)p*nwords],nwords) & mask;
+						while(table[s]!=-1) s = (s+1)&mask;
+						table[s] = p;
+					}
+				}
 			} else {
 				++cpat[j];
-				ipat[pos] = j;
 			}
-		} else {
-			// If not a compatible site
-			ipat[pos] = -1;
+			ipat.push_back(j);
 		}
 	}
 }
@@ -1413,85 +1529,110 @@ Matrix<mydouble> compute_HKY85_ptrans(const double x, const double kappa, const
 	return ptrans;
 }
 
-Matrix<double> dcompute_HKY85_ptrans(const double x, const double kappa, const vector<double> &pi) {
+/*	The HKY85 transition probabilities along a branch of length x and their first and second derivatives with respect to x.
+	They are computed from the spectral decomposition of the rate matrix in the comment before HKY85_expected_rate, scaled to one
+	expected substitution per unit branch length, whose eigenvalues are 0, that of transversions and one each for
+	transitions among purines and among pyrimidines. Unlike compute_HKY85_ptrans, the probabilities are not bounded.	*/
+void dcompute_HKY85_ptrans(const double x, const double kappa, const vector<double> &pi, Matrix<double> &ptrans, Matrix<double> &dptrans, Matrix<double> &d2ptrans) {
 	const double k = 1.0/kappa;
-	Matrix<double> ptrans(4,4,0.0);
-	double t1 = pi[2] + pi[3];
-	double t2 = t1 * pi[0];
-	double t3 = t1 * pi[1];
-	double t4 = pi[0] * pi[1] + pi[2] * pi[3] + (t2 + t3) * k;
-	t4 = 0.1e1 / t4;
-	double t5 = -0.1e1 / 0.2e1;
-	double t6 = exp(t5 * (t1 * k + pi[0] + pi[1]) * x * t4);
-	double t7 = pi[2] + pi[3] + pi[0] + pi[1];
-	double t8 = exp(t5 * k * t7 * x * t4);
-	double t9 = pow(pi[1], 0.2e1);
-	double t10 = pow(pi[0], 0.2e1);
-	double t11 = pi[0] + pi[1];
-	double t12 = t7 * t6 - t1 * t8 - pi[0] - pi[1];
-	double t13 = t8 - 0.1e1;
-	double t14 = 0.1e1 / t11;
-	double t15 = 0.1e1 / t7;
-	double t16 = t13 * pi[2] * t15;
-	double t17 = t13 * pi[3] * t15;
-	t4 = exp(t5 * (t11 * k + pi[2] + pi[3]) * x * t4);
-	t5 = pow(pi[3], 0.2e1);
-	double t18 = pow(pi[2], 0.2e1);
-	t11 = t11 * t8;
-	t7 = -t11 + t7 * t4 - pi[3] - pi[2];
-	t1 = 0.1e1 / t1;
-	double t19 = t13 * pi[0] * t15;
-	t13 = t13 * pi[1] * t15;
-	double temp;
-	temp = (t6 * t9 + ((pi[0] + pi[3] + pi[2]) * t6 + pi[0]) * pi[1] + t2 * t8 + t10) * t14 * t15;
-	if(temp>1.0) temp = 1.0; if(temp<1e-100) temp=1e-100;
-	ptrans[0][0] = temp;
-	temp = -pi[1] * t12 * t14 * t15;
-	if(temp>1.0) temp = 1.0; if(temp<1e-100) temp=1e-100;
-	ptrans[0][1] = temp;
-	temp = -t16;
-	if(temp>1.0) temp = 1.0; if(temp<1e-100) temp=1e-100;
-	ptrans[0][2] = temp;
-	temp = -t17;
-	if(temp>1.0) temp = 1.0; if(temp<1e-100) temp=1e-100;
-	ptrans[0][3] = temp;
-	temp = -pi[0] * t12 * t14 * t15;
-	if(temp>1.0) temp = 1.0; if(temp<1e-100) temp=1e-100;
-	ptrans[1][0] = temp;
-	temp = (t6 * t10 + ((pi[2] + pi[1] + pi[3]) * t6 + pi[1]) * pi[0] + t3 * t8 + t9) * t14 * t15;
-	if(temp>1.0) temp = 1.0; if(temp<1e-100) temp=1e-100;
-	ptrans[1][1] = temp;
-	temp = -t16;
-	if(temp>1.0) temp = 1.0; if(temp<1e-100) temp=1e-100;
-	ptrans[1][2] = temp;
-	temp = -t17;
-	if(temp>1.0) temp = 1.0; if(temp<1e-100) temp=1e-100;
-	ptrans[1][3] = temp;
-	temp = -t19;
-	if(temp>1.0) temp = 1.0; if(temp<1e-100) temp=1e-100;
-	ptrans[2][0] = temp;
-	temp = -t13;
-	if(temp>1.0) temp = 1.0; if(temp<1e-100) temp=1e-100;
-	ptrans[2][1] = temp;
-	temp = (t4 * t5 + ((pi[0] + pi[2] + pi[1]) * t4 + pi[2]) * pi[3] + t11 * pi[2] + t18) * t1 * t15;
-	if(temp>1.0) temp = 1.0; if(temp<1e-100) temp=1e-100;
-	ptrans[2][2] = temp;
-	temp = -t7 * pi[3] * t1 * t15;
-	if(temp>1.0) temp = 1.0; if(temp<1e-100) temp=1e-100;
-	ptrans[2][3] = temp;
-	temp = -t19;
-	if(temp>1.0) temp = 1.0; if(temp<1e-100) temp=1e-100;
-	ptrans[3][0] = temp;
-	temp = -t13;
-	if(temp>1.0) temp = 1.0; if(temp<1e-100) temp=1e-100;
-	ptrans[3][1] = temp;
-	temp = -t7 * pi[2] * t1 * t15;
-	if(temp>1.0) temp = 1.0; if(temp<1e-100) temp=1e-100;
-	ptrans[3][2] = temp;
-	temp = (t4 * t18 + ((pi[0] + pi[1] + pi[3]) * t4 + pi[3]) * pi[2] + t11 * pi[3] + t5) * t1 * t15;		
-	if(temp>1.0) temp = 1.0; if(temp<1e-100) temp=1e-100;
-	ptrans[3][3] = temp;
-	return ptrans;
+	const double piR = pi[Adenine]+pi[Guanine];
+	const double piY = pi[Cytosine]+pi[Thymine];
+	const double S = piR+piY;
+	const double mu = 0.5/(pi[Adenine]*pi[Guanine]+pi[Cytosine]*pi[Thymine]+k*piR*piY);
+	const double lambdaV = -mu*k*S;
+	const double lambdaR = -mu*(k*piY+piR);
+	const double lambdaY = -mu*(k*piR+piY);
+	const double eV = exp(lambdaV*x), eR = exp(lambdaR*x), eY = exp(lambdaY*x);
+	ptrans = Matrix<double>(4,4,0.0);
+	dptrans = Matrix<double>(4,4,0.0);
+	d2ptrans = Matrix<double>(4,4,0.0);
+	int i,j;
+	for(i=0;i<4;i++) {
+		const bool purine_i = (i==Adenine || i==Guanine);
+		for(j=0;j<4;j++) {
+			const bool purine_j = (j==Adenine || j==Guanine);
+			// P[i][j] = pi[j]/S + cV exp(lambdaV x) + cG exp(lambdaG x), where G is the class of j
+			double cV, cG = 0.0, lambdaG = 0.0, eG = 0.0;
+			if(purine_i==purine_j) {
+				const double piG = (purine_j) ? piR : piY;
+				cV = pi[j]*(1.0/piG-1.0/S);
+				cG = ((i==j) ? 1.0 : 0.0)-pi[j]/piG;
+				lambdaG = (purine_j) ? lambdaR : lambdaY;
+				eG = (purine_j) ? eR : eY;
+			} else {
+				cV = -pi[j]/S;
+			}
+			ptrans[i][j] = pi[j]/S+cV*eV+cG*eG;
+			dptrans[i][j] = cV*lambdaV*eV+cG*lambdaG*eG;
+			d2ptrans[i][j] = cV*lambdaV*lambdaV*eV+cG*lambdaG*lambdaG*eG;
+		}
+	}
+}
+
+// The no-recombination log-likelihood of a branch from its substitution counts, and its first and second derivatives with respect to the log branch length u
+static void loglik_branch_derivatives(const Matrix<double> &count, const double kappa, const vector<double> &pi, const double u, double &loglik, double &dloglik, double &d2loglik) {
+	const double x = exp(u);
+	Matrix<double> ptrans, dptrans, d2ptrans;
+	dcompute_HKY85_ptrans(x,kappa,pi,ptrans,dptrans,d2ptrans);
+	double d1 = 0.0, d2 = 0.0;
+	loglik = 0.0;
+	int i,j;
+	for(i=0;i<4;i++) {
+		for(j=0;j<4;j++) {
+			if(count[i][j]==0.0) continue;
+			// Bounded as in compute_HKY85_ptrans
+			double p = ptrans[i][j];
+			if(p>1.0) p = 1.0;
+			if(p<1.0e-100) p = 1.0e-100;
+			const double r = dptrans[i][j]/p;
+			loglik += count[i][j]*log(p);
+			d1 += count[i][j]*r;
+			d2 += count[i][j]*(d2ptrans[i][j]/p-r*r);
+		}
+	}
+	// Chain rule for x = exp(u)
+	dloglik = x*d1;
+	d2loglik = x*d1+x*x*d2;
+}
+
+/*	Maximum likelihood branch length under the no-recombination model, given the substitution counts on the branch, by a
+	safeguarded Newton-Raphson search on the log branch length. The root of the derivative is kept bracketed, and the
+	search bisects the bracket whenever the curvature is not negative or the Newton step would leave it, so every
+	iteration costs O(16) whatever the length of the alignment. The branch length is bounded by min_branch_length and
+	max_branch_length. Returns the branch length and sets loglik to the log-likelihood there and niter to the number of
+	iterations taken.	*/
+double maximum_likelihood_branch_length(const Matrix<double> &count, const double kappa, const vector<double> &pi, const double initial_branch_length, const double min_branch_length, const double max_branch_length, double &loglik, int &niter, const double tolerance) {
+	double lo = log(min_branch_length), hi = log(max_branch_length);
+	double l, dl, d2l;
+	niter = 0;
+	// The maximum is on a bound if the log-likelihood decreases away from it
+	loglik_branch_derivatives(count,kappa,pi,lo,l,dl,d2l);
+	if(dl<=0.0) {
+		loglik = l;
+		return min_branch_length;
+	}
+	loglik_branch_derivatives(count,kappa,pi,hi,l,dl,d2l);
+	if(dl>=0.0) {
+		loglik = l;
+		return max_branch_length;
+	}
+	double u = log(initial_branch_length);
+	if(!(u>lo && u<hi)) u = 0.5*(lo+hi);
+	const int maxit = 200;
+	for(niter=1;niter<=maxit;niter++) {
+		loglik_branch_derivatives(count,kappa,pi,u,l,dl,d2l);
+		if(dl==0.0) break;
+		if(dl>0.0) lo = u;
+		else hi = u;
+		double next = (d2l<0.0) ? u-dl/d2l : 0.5*(lo+hi);
+		if(!(next>lo && next<hi)) next = 0.5*(lo+hi);
+		const bool converged = (fabs(next-u)<tolerance || hi-lo<tolerance);
+		u = next;
+		if(converged) break;
+	}
+	loglik_branch_derivatives(count,kappa,pi,u,l,dl,d2l);
+	loglik = l;
+	return exp(u);
 }
 
 /* Use the following in Maple to generate this code: (k is 1/transition:transversion ratio, i.e. k=1/kappa)
@@ -1522,158 +1663,527 @@ double HKY85_expected_rate(const vector<double> &n, const double kappa, const ve
 }
 
 
+// Identify the unique site patterns among the sites in use and compute the joint maximum likelihood ancestral sequences, or take them from the cache
+mydouble reconstruct_ancestral_sequences(const EncodedAlignment &fa, const vector<bool> &usesite, marginal_tree &ctree, const double kappa, AlignmentCache *cache, vector<int> &pat1, vector<int> &cpat, vector<int> &ipat, vector<double> &empirical_nucleotide_frequencies, Matrix<Nucleotide> &node_nuc, const int nthreads) {
+	mydouble ML;
+	const AncestralReconstruction *cached = (cache==NULL) ? NULL : cache->find_reconstruction(usesite,kappa);
+	if(cached!=NULL) {
+		pat1 = cached->pat1;
+		cpat = cached->cpat;
+		ipat = cached->ipat;
+		empirical_nucleotide_frequencies = cached->pi;
+		node_nuc = cached->node_nuc;
+		ML.setlog(cached->loglik);
+		cout << "Loaded " << cpat.size() << " unique site patterns among " << ipat.size() << " sites from " << cache->filename << endl;
+		return ML;
+	}
+	// Identify and count unique patterns directly from the encoded alignment
+	vector<string> pat;				// Pattern as string of AGCTNs
+	TimedPhase timed_patterns("find_alignment_patterns");
+	find_alignment_patterns(fa,usesite,pat,pat1,cpat,ipat);
+	const double pat_time = timed_patterns.stop();
+	cout << "Identified " << pat.size() << " unique site patterns among " << ipat.size() << " sites in " << pat_time << " s" << endl;
+	// Convert the first example of each pattern to the internal representation of nucleotides
+	vector<bool> ispat1(fa.lseq,false);
+	int i;
+	for(i=0;i<pat1.size();i++) ispat1[pat1[i]] = true;
+	Matrix<Nucleotide> nuc = FASTA_to_nucleotide(fa,empirical_nucleotide_frequencies,ispat1);
+	TimedPhase timed_reconstruction("ancestral_reconstruction");
+	ML = maximum_likelihood_ancestral_sequences(nuc,ctree,kappa,empirical_nucleotide_frequencies,cpat,node_nuc,nthreads);
+	timed_reconstruction.stop();
+	if(cache!=NULL) {
+		AncestralReconstruction recon;
+		recon.kappa = kappa;
+		recon.usesite = usesite;
+		recon.pat1 = pat1;
+		recon.cpat = cpat;
+		recon.ipat = ipat;
+		recon.pi = empirical_nucleotide_frequencies;
+		recon.node_nuc = node_nuc;
+		recon.loglik = ML.LOG();
+		cache->add_reconstruction(recon);
+	}
+	return ML;
+}
+
 /*	For a full description of this algorithm:
  A Fast Algorithm for Joint Reconstruction of Ancestral Amino Acid Sequences
  Tal Pupko, Itsik Peer, Ron Shamir, and Dan Graur. Mol. Biol. Evol. 17(6):890–896. 2000
  */
-mydouble maximum_likelihood_ancestral_sequences(Matrix<Nucleotide> &nuc, marginal_tree &ctree, const double kappa, const vector<double> &pi, vector<int> &pat1, vector<int> &cpat, Matrix<Nucleotide> &node_sequence) {
-	mydouble ML(1.0);
+mydouble maximum_likelihood_ancestral_sequences(Matrix<Nucleotide> &nuc, marginal_tree &ctree, const double kappa, const vector<double> &pi, vector<int> &cpat, Matrix<Nucleotide> &node_sequence, const int nthreads) {
+	// nuc holds one column per pattern, taken from the first example of that pattern
 	// Every node in the tree has a likelihood attached of the best subtree likelihood, and the sequence eventually identified as the global maximum likelihood estimate
 	const int nseq = nuc.nrows();
 	const int nnodes = 2*nseq-1;
-	const int npat = pat1.size();
+	const int npat = cpat.size();
 	node_sequence = Matrix<Nucleotide>(nnodes,npat,N_ambiguous);
-	// subtree_ML[i][j][k] is, for node i, pattern j, the subtree maximum likelihood given the parent node has state k = {A,G,C,T}
-	Matrix<mydouble> subtree_ML_element(npat,4,0.0);
-	vector< Matrix<mydouble> > subtree_ML(nnodes,subtree_ML_element);
-	// path_ML[i][j][k] is, for node i, pattern j, the state of node i that maximizes the subtree likelihood given the parent node has state k = {A,G,C,T}
-	Matrix<Nucleotide> path_ML_element(npat,4,N_ambiguous);
-	vector< Matrix<Nucleotide> > path_ML(nnodes,path_ML_element);
-	// For each node (except the root node), define an HKY85 transition probability matrix
+	// For each node (except the root node), define an HKY85 transition probability matrix, and take logs since the recursion is done in log space
 	vector< Matrix<double> > ptrans = compute_HKY85_ptrans(ctree,kappa,pi);
-	// Nodes are ordered in the tree first in tip order (0..n-1) then in ascending time order towards the root node (2*n-2)
-	// First, do the tips
+	vector< Matrix<double> > logptrans = ptrans;
 	int i,j,k,l;
-	for(i=0;i<nseq;i++) {
-		for(j=0;j<npat;j++) {
-			const Nucleotide obs = nuc[i][pat1[j]];
-			for(k=0;k<4;k++) {
-				// If the parent node's state is k, what is the maximum likelihood of the subtree?
-				// And what is the state of the node that achieves that maximum value?
-				if(obs==Adenine || obs==Guanine || obs==Cytosine || obs==Thymine) {
-					subtree_ML[i][j][k] = ptrans[i][k][obs];
-					path_ML[i][j][k] = obs;
-				} else if(obs==N_ambiguous) {
-					// If multiple equally good paths are possible, the path is chosen in the following order of decreasing preference: A, G, C, T
-					subtree_ML[i][j][k] = ptrans[i][k][0];
-					path_ML[i][j][k] = (Nucleotide)0;
-					for(l=1;l<4;l++) {
-						double subtree_ML_l = ptrans[i][k][l];
-						if(subtree_ML_l>subtree_ML[i][j][k]) {
-							subtree_ML[i][j][k] = subtree_ML_l;
-							path_ML[i][j][k] = (Nucleotide)l;
-						}
-					}
-				} else {
-					stringstream errTxt;
-					errTxt << "maximum_likelihood_ancestral_sequences(): unexpected base " << obs << " (out of range 0-5) in sequence " << i << " pattern " << j;
-					error(errTxt.str().c_str());
-				}
-			}
+	for(i=0;i<nnodes;i++) {
+		for(k=0;k<4;k++) {
+			for(l=0;l<4;l++) logptrans[i][k][l] = log(ptrans[i][k][l]);
 		}
 	}
-	// Now the internal nodes, all of which are bifurcating
-	for(;i<nnodes;i++) {
-		for(j=0;j<npat;j++) {
-			const mt_node* d0 = ctree.node[i].descendant[0];
-			const mt_node* d1 = ctree.node[i].descendant[1];
-			// Check the descendant nodes exist
-			if(d0==NULL || d1==NULL) {
-				stringstream errTxt;
-				errTxt << "maximum_likelihood_ancestral_sequences(): null pointer during Viterbi-like algorithm";
-				error(errTxt.str().c_str());
-			}
-			const int i0 = d0->id;
-			const int i1 = d1->id;
-			if(i0<0 || i0>=nnodes || i1<0 || i1>=nnodes) {
-				stringstream errTxt;
-				errTxt << "maximum_likelihood_ancestral_sequences(): node index during Viterbi-like algorithm";
-				error(errTxt.str().c_str());
-			}
-			// Check subtree ML has been computed
-			for(l=0;l<4;l++) {
-				if(subtree_ML[i0][j][l].iszero() || subtree_ML[i1][j][l].iszero()) {
-					stringstream errTxt;
-					errTxt << "maximum_likelihood_ancestral_sequences(): uninitialized subtree ML during Viterbi-like algorithm";
-					error(errTxt.str().c_str());
-				}
-			}
-			for(k=0;k<4;k++) {
-				// If the parent node's state is k, what is the maximum likelihood of the subtree?
-				// And what is the state of the node that achieves that maximum value?
-				// If multiple equally good paths are possible, the path is chosen in the following order of decreasing preference: A, G, C, T
-				subtree_ML[i][j][k] = ptrans[i][k][0]*subtree_ML[i0][j][0]*subtree_ML[i1][j][0];
-				path_ML[i][j][k] = (Nucleotide)0;
-				for(l=1;l<4;l++) {
-					const mydouble subtree_ML_l = ptrans[i][k][l]*subtree_ML[i0][j][l]*subtree_ML[i1][j][l];
-					if(subtree_ML_l > subtree_ML[i][j][k]) {
-						subtree_ML[i][j][k] = subtree_ML_l;
-						path_ML[i][j][k] = (Nucleotide)l;
-					}
-				}
-			}
+	// Nodes are ordered in the tree first in tip order (0..n-1) then in ascending time order towards the root node (2*n-2)
+	// Check the tree once, before the recursion: internal nodes are bifurcating and their descendants precede them
+	vector<int> desc0(nnodes,-1), desc1(nnodes,-1);
+	for(i=nseq;i<nnodes;i++) {
+		const mt_node* d0 = ctree.node[i].descendant[0];
+		const mt_node* d1 = ctree.node[i].descendant[1];
+		// Check the descendant nodes exist
+		if(d0==NULL || d1==NULL) {
+			stringstream errTxt;
+			errTxt << "maximum_likelihood_ancestral_sequences(): null pointer during Viterbi-like algorithm";
+			error(errTxt.str().c_str());
 		}
-	}
-	// Now work back from root to tips choosing the ML path
-	// Start at the root (this is redundant as the root's ancestor has no bearing so subtree_ML[nnodes-1][j][l] and path_ML[nnodes-1][j][l] are the same for different l's)
-	for(j=0;j<npat;j++) {
-		int best_state = 0;
-		mydouble ML_temp = subtree_ML[nnodes-1][j][0];
-		for(l=1;l<4;l++) {
-			if(subtree_ML[nnodes-1][j][l]>ML) {
-				best_state = l;
-				ML_temp = subtree_ML[nnodes-1][j][l];
-			}
+		desc0[i] = d0->id;
+		desc1[i] = d1->id;
+		if(desc0[i]<0 || desc0[i]>=i || desc1[i]<0 || desc1[i]>=i) {
+			stringstream errTxt;
+			errTxt << "maximum_likelihood_ancestral_sequences(): node index during Viterbi-like algorithm";
+			error(errTxt.str().c_str());
 		}
-		node_sequence[nnodes-1][j] = path_ML[nnodes-1][j][best_state];
-		ML *= pow(ML_temp,cpat[j]);
 	}
+	vector<int> anc(nnodes,-1);
 	for(i=nnodes-2;i>=0;i--) {
-		const mt_node* anc = ctree.node[i].ancestor;
-		// Check the descendant nodes exist
-		if(anc==NULL) {
+		const mt_node* a = ctree.node[i].ancestor;
+		if(a==NULL) {
 			stringstream errTxt;
 			errTxt << "maximum_likelihood_ancestral_sequences(): null pointer during Viterbi-like algorithm second pass";
 			error(errTxt.str().c_str());
 		}
-		const int ianc = anc->id;
-		if(ianc<0 || ianc>=nnodes) {
+		anc[i] = a->id;
+		if(anc[i]<=i || anc[i]>=nnodes) {
 			stringstream errTxt;
 			errTxt << "maximum_likelihood_ancestral_sequences(): node index during Viterbi-like algorithm second pass";
 			error(errTxt.str().c_str());
 		}
+	}
+	for(i=0;i<nseq;i++) {
 		for(j=0;j<npat;j++) {
-			// Check ancestor path has been computed
-			const int parent_state = node_sequence[ianc][j];
-			if(parent_state==N_ambiguous) {
+			const Nucleotide obs = nuc[i][j];
+			if(obs<Adenine || obs>N_ambiguous) {
 				stringstream errTxt;
-				errTxt << "maximum_likelihood_ancestral_sequences(): uninitialized ML ancestor during Viterbi-like algorithm second pass";
+				errTxt << "maximum_likelihood_ancestral_sequences(): unexpected base " << obs << " (out of range 0-5) in sequence " << i << " pattern " << j;
 				error(errTxt.str().c_str());
 			}
-			node_sequence[i][j] = path_ML[i][j][parent_state];
 		}
 	}
-	
-	// At the end, convert patterns to sites working from the end of the sequence forwards
-	return ML;
-}
-
-void write_newick(const marginal_tree &ctree, const vector<string> &all_node_names, const char* file_name) {
-	ofstream fout(file_name);
-	if(!fout) {
-		stringstream errTxt;
-		errTxt << "write_newick(): could not open file " << file_name << " for writing";
-		error(errTxt.str().c_str());
+	// For the tips, the subtree maximum log-likelihood and the state of the tip that achieves it, given the parent node has state k = {A,G,C,T},
+	// depend only on the observed base, so they are tabulated as tip_ML[i][5*k+obs] and tip_path[i][5*k+obs]
+	Matrix<double> tip_ML(nseq,20);
+	Matrix<unsigned char> tip_path(nseq,20);
+	for(i=0;i<nseq;i++) {
+		for(k=0;k<4;k++) {
+			int obs;
+			for(obs=0;obs<4;obs++) {
+				tip_ML[i][5*k+obs] = logptrans[i][k][obs];
+				tip_path[i][5*k+obs] = obs;
+			}
+			// If multiple equally good paths are possible, the path is chosen in the following order of decreasing preference: A, G, C, T
+			tip_ML[i][5*k+N_ambiguous] = logptrans[i][k][0];
+			tip_path[i][5*k+N_ambiguous] = 0;
+			for(l=1;l<4;l++) {
+				if(logptrans[i][k][l]>tip_ML[i][5*k+N_ambiguous]) {
+					tip_ML[i][5*k+N_ambiguous] = logptrans[i][k][l];
+					tip_path[i][5*k+N_ambiguous] = l;
+				}
+			}
+		}
 	}
-	write_newick(ctree,all_node_names,fout);
-	fout.close();
-}
-
-void write_newick(const marginal_tree &ctree, const vector<string> &all_node_names, ofstream &fout) {
-	if(!fout) {
-		stringstream errTxt;
-		errTxt << "write_newick(): could not open file stream for writing";
-		error(errTxt.str().c_str());
+	/*	The patterns are processed in blocks, and the blocks in chunks shared among the threads, each of which allocates its
+		workspace once. Within a block, the subtree maximum log-likelihoods of each internal node are stored as four arrays
+		(one per parent state) over the patterns so that the max-product over the states of the node is a loop along contiguous
+		arrays that the compiler can vectorize. The state of the node achieving the maximum for each of the four parent states
+		is packed into 2 bits of a single byte per node and pattern for the backtracking pass; only these bytes, which are
+		accumulated with |=, need clearing for every block.	*/
+	const int block_size = 64;
+	const int nblocks = (npat+block_size-1)/block_size;
+	const int nchunks = (nblocks<4*nthreads) ? nblocks : 4*nthreads;
+	const int root = nnodes-1;
+	vector<double> root_ML(npat);
+	parallel_for(nchunks,nthreads,[&](const int chunk) {
+		vector<double> subtree_ML((size_t)(nnodes-nseq)*4*block_size);
+		vector<unsigned char> path_ML((size_t)(nnodes-nseq)*block_size);
+		vector<double> tip_scratch(2*4*block_size);
+		vector<unsigned char> best_l(block_size);
+		int block,i,j,k,l;
+		// Subtree maximum log-likelihoods of node c for parent state l, as an array over the patterns in the block
+		auto node_ML = [&](const int c, const int j0, const int nb, double *scratch) -> const double* {
+			if(c>=nseq) return &subtree_ML[(size_t)(c-nseq)*4*block_size];
+			int jc,lc;
+			for(lc=0;lc<4;lc++) {
+				for(jc=0;jc<nb;jc++) scratch[lc*block_size+jc] = tip_ML[c][5*lc+nuc[c][j0+jc]];
+			}
+			return scratch;
+		};
+		for(block=(chunk*nblocks)/nchunks;block<((chunk+1)*nblocks)/nchunks;block++) {
+			const int j0 = block*block_size;
+			const int nb = (j0+block_size<npat) ? block_size : npat-j0;
+			fill(path_ML.begin(),path_ML.end(),0);
+			for(i=nseq;i<nnodes;i++) {
+				const double *ML0 = node_ML(desc0[i],j0,nb,&tip_scratch[0]);
+				const double *ML1 = node_ML(desc1[i],j0,nb,&tip_scratch[4*block_size]);
+				double *ML = &subtree_ML[(size_t)(i-nseq)*4*block_size];
+				unsigned char *path = &path_ML[(size_t)(i-nseq)*block_size];
+				for(k=0;k<4;k++) {
+					// If the parent node's state is k, what is the maximum likelihood of the subtree?
+					// And what is the state of the node that achieves that maximum value?
+					// If multiple equally good paths are possible, the path is chosen in the following order of decreasing preference: A, G, C, T
+					double *MLk = ML+k*block_size;
+					const double *lp = &logptrans[i][k][0];
+					for(j=0;j<nb;j++) {
+						MLk[j] = lp[0]+ML0[j]+ML1[j];
+						best_l[j] = 0;
+					}
+					for(l=1;l<4;l++) {
+						const double *ML0l = ML0+l*block_size;
+						const double *ML1l = ML1+l*block_size;
+						for(j=0;j<nb;j++) {
+							const double subtree_ML_l = lp[l]+ML0l[j]+ML1l[j];
+							const bool better = subtree_ML_l>MLk[j];
+							MLk[j] = better ? subtree_ML_l : MLk[j];
+							best_l[j] = better ? l : best_l[j];
+						}
+					}
+					for(j=0;j<nb;j++) path[j] |= best_l[j]<<(2*k);
+				}
+			}
+			// Now work back from root to tips choosing the ML path
+			// At the root the parent state has no bearing since the rows of its transition matrix are identical, so take parent state 0
+			const double *MLroot = node_ML(root,j0,nb,&tip_scratch[0]);
+			for(j=0;j<nb;j++) {
+				root_ML[j0+j] = MLroot[j];
+				node_sequence[root][j0+j] = (root>=nseq) ? (Nucleotide)(path_ML[(size_t)(root-nseq)*block_size+j]&3) : (Nucleotide)tip_path[root][nuc[root][j0+j]];
+			}
+			for(i=nnodes-2;i>=0;i--) {
+				const int ianc = anc[i];
+				for(j=0;j<nb;j++) {
+					const int parent_state = node_sequence[ianc][j0+j];
+					if(i>=nseq) {
+						node_sequence[i][j0+j] = (Nucleotide)((path_ML[(size_t)(i-nseq)*block_size+j]>>(2*parent_state))&3);
+					} else {
+						node_sequence[i][j0+j] = (Nucleotide)tip_path[i][5*parent_state+nuc[i][j0+j]];
+					}
+				}
+			}
+		}
+	});
+	// Accumulate the log-likelihood over patterns in order
+	mydouble ML(1.0);
+	for(j=0;j<npat;j++) {
+		mydouble ML_temp;
+		ML_temp.setlog(root_ML[j]);
+		ML *= pow(ML_temp,cpat[j]);
+	}
+	return ML;
+}
+
+/*	Marginal reconstruction of the ancestral sequences by Felsenstein's pruning algorithm followed by an outside (preorder) pass.
+	nuc holds one column per pattern, as for maximum_likelihood_ancestral_sequences. On return max_base[i][j] is the most
+	probable nucleotide at node i (tips included) for pattern j and max_posterior[i][j] its posterior probability, and
+	pattern_loglik[j] is the log-likelihood of pattern j. Returns the likelihood of all the sites, each pattern counted cpat times.	*/
+mydouble marginal_ancestral_posteriors(const Matrix<Nucleotide> &nuc, const marginal_tree &ctree, const double kappa, const vector<double> &pi, const vector<int> &cpat, Matrix<Nucleotide> &max_base, Matrix<float> &max_posterior, vector<double> &pattern_loglik, const int nthreads) {
+	const int nseq = nuc.nrows();
+	const int nnodes = 2*nseq-1;
+	const int npat = cpat.size();
+	const int root = nnodes-1;
+	if(ctree.size!=nnodes) error("marginal_ancestral_posteriors(): tree and alignment do not match");
+	// Every element of the posterior and its base is written below
+	max_base = Matrix<Nucleotide>(nnodes,npat);
+	max_posterior = Matrix<float>(nnodes,npat);
+	pattern_loglik = vector<double>(npat,0.0);
+	// Transition probabilities of every branch (ptrans_flat[16*i+4*k+l]: from k to l)
+	const vector< Matrix<double> > ptrans = compute_HKY85_ptrans(ctree,kappa,pi);
+	vector<double> ptrans_flat(16*nnodes);
+	int i,j,k,l;
+	for(i=0;i<nnodes;i++) {
+		for(k=0;k<4;k++) {
+			for(l=0;l<4;l++) ptrans_flat[16*i+4*k+l] = ptrans[i][k][l];
+		}
+	}
+	// Check the tree once: internal nodes are bifurcating and their descendants precede them
+	vector<int> desc0(nnodes,-1), desc1(nnodes,-1), anc(nnodes,-1);
+	for(i=nseq;i<nnodes;i++) {
+		const mt_node* d0 = ctree.node[i].descendant[0];
+		const mt_node* d1 = ctree.node[i].descendant[1];
+		if(d0==NULL || d1==NULL || d0->id<0 || d0->id>=i || d1->id<0 || d1->id>=i) {
+			stringstream errTxt;
+			errTxt << "marginal_ancestral_posteriors(): unexpected descendants of node " << i;
+			error(errTxt.str().c_str());
+		}
+		desc0[i] = d0->id;
+		desc1[i] = d1->id;
+		anc[desc0[i]] = anc[desc1[i]] = i;
+	}
+	for(i=0;i<root;i++) {
+		if(anc[i]<0) {
+			stringstream errTxt;
+			errTxt << "marginal_ancestral_posteriors(): node " << i << " has no ancestor";
+			error(errTxt.str().c_str());
+		}
+	}
+	for(i=0;i<nseq;i++) {
+		for(j=0;j<npat;j++) {
+			if(nuc[i][j]<Adenine || nuc[i][j]>N_ambiguous) {
+				stringstream errTxt;
+				errTxt << "marginal_ancestral_posteriors(): unexpected base " << nuc[i][j] << " (out of range 0-5) in sequence " << i << " pattern " << j;
+				error(errTxt.str().c_str());
+			}
+		}
+	}
+	// For the tips, the likelihood of the observed base given the ancestor has state k depends only on the base,
+	// so it is tabulated as tip_message[i][4*obs+k], which is 1 if the base is unobserved
+	Matrix<double> tip_message(nseq,20);
+	for(i=0;i<nseq;i++) {
+		for(k=0;k<4;k++) {
+			for(l=0;l<4;l++) tip_message[i][4*l+k] = ptrans_flat[16*i+4*k+l];
+			tip_message[i][4*N_ambiguous+k] = 1.0;
+		}
+	}
+	/*	The patterns are processed in blocks, and the blocks in chunks shared among the threads, each of which allocates its
+		workspace once. Within a block, the partial likelihoods of each internal node are stored as four arrays (one per state)
+		over the patterns, as in maximum_likelihood_ancestral_sequences, so that the products with the transition matrices are
+		loops along contiguous arrays that the compiler can vectorize. For every internal node, inside[] holds the likelihood
+		of the subtree below it given its state, message[] the likelihood of that subtree given the state of its ancestor, and
+		outside[] the probability of its state and the data outside the subtree, scaled pattern by pattern so that the posterior
+		probabilities, the products of inside[] and outside[], sum to one. The messages of the tips are taken from tip_message,
+		and the outside probabilities of a tip are only needed, and only computed, where its base is unobserved. The inside
+		partials are rescaled when they risk underflow, and the logs of the scale factors accumulated per pattern.			*/
+	const int block_size = 64;
+	const int nblocks = (npat+block_size-1)/block_size;
+	const int nchunks = (nblocks<4*nthreads) ? nblocks : 4*nthreads;
+	const size_t node_stride = 4*block_size;
+	const int ninternal = nnodes-nseq;
+	parallel_for(nchunks,nthreads,[&](const int chunk) {
+		vector<double> inside((size_t)ninternal*node_stride), outside((size_t)ninternal*node_stride), message((size_t)ninternal*node_stride);
+		vector<double> scratch(3*node_stride), logscale(block_size), scale(block_size);
+		int block,i,j,k,l;
+		// Likelihood of the subtree below node c given the state of its ancestor, as four arrays over the patterns in the block
+		auto node_message = [&](const int c, const int j0, const int nb, double *buffer) -> const double* {
+			if(c>=nseq) return &message[(size_t)(c-nseq)*node_stride];
+			const double *T = tip_message[c];
+			int jc,kc;
+			for(jc=0;jc<nb;jc++) {
+				const double *Tj = T+4*nuc[c][j0+jc];
+				for(kc=0;kc<4;kc++) buffer[kc*block_size+jc] = Tj[kc];
+			}
+			return buffer;
+		};
+		// Unscaled outside probabilities of node c, from those of its ancestor and the message of its sibling
+		auto node_outside = [&](const int c, const int nb, const double *Ms, double *O) {
+			const int a = anc[c];
+			const double *Oa = &outside[(size_t)(a-nseq)*node_stride];
+			const double *P = &ptrans_flat[16*c];
+			double *W = &scratch[2*node_stride];
+			int jc,kc,lc;
+			for(kc=0;kc<4;kc++) {
+				for(jc=0;jc<nb;jc++) W[kc*block_size+jc] = Oa[kc*block_size+jc]*Ms[kc*block_size+jc];
+			}
+			for(lc=0;lc<4;lc++) {
+				double *Ol = O+lc*block_size;
+				for(jc=0;jc<nb;jc++) Ol[jc] = P[lc]*W[jc];
+				for(kc=1;kc<4;kc++) {
+					const double Pkl = P[4*kc+lc];
+					const double *Wk = W+kc*block_size;
+					for(jc=0;jc<nb;jc++) Ol[jc] += Pkl*Wk[jc];
+				}
+			}
+		};
+		for(block=(chunk*nblocks)/nchunks;block<((chunk+1)*nblocks)/nchunks;block++) {
+			const int j0 = block*block_size;
+			const int nb = (j0+block_size<npat) ? block_size : npat-j0;
+			for(j=0;j<nb;j++) logscale[j] = 0.0;
+			// Pruning pass, from the tips towards the root
+			for(i=nseq;i<nnodes;i++) {
+				double *L = &inside[(size_t)(i-nseq)*node_stride];
+				const double *M0 = node_message(desc0[i],j0,nb,&scratch[0]);
+				const double *M1 = node_message(desc1[i],j0,nb,&scratch[node_stride]);
+				bool underflow = false;
+				for(j=0;j<nb;j++) {
+					const double L0 = M0[j]*M1[j];
+					const double L1 = M0[block_size+j]*M1[block_size+j];
+					const double L2 = M0[2*block_size+j]*M1[2*block_size+j];
+					const double L3 = M0[3*block_size+j]*M1[3*block_size+j];
+					L[j] = L0;
+					L[block_size+j] = L1;
+					L[2*block_size+j] = L2;
+					L[3*block_size+j] = L3;
+					const double Lmax01 = (L0>L1) ? L0 : L1;
+					const double Lmax23 = (L2>L3) ? L2 : L3;
+					scale[j] = (Lmax01>Lmax23) ? Lmax01 : Lmax23;
+					underflow |= scale[j]<1.0e-100;
+				}
+				if(underflow) {
+					for(j=0;j<nb;j++) {
+						if(scale[j]<1.0e-100 && scale[j]>0.0) {
+							for(k=0;k<4;k++) L[k*block_size+j] /= scale[j];
+							logscale[j] += log(scale[j]);
+						}
+					}
+				}
+				if(i==root) break;
+				// message[k][j] = sum over l of P[k][l] inside[l][j]
+				const double *P = &ptrans_flat[16*i];
+				double *M = &message[(size_t)(i-nseq)*node_stride];
+				for(k=0;k<4;k++) {
+					double *Mk = M+k*block_size;
+					for(j=0;j<nb;j++) Mk[j] = P[4*k]*L[j]+P[4*k+1]*L[block_size+j]+P[4*k+2]*L[2*block_size+j]+P[4*k+3]*L[3*block_size+j];
+				}
+			}
+			// The root state is drawn from the equilibrium frequencies
+			{
+				const double *L = &inside[(size_t)(root-nseq)*node_stride];
+				double *O = &outside[(size_t)(root-nseq)*node_stride];
+				for(j=0;j<nb;j++) {
+					double p[4];
+					for(k=0;k<4;k++) p[k] = pi[k]*L[k*block_size+j];
+					const double lik = p[0]+p[1]+p[2]+p[3];
+					int kmax = 0;
+					for(k=1;k<4;k++) if(p[k]>p[kmax]) kmax = k;
+					const double inv = (lik>0.0) ? 1.0/lik : 0.0;
+					for(k=0;k<4;k++) O[k*block_size+j] = pi[k]*inv;
+					max_base[root][j0+j] = (Nucleotide)kmax;
+					max_posterior[root][j0+j] = (float)(p[kmax]*inv);
+					pattern_loglik[j0+j] = log(lik)+logscale[j];
+				}
+			}
+			// Outside pass, from the root towards the tips, and the most probable base of every node
+			for(i=root-1;i>=nseq;i--) {
+				const int a = anc[i];
+				const int sib = (desc0[a]==i) ? desc1[a] : desc0[a];
+				const double *L = &inside[(size_t)(i-nseq)*node_stride];
+				double *O = &outside[(size_t)(i-nseq)*node_stride];
+				node_outside(i,nb,node_message(sib,j0,nb,&scratch[0]),O);
+				for(j=0;j<nb;j++) {
+					const double p0 = O[j]*L[j];
+					const double p1 = O[block_size+j]*L[block_size+j];
+					const double p2 = O[2*block_size+j]*L[2*block_size+j];
+					const double p3 = O[3*block_size+j]*L[3*block_size+j];
+					const double sum = p0+p1+p2+p3;
+					const int k01 = (p1>p0) ? 1 : 0;
+					const int k23 = (p3>p2) ? 3 : 2;
+					const double pmax01 = (p1>p0) ? p1 : p0;
+					const double pmax23 = (p3>p2) ? p3 : p2;
+					const int kmax = (pmax23>pmax01) ? k23 : k01;
+					const double pmax = (pmax23>pmax01) ? pmax23 : pmax01;
+					const double inv = (sum>0.0) ? 1.0/sum : 0.0;
+					O[j] *= inv;
+					O[block_size+j] *= inv;
+					O[2*block_size+j] *= inv;
+					O[3*block_size+j] *= inv;
+					max_base[i][j0+j] = (Nucleotide)kmax;
+					max_posterior[i][j0+j] = (float)(pmax*inv);
+				}
+			}
+			// An observed base is certain, and an unobserved one distributed as the outside probabilities
+			for(i=0;i<nseq;i++) {
+				const Nucleotide *obs = &nuc[i][j0];
+				Nucleotide *base = &max_base[i][j0];
+				float *post = &max_posterior[i][j0];
+				bool unobserved = false;
+				for(j=0;j<nb;j++) {
+					base[j] = obs[j];
+					post[j] = 1.0f;
+					unobserved |= obs[j]==N_ambiguous;
+				}
+				if(!unobserved) continue;
+				const int a = anc[i];
+				const int sib = (desc0[a]==i) ? desc1[a] : desc0[a];
+				double *O = &scratch[node_stride];
+				node_outside(i,nb,node_message(sib,j0,nb,&scratch[0]),O);
+				for(j=0;j<nb;j++) {
+					if(obs[j]!=N_ambiguous) continue;
+					const double sum = O[j]+O[block_size+j]+O[2*block_size+j]+O[3*block_size+j];
+					int kmax = 0;
+					for(k=1;k<4;k++) if(O[k*block_size+j]>O[kmax*block_size+j]) kmax = k;
+					base[j] = (Nucleotide)kmax;
+					post[j] = (float)((sum>0.0) ? O[kmax*block_size+j]/sum : 0.0);
+				}
+			}
+		}
+	});
+	// Accumulate the log-likelihood over patterns in order
+	mydouble ML(1.0);
+	for(j=0;j<npat;j++) {
+		mydouble ML_temp;
+		ML_temp.setlog(pattern_loglik[j]);
+		ML *= pow(ML_temp,cpat[j]);
+	}
+	return ML;
+}
+
+// For every node, the most probable nucleotide at every pattern and its posterior probability, as base:probability (see marginal_ancestral_posteriors)
+void write_marginal_posteriors(const Matrix<Nucleotide> &max_base, const Matrix<float> &max_posterior, const vector<string> &all_node_names, const char* file_name) {
+	OutputFile fout(file_name);
+	if(!fout) {
+		stringstream errTxt;
+		errTxt << "write_marginal_posteriors(): could not open file " << file_name << " for writing";
+		error(errTxt.str().c_str());
+	}
+	const int nnodes = max_posterior.nrows();
+	const int npat = max_posterior.ncols();
+	static const char AGCTN[5] = {'A','G','C','T','N'};
+	int i,j;
+	char text[16];
+	for(i=0;i<nnodes;i++) {
+		fout.write(all_node_names[i]);
+		for(j=0;j<npat;j++) {
+			const int len = snprintf(text,sizeof(text),"\t%c:%.4f",AGCTN[max_base[i][j]],max_posterior[i][j]);
+			fout.write(text,len);
+		}
+		fout.put('\n');
+	}
+	fout.close();
+}
+
+// For every position in the original FASTA file, the log-likelihood of its pattern under the marginal reconstruction, or NA (not included)
+void write_site_loglik(const vector<bool> &iscompat, const vector<int> &ipat, const vector<double> &pattern_loglik, const char* file_name) {
+	OutputFile fout(file_name);
+	if(!fout) {
+		stringstream errTxt;
+		errTxt << "write_site_loglik(): could not open file " << file_name << " for writing";
+		error(errTxt.str().c_str());
+	}
+	int i,j;
+	char text[32];
+	for(i=0,j=0;i<iscompat.size();i++) {
+		if(i>0) fout.put(',');
+		if(iscompat[i]) {
+			if(j>=ipat.size()) {
+				stringstream errTxt;
+				errTxt << "write_site_loglik(): internal inconsistency in number of compatible sizes (" << j+1 << " or more) and number of patterns (" << ipat.size() << ")";
+				error(errTxt.str().c_str());
+			}
+			const int len = snprintf(text,sizeof(text),"%.10g",pattern_loglik[ipat[j]]);
+			fout.write(text,len);
+			++j;
+		} else {
+			fout.write("NA",2);
+		}
+	}
+	fout.put('\n');
+	fout.close();
+}
+
+void write_newick(const marginal_tree &ctree, const vector<string> &all_node_names, const char* file_name) {
+	ofstream fout(file_name);
+	if(!fout) {
+		stringstream errTxt;
+		errTxt << "write_newick(): could not open file " << file_name << " for writing";
+		error(errTxt.str().c_str());
+	}
+	write_newick(ctree,all_node_names,fout);
+	fout.close();
+}
+
+void write_newick(const marginal_tree &ctree, const vector<string> &all_node_names, ofstream &fout) {
+	if(!fout) {
+		stringstream errTxt;
+		errTxt << "write_newick(): could not open file stream for writing";
+		error(errTxt.str().c_str());
 	}
 	const int nnodes = ctree.size;
 	if(all_node_names.size()!=nnodes) {
@@ -1726,8 +2236,9 @@ void write_newick_node(const mt_node *node, const vector<string> &all_node_names
 	}
 }
 
-void write_ancestral_fasta(Matrix<Nucleotide> &nuc, vector<string> &all_node_names, const char* file_name) {
-	ofstream fout(file_name);
+// Sequences are formatted, and compressed if the file name asks for it, in parallel in blocks of about 4 Mb, which are written in order
+void write_ancestral_fasta(Matrix<Nucleotide> &nuc, vector<string> &all_node_names, const char* file_name, const int nthreads) {
+	OutputFile fout(file_name);
 	if(!fout) {
 		stringstream errTxt;
 		errTxt << "write_ancestral_fasta(): could not open file " << file_name << " for writing";
@@ -1739,42 +2250,85 @@ void write_ancestral_fasta(Matrix<Nucleotide> &nuc, vector<string> &all_node_nam
 		errTxt << "write_ancestral_fasta(): number of sequences (" << nuc.nrows() << ") does not equal number of node labels (" << all_node_names.size() << ")";
 		error(errTxt.str().c_str());
 	}
-	int i,pos;
-	for(i=0;i<nuc.nrows();i++) {
-		fout << ">" << all_node_names[i] << endl;
-		for(pos=0;pos<nuc.ncols();pos++) {
-			fout << AGCTN[nuc[i][pos]];
-		}
-		fout << endl;
-	}	
+	const int nrows = nuc.nrows();
+	const int ncols = nuc.ncols();
+	const int block_rows = (ncols<(1<<22)) ? (1<<22)/(ncols+1) : 1;
+	const int nblocks = (nrows+block_rows-1)/block_rows;
+	// Blocks are handled nthreads at a time to bound the memory used
+	const int nbatch = (nthreads>1) ? nthreads : 1;
+	vector<string> text(nbatch), block(nbatch);
+	int b0;
+	for(b0=0;b0<nblocks;b0+=nbatch) {
+		const int nb = (b0+nbatch<nblocks) ? nbatch : nblocks-b0;
+		parallel_for(nb,nthreads,[&](const int k) {
+			const int beg = (b0+k)*block_rows;
+			const int end = (beg+block_rows<nrows) ? beg+block_rows : nrows;
+			string &t = text[k];
+			t.clear();
+			int i,pos;
+			for(i=beg;i<end;i++) {
+				t += '>';
+				t += all_node_names[i];
+				t += '\n';
+				const size_t off = t.size();
+				t.resize(off+ncols);
+				for(pos=0;pos<ncols;pos++) t[off+pos] = AGCTN[nuc[i][pos]];
+				t += '\n';
+			}
+			output_encode(fout.compression,t.data(),t.size(),block[k]);
+		});
+		int k;
+		for(k=0;k<nb;k++) fout.write_encoded(block[k]);
+	}
 	fout.close();
 }
 
-void write_filtered_fasta(vector< vector<ImportationState> > &imported, DNA * fa,vector<bool> &ignore_site, const char* file_name) {
-	ofstream fout(file_name);
+void write_filtered_fasta(vector< vector<ImportedInterval> > &imported, EncodedAlignment * fa,vector<bool> &ignore_site, const char* file_name) {
+	OutputFile fout(file_name);
 	if(!fout) {
 		stringstream errTxt;
 		errTxt << "write_filtered_fasta(): could not open file " << file_name << " for writing";
 		error(errTxt.str().c_str());
 	}
 	int n,pos;
-	vector<bool> tokeep(fa->lseq);
+	// Sweep through the imported intervals of all branches, counting at every site the number that cover it
+	vector<int> nbeg(fa->lseq+1,0);
+	for (n=0;n<imported.size();n++) {
+		int k;
+		for (k=0;k<imported[n].size();k++) {
+			++nbeg[imported[n][k].beg];
+			--nbeg[imported[n][k].end];
+		}
+	}
+	vector<int> tokeep(0);
+	int ncover = 0;
 	for (pos=0;pos<fa->lseq;pos++) {
-		tokeep[pos]=true;
-		if (ignore_site[pos]) tokeep[pos]=false;
-		for (n=0;n<imported.size();n++) if(imported[n][pos]==Imported) tokeep[pos]=false;
-	}
-	for(n=0;n<fa->nseq;n++)
-	{
-		fout << ">" << fa->label[n] << endl;
-		for(pos=0;pos<fa->lseq;pos++)
-			if (tokeep[pos]) fout << fa->sequence[n][pos];
-		fout << endl;
-	}	fout.close();
+		ncover += nbeg[pos];
+		if(ncover==0 && !ignore_site[pos]) tokeep.push_back(pos);
+	}
+	const int nkeep = tokeep.size();
+	// Decode the site-major alignment a group of sequences at a time
+	const int group_size = 32;
+	vector<string> seq(group_size,string(nkeep,' '));
+	int n0,k;
+	for(n0=0;n0<fa->nseq;n0+=group_size) {
+		const int ngroup = (n0+group_size<fa->nseq) ? group_size : fa->nseq-n0;
+		for(k=0;k<nkeep;k++) {
+			for(n=0;n<ngroup;n++) seq[n][k] = fa->base(n0+n,tokeep[k]);
+		}
+		for(n=0;n<ngroup;n++) {
+			fout.put('>');
+			fout.write(fa->label[n0+n]);
+			fout.put('\n');
+			fout.write(seq[n]);
+			fout.put('\n');
+		}
+	}
+	fout.close();
 }
 
 void write_position_cross_reference(vector<bool> &iscompat, vector<int> &ipat, const char* file_name) {
-	ofstream fout(file_name);
+	OutputFile fout(file_name);
 	if(!fout) {
 		stringstream errTxt;
 		errTxt << "write_position_cross_reference(): could not open file " << file_name << " for writing";
@@ -1792,29 +2346,97 @@ void write_position_cross_reference(vector<bool> &iscompat, vector<int> &ipat, c
 			pat = ipat[j];
 			++j;
 		}
-		if(i>0) fout << ',';
-		fout << pat+1;
+		if(i>0) fout.put(',');
+		fout.write_int(pat+1);
 	}
-	fout << endl;
+	fout.put('\n');
 	fout.close();
 }
 
-mydouble likelihood_branch(const int dec_id, const int anc_id, const Matrix<Nucleotide> &node_nuc, const vector<int> &pat1, const vector<int> &cpat, const double kappa, const vector<double> &pinuc, const double branch_length) {
+// Counts of the ancestral (row) and descendant (column) nucleotides on the branch above dec_id, over the patterns weighted by their frequencies
+Matrix<double> substitution_counts(const int dec_id, const int anc_id, const Matrix<Nucleotide> &node_nuc, const vector<int> &cpat) {
+	Matrix<double> count(4,4,0.0);
+	const int npat = cpat.size();
+	int i;
+	for(i=0;i<npat;i++) {
+		count[node_nuc[anc_id][i]][node_nuc[dec_id][i]] += (double)cpat[i];
+	}
+	return count;
+}
+
+// Number of sites at which the ancestral and descendant nucleotides differ, from the substitution counts
+double substitution_differences(const Matrix<double> &count) {
+	double d = 0.0;
+	int i,j;
+	for(i=0;i<4;i++) {
+		for(j=0;j<4;j++) {
+			if(i!=j) d += count[i][j];
+		}
+	}
+	return d;
+}
+
+// Crude estimate of a branch length from its substitution counts: the proportion of sites that differ, with one pseudo-difference in two pseudo-sites
+double crude_branch_length(const Matrix<double> &count) {
+	double pd_den = 2.0;
+	int i,j;
+	for(i=0;i<4;i++) {
+		for(j=0;j<4;j++) pd_den += count[i][j];
+	}
+	return (1.0+substitution_differences(count))/pd_den;
+}
+
+/*	Summarize the first nbranch branches of the tree, in parallel, in one pass over the patterns of the reconstructed
+	ancestral sequences. Every analysis takes its substitution counts, crude branch lengths and informative branches
+	from the result instead of scanning the sites in use again.	*/
+vector<BranchSummary> summarize_branches(const marginal_tree &tree, const Matrix<Nucleotide> &node_nuc, const vector<int> &cpat, const int nbranch, const int nthreads) {
+	TimedPhase timed("summarize_branches");
+	vector<BranchSummary> summary(nbranch);
+	parallel_for(nbranch,nthreads,[&](const int i) {
+		BranchSummary &s = summary[i];
+		s.count = substitution_counts(tree.node[i].id,tree.node[i].ancestor->id,node_nuc,cpat);
+		s.differences = substitution_differences(s.count);
+		s.initial_branch_length = crude_branch_length(s.count);
+		s.informative = (s.differences>=1.0);
+	});
+	return summary;
+}
+
+// The likelihood of a branch without recombination, which depends on the data only through its substitution counts
+mydouble likelihood_branch(const Matrix<double> &count, const double kappa, const vector<double> &pinuc, const double branch_length) {
 	mydouble ML(1.0);
-	const int npat = pat1.size();
 	// Define an HKY85 emission probability matrix for Unimported sites
 	Matrix<mydouble> pemis;
 	pemis = compute_HKY85_ptrans(branch_length,kappa,pinuc);
-	// Cycle through the patterns calculating the likelihood
-	int i;
-	for(i=0;i<npat;i++) {
-		Nucleotide dec = node_nuc[dec_id][i];
-		Nucleotide anc = node_nuc[anc_id][i];
-		ML *= pow(pemis[anc][dec],(double)cpat[i]);
+	// Cycle through the pairs of ancestral and descendant nucleotides calculating the likelihood
+	int i,j;
+	for(i=0;i<4;i++) {
+		for(j=0;j<4;j++) {
+			if(count[i][j]>0.0) ML *= pow(pemis[i][j],count[i][j]);
+		}
 	}
 	return ML;
 }
 
+// Precompute the observations for the ClonalFrame HMM once the ancestral sequences have been reconstructed.
+// emission_class[i][j] is, for the branch above node i and pattern j, the ancestral and descendant nucleotides packed into one byte
+// (see pack_emission_class). The HMM routines then read a single byte row per branch instead of the sequences of both nodes.
+Matrix<unsigned char> compute_emission_classes(const marginal_tree &tree, const Matrix<Nucleotide> &node_nuc) {
+	const int nnodes = node_nuc.nrows();
+	const int npat = node_nuc.ncols();
+	Matrix<unsigned char> emission_class(nnodes,npat,0);
+	int i,j;
+	for(i=0;i<nnodes;i++) {
+		if(tree.node[i].ancestor==NULL) continue;
+		const int dec_id = tree.node[i].id;
+		const int anc_id = tree.node[i].ancestor->id;
+		for(j=0;j<npat;j++) {
+			emission_class[dec_id][j] = pack_emission_class(node_nuc[anc_id][j],node_nuc[dec_id][j]);
+		}
+	}
+	return emission_class;
+}
+
 bool string_to_bool(const string s, const string label) {
 	int i;
 	string S = s;
@@ -1827,7 +2449,416 @@ bool string_to_bool(const string s, const string label) {
 	return false;
 }
 
-void write_importation_status_intervals(vector< vector<ImportationState> > &imported, vector<string> &all_node_names, vector<bool> &isBLC, vector<int> &compat, const char* file_name, const int root_node,  const char* chr_name) {
+// Continue the checksum h over len bytes of data, eight bytes at a time
+unsigned long long checksum_bytes(const void* data, const size_t len, unsigned long long h) {
+	const unsigned char *text = (const unsigned char*)data;
+	size_t pos;
+	for(pos=0;pos+8<=len;pos+=8) {
+		unsigned long long w;
+		memcpy(&w,text+pos,8);
+		h = (h ^ w) * 0x100000001b3ULL;
+		h ^= h >> 29;
+	}
+	for(;pos<len;pos++) h = (h ^ text[pos]) * 0x100000001b3ULL;
+	return h;
+}
+
+// Checksum of the contents of a file, read through a memory map
+unsigned long long checksum_file(const char* filename) {
+	const int fd = open(filename,O_RDONLY);
+	struct stat st;
+	if(fd<0 || fstat(fd,&st)!=0) {
+		stringstream errTxt;
+		errTxt << "checksum_file(): could not open file " << filename;
+		error(errTxt.str().c_str());
+	}
+	const size_t len = st.st_size;
+	unsigned long long h = 0xcbf29ce484222325ULL ^ (unsigned long long)len;
+	if(len>0) {
+		void *map = mmap(NULL,len,PROT_READ,MAP_PRIVATE,fd,0);
+		if(map==MAP_FAILED) {
+			stringstream errTxt;
+			errTxt << "checksum_file(): could not map file " << filename << " into memory";
+			error(errTxt.str().c_str());
+		}
+		h = checksum_bytes(map,len,h);
+		munmap(map,len);
+	}
+	close(fd);
+	return h;
+}
+
+// Sequential reader for the memory-mapped cache file, which fails (rather than stopping the program) when the file is truncated
+struct CacheReader {
+	const char *pos, *end;
+	bool ok;
+	CacheReader(const char *_begin, const char *_end) : pos(_begin), end(_end), ok(true) {}
+	bool read_bytes(void *dest, const size_t n) {
+		if(!ok || (size_t)(end-pos)<n) return ok = false;
+		if(n>0) memcpy(dest,pos,n);
+		pos += n;
+		return true;
+	}
+	template<typename T> bool read(T &x) {
+		return read_bytes(&x,sizeof(T));
+	}
+	template<typename T> bool read_vector(vector<T> &v) {
+		unsigned long long n;
+		if(!read(n) || n>(unsigned long long)(end-pos)/sizeof(T)) return ok = false;
+		v.resize(n);
+		return read_bytes((n>0) ? &v[0] : NULL,n*sizeof(T));
+	}
+	bool read_vector(vector<bool> &v) {
+		vector<unsigned char> b;
+		if(!read_vector(b)) return false;
+		v = vector<bool>(b.begin(),b.end());
+		return true;
+	}
+	bool read(string &s) {
+		vector<char> b;
+		if(!read_vector(b)) return false;
+		s = string(b.begin(),b.end());
+		return true;
+	}
+};
+
+template<typename T> void cache_write(ofstream &fout, const T &x) {
+	fout.write((const char*)&x,sizeof(T));
+}
+
+template<typename T> void cache_write_vector(ofstream &fout, const vector<T> &v) {
+	cache_write(fout,(unsigned long long)v.size());
+	if(v.size()>0) fout.write((const char*)&v[0],v.size()*sizeof(T));
+}
+
+void cache_write_vector(ofstream &fout, const vector<bool> &v) {
+	cache_write_vector(fout,vector<unsigned char>(v.begin(),v.end()));
+}
+
+static const char alignment_cache_magic[8] = {'C','F','M','L','I','D','X','\0'};
+
+AlignmentCache::AlignmentCache(const string &_filename, const unsigned int _input_type) : filename(_filename), fasta_checksum(0), newick_checksum(0), input_type(_input_type), modified(true) {
+}
+
+// Whether the site patterns and ancestral sequences of a cached reconstruction are consistent with the alignment, so that
+// every index taken from them later is in range
+static bool valid_reconstruction(const AncestralReconstruction &recon, const EncodedAlignment &aln) {
+	const int npat = recon.cpat.size();
+	if(recon.usesite.size()!=aln.lseq || recon.pat1.size()!=npat || recon.pi.size()!=4) return false;
+	if(recon.node_nuc.nrows()!=2*aln.nseq-1 || recon.node_nuc.ncols()!=npat) return false;
+	int i, nused = 0;
+	for(i=0;i<aln.lseq;i++) nused += recon.usesite[i];
+	if(recon.ipat.size()!=nused) return false;
+	for(i=0;i<npat;i++) {
+		if(recon.pat1[i]<0 || recon.pat1[i]>=aln.lseq || recon.cpat[i]<1) return false;
+	}
+	for(i=0;i<recon.ipat.size();i++) {
+		if(recon.ipat[i]<0 || recon.ipat[i]>=npat) return false;
+	}
+	return true;
+}
+
+// Read the cache file if it exists, is intact and matches the input files, returning false otherwise
+bool AlignmentCache::read(const char* fasta_file, const char* newick_file, EncodedAlignment &aln, vector<SiteInterval> &sites_to_ignore, vector<int> &compat, vector<bool> &anyN) {
+	fasta_checksum = checksum_file(fasta_file);
+	newick_checksum = checksum_file(newick_file);
+	const int fd = open(filename.c_str(),O_RDONLY);
+	if(fd<0) return false;
+	struct stat st;
+	st.st_size = 0;
+	void *map = MAP_FAILED;
+	if(fstat(fd,&st)==0 && st.st_size>0) map = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	if(map==MAP_FAILED) return false;
+	// The file ends with a checksum of everything before it, which covers the cached contents themselves
+	size_t payload_len = 0;
+	bool intact = false;
+	if(st.st_size>=sizeof(unsigned long long)) {
+		payload_len = st.st_size-sizeof(unsigned long long);
+		unsigned long long file_payload_checksum;
+		memcpy(&file_payload_checksum,(const char*)map+payload_len,sizeof(unsigned long long));
+		intact = file_payload_checksum==checksum_bytes(map,payload_len,0xcbf29ce484222325ULL ^ (unsigned long long)payload_len);
+	}
+	CacheReader in((const char*)map,(const char*)map+payload_len);
+	in.ok = intact;
+	char magic[8];
+	unsigned int file_version, file_input_type;
+	unsigned long long file_fasta_checksum, file_newick_checksum;
+	in.read(magic);
+	in.read(file_version);
+	in.read(file_input_type);
+	in.read(file_fasta_checksum);
+	in.read(file_newick_checksum);
+	bool match = in.ok && memcmp(magic,alignment_cache_magic,8)==0 && file_version==version && file_input_type==input_type
+		&& file_fasta_checksum==fasta_checksum && file_newick_checksum==newick_checksum;
+	if(match) {
+		// The encoded alignment
+		int i;
+		in.read(aln.nseq);
+		in.read(aln.lseq);
+		if(aln.nseq<1 || aln.lseq<0) in.ok = false;
+		aln.label = vector<string>(in.ok ? aln.nseq : 0);
+		for(i=0;i<aln.label.size();i++) in.read(aln.label[i]);
+		aln.site_bytes = (aln.nseq+1)/2;
+		in.read_vector(aln.data);
+		// The sites to ignore and the results of compute_compatibility
+		in.read_vector(sites_to_ignore);
+		in.read_vector(compat);
+		in.read_vector(anyN);
+		// The ancestral reconstructions
+		unsigned int nrecon = 0;
+		in.read(nrecon);
+		reconstruction = vector<AncestralReconstruction>(in.ok ? nrecon : 0);
+		for(i=0;i<reconstruction.size();i++) {
+			AncestralReconstruction &recon = reconstruction[i];
+			in.read(recon.kappa);
+			in.read_vector(recon.usesite);
+			in.read_vector(recon.pat1);
+			in.read_vector(recon.cpat);
+			in.read_vector(recon.ipat);
+			in.read_vector(recon.pi);
+			int nrows = 0, ncols = 0;
+			in.read(nrows);
+			in.read(ncols);
+			if(!in.ok || nrows<0 || ncols<0 || (unsigned long long)nrows*ncols>(unsigned long long)(in.end-in.pos)) {
+				in.ok = false;
+				break;
+			}
+			recon.node_nuc = Matrix<Nucleotide>(nrows,ncols);
+			int r,c;
+			for(r=0;r<nrows;r++) {
+				for(c=0;c<ncols;c++) {
+					const unsigned char b = (unsigned char)in.pos[c];
+					if(b>N_ambiguous) in.ok = false;
+					recon.node_nuc[r][c] = (Nucleotide)b;
+				}
+				in.pos += ncols;
+			}
+			in.read(recon.loglik);
+			if(in.ok && !valid_reconstruction(recon,aln)) in.ok = false;
+			if(!in.ok) break;
+		}
+		match = in.ok && in.pos==in.end && aln.data.size()==aln.site_bytes*(size_t)aln.lseq
+			&& compat.size()==aln.lseq && anyN.size()==aln.lseq;
+		for(i=0;match && i<sites_to_ignore.size();i++) {
+			match = sites_to_ignore[i].beg>=0 && sites_to_ignore[i].beg<=sites_to_ignore[i].end && sites_to_ignore[i].end<=aln.lseq;
+		}
+	}
+	munmap(map,st.st_size);
+	if(!match) {
+		stringstream wrnTxt;
+		wrnTxt << "cache file " << filename << " is damaged or does not match the input files and will be rebuilt";
+		warning(wrnTxt.str().c_str());
+		reconstruction.clear();
+		return false;
+	}
+	used = vector<bool>(reconstruction.size(),false);
+	modified = false;
+	return true;
+}
+
+const AncestralReconstruction* AlignmentCache::find_reconstruction(const vector<bool> &usesite, const double kappa) {
+	int i;
+	for(i=0;i<reconstruction.size();i++) {
+		if(reconstruction[i].kappa==kappa && reconstruction[i].usesite==usesite) {
+			used[i] = true;
+			return &reconstruction[i];
+		}
+	}
+	return NULL;
+}
+
+void AlignmentCache::add_reconstruction(const AncestralReconstruction &recon) {
+	reconstruction.push_back(recon);
+	used.push_back(true);
+	modified = true;
+}
+
+// Write to a temporary file and rename it, so that an interrupted run never leaves a partial cache behind
+void AlignmentCache::write(const EncodedAlignment &aln, const vector<SiteInterval> &sites_to_ignore, const vector<int> &compat, const vector<bool> &anyN) {
+	const string tmp_filename = filename + ".tmp";
+	ofstream fout(tmp_filename.c_str(),std::ios::binary);
+	if(!fout) {
+		stringstream errTxt;
+		errTxt << "AlignmentCache::write(): could not open file " << tmp_filename << " for writing";
+		error(errTxt.str().c_str());
+	}
+	fout.write(alignment_cache_magic,8);
+	cache_write(fout,(unsigned int)version);
+	cache_write(fout,input_type);
+	cache_write(fout,fasta_checksum);
+	cache_write(fout,newick_checksum);
+	cache_write(fout,aln.nseq);
+	cache_write(fout,aln.lseq);
+	int i;
+	for(i=0;i<aln.nseq;i++) cache_write_vector(fout,vector<char>(aln.label[i].begin(),aln.label[i].end()));
+	cache_write_vector(fout,aln.data);
+	cache_write_vector(fout,sites_to_ignore);
+	cache_write_vector(fout,compat);
+	cache_write_vector(fout,anyN);
+	// Reconstructions not used by the current run are dropped, so that the file does not grow with every new value of kappa or set of sites
+	unsigned int nrecon = 0;
+	for(i=0;i<reconstruction.size();i++) nrecon += used[i];
+	cache_write(fout,nrecon);
+	for(i=0;i<reconstruction.size();i++) {
+		if(!used[i]) continue;
+		const AncestralReconstruction &recon = reconstruction[i];
+		cache_write(fout,recon.kappa);
+		cache_write_vector(fout,recon.usesite);
+		cache_write_vector(fout,recon.pat1);
+		cache_write_vector(fout,recon.cpat);
+		cache_write_vector(fout,recon.ipat);
+		cache_write_vector(fout,recon.pi);
+		const int nrows = recon.node_nuc.nrows(), ncols = recon.node_nuc.ncols();
+		cache_write(fout,nrows);
+		cache_write(fout,ncols);
+		vector<unsigned char> row(ncols);
+		int r,c;
+		for(r=0;r<nrows;r++) {
+			for(c=0;c<ncols;c++) row[c] = (unsigned char)recon.node_nuc[r][c];
+			if(ncols>0) fout.write((const char*)&row[0],ncols);
+		}
+		cache_write(fout,recon.loglik);
+	}
+	fout.close();
+	// Append the checksum of the contents, verified by read
+	if(fout) {
+		const unsigned long long payload_checksum = checksum_file(tmp_filename.c_str());
+		fout.open(tmp_filename.c_str(),std::ios::binary | std::ios::app);
+		cache_write(fout,payload_checksum);
+		fout.close();
+	}
+	if(!fout || rename(tmp_filename.c_str(),filename.c_str())!=0) {
+		stringstream errTxt;
+		errTxt << "AlignmentCache::write(): could not write file " << filename;
+		error(errTxt.str().c_str());
+	}
+	modified = false;
+}
+
+static const char em_checkpoint_magic[8] = {'C','F','M','L','E','M','C','\0'};
+
+EMCheckpoint::EMCheckpoint(const string &_filename, const int _every_steps, const double _every_seconds, const bool _resume) : filename(_filename), every_steps(_every_steps), every_seconds(_every_seconds), resume(_resume), input_checksum(0), last_steps(0), last_time(phase_timings().wall_time()) {
+}
+
+// Read the checkpoint if resuming and it matches the EM routine and its inputs, returning false otherwise
+bool EMCheckpoint::load(EMState &state) {
+	if(!resume) return false;
+	const int fd = open(filename.c_str(),O_RDONLY);
+	if(fd<0) {
+		stringstream wrnTxt;
+		wrnTxt << "no EM checkpoint " << filename << " to resume from";
+		warning(wrnTxt.str().c_str());
+		return false;
+	}
+	struct stat st;
+	st.st_size = 0;
+	void *map = MAP_FAILED;
+	if(fstat(fd,&st)==0 && st.st_size>0) map = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+	close(fd);
+	bool match = false;
+	if(map!=MAP_FAILED) {
+		CacheReader in((const char*)map,(const char*)map+st.st_size);
+		char magic[8];
+		unsigned int file_version;
+		string file_label;
+		unsigned long long file_input_checksum;
+		in.read(magic);
+		in.read(file_version);
+		in.read(file_label);
+		in.read(file_input_checksum);
+		match = in.ok && memcmp(magic,em_checkpoint_magic,8)==0 && file_version==version && file_label==label && file_input_checksum==input_checksum;
+		if(match) {
+			in.read_vector(state.p0);
+			in.read_vector(state.p1);
+			in.read(state.L0);
+			in.read(state.step_max);
+			in.read(state.iter.steps);
+			in.read(state.iter.extrapolations);
+			in.read(state.iter.rejected);
+			state.iter.converged = false;
+			match = in.ok && in.pos==in.end;
+		}
+		munmap(map,st.st_size);
+	}
+	if(!match) {
+		stringstream wrnTxt;
+		wrnTxt << "EM checkpoint " << filename << " does not match this analysis and will be ignored";
+		warning(wrnTxt.str().c_str());
+		return false;
+	}
+	cout << "Resuming EM from checkpoint " << filename << " after " << state.iter.steps << " steps" << endl;
+	last_steps = state.iter.steps;
+	last_time = phase_timings().wall_time();
+	return true;
+}
+
+// Write the checkpoint if the number of steps or the time since the last one is due
+void EMCheckpoint::save(const EMState &state) {
+	const double now = phase_timings().wall_time();
+	if((every_steps>0 && state.iter.steps-last_steps>=every_steps) || (every_seconds>0.0 && now-last_time>=every_seconds)) {
+		write(state);
+		last_steps = state.iter.steps;
+		last_time = now;
+	}
+}
+
+// Write to a temporary file and rename it, so that an interruption while writing leaves the previous checkpoint intact
+void EMCheckpoint::write(const EMState &state) {
+	TimedPhase timed("write_em_checkpoint");
+	const string tmp_filename = filename + ".tmp";
+	ofstream fout(tmp_filename.c_str(),std::ios::binary);
+	if(!fout) {
+		stringstream errTxt;
+		errTxt << "EMCheckpoint::write(): could not open file " << tmp_filename << " for writing";
+		error(errTxt.str().c_str());
+	}
+	fout.write(em_checkpoint_magic,8);
+	cache_write(fout,(unsigned int)version);
+	cache_write_vector(fout,vector<char>(label.begin(),label.end()));
+	cache_write(fout,input_checksum);
+	cache_write_vector(fout,state.p0);
+	cache_write_vector(fout,state.p1);
+	cache_write(fout,state.L0);
+	cache_write(fout,state.step_max);
+	cache_write(fout,state.iter.steps);
+	cache_write(fout,state.iter.extrapolations);
+	cache_write(fout,state.iter.rejected);
+	fout.close();
+	if(!fout || rename(tmp_filename.c_str(),filename.c_str())!=0) {
+		stringstream errTxt;
+		errTxt << "EMCheckpoint::write(): could not write file " << filename;
+		error(errTxt.str().c_str());
+	}
+}
+
+// Delete the checkpoint once the EM algorithm has finished
+void EMCheckpoint::remove() {
+	::remove(filename.c_str());
+}
+
+// Checksum identifying the inputs of an EM routine, including its starting point and the options that change its results
+unsigned long long checksum_EM_inputs(const char* label, const marginal_tree &tree, const Matrix<unsigned char> &emission_class, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const vector<bool> &informative, const vector<double> &prior_a, const vector<double> &prior_b, const vector<double> &param, const HMMKernel kernel, const EMAccelerator accel) {
+	unsigned long long h = checksum_bytes(label,strlen(label),0xcbf29ce484222325ULL);
+	int i;
+	for(i=0;i<tree.size;i++) h = checksum_bytes(&tree.node[i].edge_time,sizeof(double),h);
+	for(i=0;i<emission_class.nrows();i++) {
+		if(emission_class.ncols()>0) h = checksum_bytes(&emission_class[i][0],emission_class.ncols(),h);
+	}
+	h = checksum_bytes(position.data(),position.size()*sizeof(double),h);
+	h = checksum_bytes(ipat.data(),ipat.size()*sizeof(int),h);
+	h = checksum_bytes(&kappa,sizeof(double),h);
+	h = checksum_bytes(pinuc.data(),pinuc.size()*sizeof(double),h);
+	const vector<unsigned char> informative_bytes(informative.begin(),informative.end());
+	h = checksum_bytes(informative_bytes.data(),informative_bytes.size(),h);
+	h = checksum_bytes(prior_a.data(),prior_a.size()*sizeof(double),h);
+	h = checksum_bytes(prior_b.data(),prior_b.size()*sizeof(double),h);
+	h = checksum_bytes(param.data(),param.size()*sizeof(double),h);
+	const int options[2] = {(int)kernel,(int)accel};
+	return checksum_bytes(options,sizeof(options),h);
+}
+
+void write_importation_status_intervals(vector< vector<ImportedInterval> > &imported, vector<string> &all_node_names, vector<bool> &isBLC, vector<int> &compat, const char* file_name, const int root_node,  const char* chr_name) {
 	ofstream fout(file_name);
 	if(!fout) {
 		stringstream errTxt;
@@ -1848,133 +2879,152 @@ void write_importation_status_intervals(vector< vector<ImportationState> > &impo
 	if (strlen(chr_name)==0) 
 		fout << "Node" << tab << "Beg" << tab << "End" << endl;
 	//else fout << "Chr" << tab << "Beg" << tab << "End" << tab << "Node" << endl;
-	int i,pos;
+	int i,k;
 	for(i=0;i<root_node;i++) {
-		// Identify intervals
-		bool in_interval = (imported[i][0]==Imported);
-		int interval_beg = 0;
-		for(pos=1;pos<imported[i].size();pos++) {
-			if(in_interval) {
-				if(imported[i][pos]==Unimported) {
-					if (strlen(chr_name)==0) 
-						fout << all_node_names[i] << tab << interval_beg+1 << tab << pos << endl;
-					else fout << chr_name << tab << interval_beg+1 << tab << pos << tab << all_node_names[i] << endl;
-					in_interval = false;
-				}
-			} else {
-				if(imported[i][pos]==Imported) {
-					interval_beg = pos;
-					in_interval = true;
-				}
-			}
-		}
-		if(in_interval) {
+		// Intervals are 0-based and exclusive of the end, and output 1-based and inclusive
+		for(k=0;k<imported[i].size();k++) {
+			const ImportedInterval &iv = imported[i][k];
 			if (strlen(chr_name)==0)
-				fout << all_node_names[i] << tab << interval_beg+1 << tab << pos << endl;
-			else fout << chr_name << tab << interval_beg+1 << tab << pos << tab << all_node_names[i] << endl;
+				fout << all_node_names[i] << tab << iv.beg+1 << tab << iv.end << endl;
+			else fout << chr_name << tab << iv.beg+1 << tab << iv.end << tab << all_node_names[i] << endl;
 		}
 	}
 	fout.close();
 }
 
-mydouble maximum_likelihood_ClonalFrame_branch_allsites(const int dec_id, const int anc_id, const Matrix<Nucleotide> &node_nuc, const vector<bool> &iscompat, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const double branch_length, const double rho_over_theta, const double mean_import_length, const double import_divergence, vector<ImportationState> &is_imported) {
-	mydouble ML(0.0);
-	// Store the positions of **all** sites
-	is_imported = vector<ImportationState>(iscompat.size(),Unimported);
-	// subseq_ML[i][j] is, for position i, the subsequence maximum likelihood given the next position has state j = {Unimported,Imported}
-	Matrix<mydouble> subseq_ML(iscompat.size(),2);
-	// path_ML[i][j] is, for position i, the state of position i that maximizes the subsequence likelihood given the next position has state j = {Unimported,Imported}
-	Matrix<ImportationState> path_ML(iscompat.size(),2);
-	// Define an HKY85 emission probability matrix for Unimported sites
-	Matrix<mydouble> pemisUnimported;
-	pemisUnimported = compute_HKY85_ptrans(branch_length,kappa,pinuc);
-	// Define an HKY85 emission probability matrix for Imported sites
-	Matrix<mydouble> pemisImported;
-	pemisImported = compute_HKY85_ptrans(import_divergence,kappa,pinuc);
+/*	For a particular branch, find the most likely importation state at every site, of which only the compatible sites at position
+	carry an emission. The recursion visits only those sites (and the first and last site). Across the gap of d steps between
+	two of them the transitions combine in closed form: because the determinant of the transition matrix, exp(-totrecrate), is
+	positive, a best path through a gap switches state at most twice, and stays in a single state over the whole interior of
+	the gap. So a gap costs O(1) whatever its length, and the result is written directly as the list of imported intervals. */
+mydouble maximum_likelihood_ClonalFrame_branch_allsites(const int dec_id, const Matrix<unsigned char> &emission_class, const vector<double> &position, const int nsites, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const double branch_length, const double rho_over_theta, const double mean_import_length, const double import_divergence, vector<ImportedInterval> &imported) {
+	imported.clear();
+	if(nsites<1 || position.size()!=ipat.size()) {
+		stringstream errTxt;
+		errTxt << "maximum_likelihood_ClonalFrame_branch_allsites(): internal inconsistency in tracking informative sites";
+		error(errTxt.str().c_str());
+	}
+	// Log HKY85 emission probabilities for Unimported and Imported sites respectively
+	const Matrix<mydouble> pemisUnimported = compute_HKY85_ptrans(branch_length,kappa,pinuc);
+	const Matrix<mydouble> pemisImported = compute_HKY85_ptrans(import_divergence,kappa,pinuc);
+	double lemis[2][4][4];
+	int a,b;
+	for(a=0;a<4;a++) {
+		for(b=0;b<4;b++) {
+			lemis[Unimported][a][b] = pemisUnimported[a][b].LOG();
+			lemis[Imported][a][b] = pemisImported[a][b].LOG();
+		}
+	}
 	// Recombination parameters
 	const double recrate = rho_over_theta*branch_length;
 	const double endrecrate = 1.0/mean_import_length;
-	const double totrecrate = recrate+endrecrate;	
+	const double totrecrate = recrate+endrecrate;
 	// Equilibrium frequency of unimported and imported sites respectively
 	const double pi[2] = {endrecrate/totrecrate,recrate/totrecrate};
-	// Define a transition probability matrix
-	Matrix<mydouble> ptrans(2,2,0.0);
-	// These probabilities do not change until (i==0)
-	ptrans[0][0] = (mydouble)(exp(-totrecrate)+pi[0]*(1-exp(-totrecrate)));
-	ptrans[0][1] = (mydouble)(pi[1]*(1-exp(-totrecrate)));
-	ptrans[1][1] = (mydouble)(exp(-totrecrate)+pi[1]*(1-exp(-totrecrate)));
-	ptrans[1][0] = (mydouble)(pi[0]*(1-exp(-totrecrate)));
-	// Beginning at the last variable site, calculate the subsequence maximum likelihood
-	int i,j;
-	for(i=iscompat.size()-1,j=ipat.size();i>=0;i--) {
-		if(i==0) {
-			ptrans[0][0] = pi[0];
-			ptrans[1][0] = pi[0];
-			ptrans[0][1] = pi[1];
-			ptrans[1][1] = pi[1];
-		}
-		// If the previous position's state (leftwards) is j, what is the maximum likelihood of the subsequence from the current position to the last (rightwards)?
-		// And what is the state k of the position that achieves that maximum value?
-		mydouble UU,UI,IU,II;
-		if(iscompat[i]) {
-			j--;
-			if(j<0) {
-				stringstream errTxt;
-				errTxt << "maximum_likelihood_ClonalFrame_branch_allsites(): internal inconsistency in tracking informative sites";
-				error(errTxt.str().c_str());
+	// Log transition probabilities between adjacent sites
+	double lptrans[2][2];
+	lptrans[0][0] = log(exp(-totrecrate)+pi[0]*(1-exp(-totrecrate)));
+	lptrans[0][1] = log(pi[1]*(1-exp(-totrecrate)));
+	lptrans[1][1] = log(exp(-totrecrate)+pi[1]*(1-exp(-totrecrate)));
+	lptrans[1][0] = log(pi[0]*(1-exp(-totrecrate)));
+	// Log probability of the best path from state a to state b over d>=1 steps, and the state it takes in between
+	auto gap = [&](const int a, const int b, const int d, int &interior) -> double {
+		if(d==1) {
+			interior = a;
+			return lptrans[a][b];
+		}
+		if(a!=b) {
+			// Stay in the more likely state of the two, switching at the first or last step
+			interior = (lptrans[a][a]>=lptrans[b][b]) ? a : b;
+			return (double)(d-1)*lptrans[interior][interior]+lptrans[a][b];
+		}
+		// Stay in state a, or switch to the other state for the whole interior
+		const int o = 1-a;
+		const double stay = (double)d*lptrans[a][a];
+		const double excursion = lptrans[a][o]+lptrans[o][a]+((d>2) ? (double)(d-2)*lptrans[o][o] : 0.0);
+		interior = (excursion>stay) ? o : a;
+		return (excursion>stay) ? excursion : stay;
+	};
+	// The sites visited: the first site, the compatible sites and the last site
+	const int ninf = position.size();
+	vector<int> site(0), pat(0);
+	site.reserve(ninf+2);
+	pat.reserve(ninf+2);
+	int j;
+	if(ninf==0 || (int)position[0]>0) {
+		site.push_back(0);
+		pat.push_back(-1);
+	}
+	for(j=0;j<ninf;j++) {
+		site.push_back((int)position[j]);
+		pat.push_back(ipat[j]);
+	}
+	if(site.back()<nsites-1) {
+		site.push_back(nsites-1);
+		pat.push_back(-1);
+	}
+	const int nvisit = site.size();
+	// Viterbi recursion from left to right. back[t] holds, in bit s, the best state at visit t-1 given state s at visit t
+	vector<unsigned char> back(nvisit,0);
+	double V[2], newV[2];
+	int s,interior;
+	for(s=0;s<2;s++) V[s] = log(pi[s]);
+	int t;
+	for(t=0;t<nvisit;t++) {
+		if(t>0) {
+			const int d = site[t]-site[t-1];
+			for(s=0;s<2;s++) {
+				const double fromU = V[Unimported]+gap(Unimported,s,d,interior);
+				const double fromI = V[Imported]+gap(Imported,s,d,interior);
+				newV[s] = (fromU>=fromI) ? fromU : fromI;
+				if(fromU<fromI) back[t] |= (1 << s);
 			}
-			Nucleotide dec = node_nuc[dec_id][ipat[j]];
-			Nucleotide anc = node_nuc[anc_id][ipat[j]];
-			if(i<iscompat.size()-1) {
-				UU = ptrans[0][0]*pemisUnimported[anc][dec]*subseq_ML[i+1][0];
-				UI = ptrans[0][1]*  pemisImported[anc][dec]*subseq_ML[i+1][1];
-				IU = ptrans[1][0]*pemisUnimported[anc][dec]*subseq_ML[i+1][0];
-				II = ptrans[1][1]*  pemisImported[anc][dec]*subseq_ML[i+1][1];
-			} else {
-				UU = ptrans[0][0]*pemisUnimported[anc][dec];
-				UI = ptrans[0][1]*  pemisImported[anc][dec];
-				IU = ptrans[1][0]*pemisUnimported[anc][dec];
-				II = ptrans[1][1]*  pemisImported[anc][dec];
-			}					
-		} else {
-			if(i<iscompat.size()-1) {
-				UU = ptrans[0][0]*subseq_ML[i+1][0];
-				UI = ptrans[0][1]*subseq_ML[i+1][1];
-				IU = ptrans[1][0]*subseq_ML[i+1][0];
-				II = ptrans[1][1]*subseq_ML[i+1][1];
-			} else {
-				UU = ptrans[0][0];
-				UI = ptrans[0][1];
-				IU = ptrans[1][0];
-				II = ptrans[1][1];
-			}					
-		}
-		subseq_ML[i][0] = (UU>=UI) ? UU : UI;
-		path_ML[i][0]   = (UU>=UI) ? Unimported : Imported;
-		subseq_ML[i][1] = (IU>=II) ? IU : II;
-		path_ML[i][1]   = (IU>=II) ? Unimported : Imported;
-	}
-	// Beginning at the first variable site, identify the most likely path
-	// Sanity check
-	if(path_ML[0][0]!=path_ML[0][1]) {
-		stringstream errTxt;
-		errTxt << "maximum_likelihood_ClonalFrame_branch_allsites(): internal inconsistency when choosing the first importation state in the best path";
-		error(errTxt.str().c_str());
-	}
-	is_imported[0] = path_ML[0][0];
-	ML = subseq_ML[0][0];
-	for(i=1;i<iscompat.size();i++) {
-		const int prev = is_imported[i-1];
-		is_imported[i] = path_ML[i][prev];
+			V[0] = newV[0];
+			V[1] = newV[1];
+		}
+		if(pat[t]>=0) {
+			const unsigned char c = emission_class[dec_id][pat[t]];
+			const Nucleotide dec = emission_class_dec(c);
+			const Nucleotide anc = emission_class_anc(c);
+			for(s=0;s<2;s++) V[s] += lemis[s][anc][dec];
+		}
+	}
+	// Trace back the best path, overwriting back[t] with the state at visit t
+	s = (V[Unimported]>=V[Imported]) ? Unimported : Imported;
+	mydouble ML;
+	ML.setlog(V[s]);
+	for(t=nvisit-1;t>0;t--) {
+		const int prev = (back[t] >> s) & 1;
+		back[t] = s;
+		s = prev;
+	}
+	back[0] = s;
+	// Collect the imported intervals, including those that extend over gaps
+	int beg = (back[0]==Imported) ? 0 : -1;
+	for(t=1;t<nvisit;t++) {
+		const int d = site[t]-site[t-1];
+		gap(back[t-1],back[t],d,interior);
+		if(d>1) {
+			if(interior==Imported && beg<0) beg = site[t-1]+1;
+			if(interior==Unimported && beg>=0) {
+				imported.push_back(ImportedInterval(beg,site[t-1]+1));
+				beg = -1;
+			}
+		}
+		if(back[t]==Imported && beg<0) beg = site[t];
+		if(back[t]==Unimported && beg>=0) {
+			imported.push_back(ImportedInterval(beg,site[t]));
+			beg = -1;
+		}
 	}
-	
+	if(beg>=0) imported.push_back(ImportedInterval(beg,nsites));
 	return ML;
 }
 
 // The following function calculates, for a particular branch of the tree, the expected number of transitions from state i to state j and emissions from state i to observation j
 // This requires storage for the forward algorithm calculations and a second pass using the backward algorithm to calculate the marginal expectations
 // The marginal likelihood for the branch is returned
-mydouble mydouble_forward_backward_expectations_ClonalFrame_branch(const int dec_id, const int anc_id, const Matrix<Nucleotide> &node_nuc, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const double branch_length, const double rho_over_theta, const double mean_import_length, const double import_divergence, Matrix<double> &numEmis, vector<double> &denEmis, Matrix<double> &numTrans, vector<double> &denTrans) {
+mydouble mydouble_forward_backward_expectations_ClonalFrame_branch(const int dec_id, const Matrix<unsigned char> &emission_class, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const double branch_length, const double rho_over_theta, const double mean_import_length, const double import_divergence, Matrix<double> &numEmis, vector<double> &denEmis, Matrix<double> &numTrans, vector<double> &denTrans) {
 	const int npos = position.size();
 	// Define an HKY85 emission probability matrix for Unimported sites
 	Matrix<mydouble> pemisUnimported;
@@ -2003,8 +3053,9 @@ mydouble mydouble_forward_backward_expectations_ClonalFrame_branch(const int dec
 	// Beginning at the first variable site, calculate the subsequence marginal likelihood
 	int i;
 	for(i=0;i<npos;i++) {
-		Nucleotide dec = node_nuc[dec_id][ipat[i]];
-		Nucleotide anc = node_nuc[anc_id][ipat[i]];
+		const unsigned char c = emission_class[dec_id][ipat[i]];
+		const Nucleotide dec = emission_class_dec(c);
+		const Nucleotide anc = emission_class_anc(c);
 		if(i==0) {
 			a[0] = pi[0]*pemisUnimported[anc][dec];
 			a[1] = pi[1]*  pemisImported[anc][dec];
@@ -2044,7 +3095,7 @@ mydouble mydouble_forward_backward_expectations_ClonalFrame_branch(const int dec
 			// Increment the numerator and denominator of the expected number of emissions from state j to observation k
 			int j;
 			// NB:- *** obs refers to the PRESENT site !!! ***
-			const int obs = (int)(node_nuc[dec_id][ipat[i]]!=node_nuc[anc_id][ipat[i]]);		// 0 = same, 1 = different
+			const int obs = (int)emission_class_differs(emission_class[dec_id][ipat[i]]);		// 0 = same, 1 = different
 			for(j=0;j<2;j++) {
 				// Total number of emissions from j to k equals indicator of actual observation k (0 or 1) weighted by probability the site was in state j
 				numEmis[j][obs] += ppost[j];
@@ -2055,8 +3106,9 @@ mydouble mydouble_forward_backward_expectations_ClonalFrame_branch(const int dec
 			bnext[0] = b[0];
 			bnext[1] = b[1];
 			// Note that these retrieve the ancestral and descendant nucleotides at the 3prime adjacent site
-			Nucleotide dec = node_nuc[dec_id][ipat[i+1]];
-			Nucleotide anc = node_nuc[anc_id][ipat[i+1]];
+			const unsigned char c = emission_class[dec_id][ipat[i+1]];
+			const Nucleotide dec = emission_class_dec(c);
+			const Nucleotide anc = emission_class_anc(c);
 			const mydouble pemisU = pemisUnimported[anc][dec];
 			const mydouble pemisI = pemisImported[anc][dec];
 			mydouble prnotrans;
@@ -2081,7 +3133,7 @@ mydouble mydouble_forward_backward_expectations_ClonalFrame_branch(const int dec
 			// Increment the numerator and denominator of the expected number of emissions from state j to observation k
 			int j;
 			// NB:- *** obs refers to the PRESENT site !!! ***
-			const int obs = (int)(node_nuc[dec_id][ipat[i]]!=node_nuc[anc_id][ipat[i]]);		// 0 = same, 1 = different
+			const int obs = (int)emission_class_differs(emission_class[dec_id][ipat[i]]);		// 0 = same, 1 = different
 			for(j=0;j<2;j++) {
 				// Total number of emissions from j to k equals indicator of actual observation k (0 or 1) weighted by probability the site was in state j
 				numEmis[j][obs] += ppost[j];
@@ -2116,93 +3168,341 @@ mydouble mydouble_forward_backward_expectations_ClonalFrame_branch(const int dec
 	return ML;
 }
 
-double Baum_Welch(const marginal_tree &tree, const Matrix<Nucleotide> &node_nuc, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const vector<bool> &informative, const vector<double> &prior_a, const vector<double> &prior_b, vector<double> &full_param, vector<double> &posterior_a, int &neval, const bool coutput, double &priorL) {
-	int i;
-	if(coutput) cout << setprecision(9);
-	// Initial parameters
-	double rho_over_theta = full_param[0];
-	double mean_import_length = full_param[1];
-	double import_divergence = full_param[2];
-	posterior_a = vector<double>(3+informative.size());
-	// Storage for the expected number of transitions and emissions in the HMM
-	Matrix<double> numEmiss(2,2), numTrans(2,2);
-	vector<double> denEmiss(2),   denTrans(2);
-	// Counters
-	double mutI=0.0;			// Running total divergence at imported sites
-	double numU=0.0, numI=0.0;	// Running total number of transitions *to* unimported, imported regions
-	double nsiI=0.0;			// Running total number of imported sites
-	double lenU=0.0, lenI=0.0;	// Running total length of unimported, imported regions
-	// Calculate the marginal likelihood and expected number of transitions and emissions by the forward-backward algorithm
-	// Include the effect of the prior
-	double ML = 0.0;
-	priorL = gamma_loglikelihood(full_param[0], prior_a[0], prior_b[0]) + gamma_loglikelihood(1.0/full_param[1], prior_a[1], prior_b[1]) + gamma_loglikelihood(full_param[2], prior_a[2], prior_b[2]);
-	for(i=0;i<informative.size();i++) {
-		if(informative[i]) {
-			priorL += gamma_loglikelihood(full_param[3+i], prior_a[3], prior_b[3]);
-			const int dec_id = tree.node[i].id;
-			const int anc_id = tree.node[i].ancestor->id;
-			const double branch_length = full_param[3+i];
-			ML += mydouble_forward_backward_expectations_ClonalFrame_branch(dec_id,anc_id,node_nuc,position,ipat,kappa,pinuc,branch_length,rho_over_theta,mean_import_length,import_divergence,numEmiss,denEmiss,numTrans,denTrans).LOG();
-			// Update estimate of the branch length
-			const double mutU_br = numEmiss[0][1];
-			const double nsiU_br = denEmiss[0];
-			full_param[3+i] = (prior_a[3]+mutU_br)/(prior_b[3]+nsiU_br);
-			posterior_a[3+i] = (prior_a[3]+mutU_br);
-			// Increment counters for the other expectations
-			mutI += numEmiss[1][1];
-			nsiI += denEmiss[1];
-			const double numI_br = numTrans[0][1];
-			const double lenU_br = denTrans[0];
-			numI += numI_br;
-			lenU += full_param[3+i]*lenU_br;
-			numU += numTrans[1][0];
-			lenI += denTrans[1];
-			if(coutput) {
-				cout << "nmut = " << mutU_br << " nU = " << nsiU_br << " nsub = " << numEmiss[1][1] << " nI = " << denEmiss[1] << endl;
-				cout << "nU>I = " << numI_br << " dU = " << lenU_br << " nI>U = " << numTrans[1][0] << " dI = " << denTrans[1] << endl;
-				cout << "numTrans = " << numTrans[0][0] << " " << numTrans[0][1] << " " << numTrans[1][0] << " " << numTrans[0][0] << endl;
+// As mydouble_forward_backward_expectations_ClonalFrame_branch, but the forward and backward variables are stored as plain doubles
+// to avoid the transcendental functions needed by mydouble arithmetic. To prevent underflow, each vector is rescaled to sum to one
+// every scaling_interval steps (or sooner if it becomes very small) and the log of the forward scale factors is accumulated separately.
+// The scale factors cancel in the posterior probabilities and expected numbers of transitions and emissions.
+// Runs of adjacent sites at which the ancestral and descendant nucleotides match are traversed in blocks of up to max_block_length
+// sites. The emission probabilities at a matching site depend only on its nucleotide, so there are just 4^L distinct blocks of length L.
+// The transfer matrix of each, and the matrices giving its contribution to the expected numbers of transitions and emissions, are
+// tabulated once per call so that a whole block costs a single step in each pass.
+mydouble scaled_forward_backward_expectations_ClonalFrame_branch(const int dec_id, const Matrix<unsigned char> &emission_class, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const double branch_length, const double rho_over_theta, const double mean_import_length, const double import_divergence, Matrix<double> &numEmis, vector<double> &denEmis, Matrix<double> &numTrans, vector<double> &denTrans) {
+	const int npos = position.size();
+	const int scaling_interval = 16;
+	const double min_scale = 1.0e-150;
+	const int max_block_length = 4;
+	// Define HKY85 emission probabilities for Unimported and Imported sites, indexed by emission class
+	const Matrix<mydouble> mpemisUnimported = compute_HKY85_ptrans(branch_length,kappa,pinuc);
+	const Matrix<mydouble> mpemisImported = compute_HKY85_ptrans(import_divergence,kappa,pinuc);
+	double pemisUnimported[16], pemisImported[16];
+	int i,j,k,l;
+	for(i=0;i<4;i++) {
+		for(j=0;j<4;j++) {
+			pemisUnimported[pack_emission_class((Nucleotide)i,(Nucleotide)j)] = mpemisUnimported[i][j].todouble();
+			pemisImported[pack_emission_class((Nucleotide)i,(Nucleotide)j)] = mpemisImported[i][j].todouble();
+		}
+	}
+	// The observation at every site on this branch
+	const unsigned char *obs_class = &emission_class[dec_id][0];
+	// Resize if necessary and zero the output objects
+	numEmis = Matrix<double>(2,2,0.0);
+	denEmis = vector<double>(2,0.0);
+	numTrans = Matrix<double>(2,2,0.0);
+	denTrans = vector<double>(2,0.0);
+	// Recombination parameters
+	const double recrate = rho_over_theta*branch_length;
+	const double endrecrate = 1.0/mean_import_length;
+	const double totrecrate = recrate+endrecrate;
+	// Equilibrium frequency of unimported and imported sites respectively
+	const double pi[2] = {endrecrate/totrecrate,recrate/totrecrate};
+	// Tabulate the blocks of adjacent matching sites. S[x][j][k] is the probability of moving from state j to state k between
+	// adjacent sites and emitting a match with nucleotide x at the second. The block of length L whose m-th site (m=0..L-1) has
+	// nucleotide x_m is stored at block[block_offset[L]+sum_m x_m*4^m]
+	const double prnotrans1 = exp(-totrecrate), prtrans1 = -expm1(-totrecrate);
+	double S[4][2][2];
+	for(l=0;l<4;l++) {
+		const unsigned char c = pack_emission_class((Nucleotide)l,(Nucleotide)l);
+		const double pemis[2] = {pemisUnimported[c],pemisImported[c]};
+		for(j=0;j<2;j++) {
+			for(k=0;k<2;k++) {
+				S[l][j][k] = ((j==k) ? prnotrans1+prtrans1*pi[k] : prtrans1*pi[k])*pemis[k];
 			}
 		}
 	}
-	ML += priorL;
-	++neval;
-	// Update estimates of the recombination parameters
-	full_param[0] = (prior_a[0]+numI)/(prior_b[0]+lenU);
-	full_param[1] = (prior_b[1]+lenI)/(prior_a[1]+numU);
-	full_param[2] = (prior_a[2]+mutI)/(prior_b[2]+nsiI);
-	posterior_a[0] = (prior_a[0]+numI);
-	posterior_a[1] = (prior_a[1]+numU);
-	posterior_a[2] = (prior_a[2]+mutI);
-	if(coutput) {
-		cout << "params =";
-		for(int j=0;j<full_param.size();j++) cout << " " << full_param[j];
-		cout << " ML = " << ML << endl;
+	vector<int> block_offset(max_block_length+2,0);
+	for(l=1;l<=max_block_length;l++) block_offset[l+1] = block_offset[l]+(1<<(2*l));
+	vector<ScaledHMMBlock> block(block_offset[max_block_length+1]);
+	for(l=0;l<4;l++) {
+		ScaledHMMBlock &B = block[l];
+		memset(&B,0,sizeof(ScaledHMMBlock));
+		for(j=0;j<2;j++) {
+			for(k=0;k<2;k++) {
+				B.P[j][k] = S[l][j][k];
+				B.H[j][k][j][k] = S[l][j][k];
+			}
+			B.G[j][0] = S[l][j][0];
+		}
 	}
-	// Iterate until the maximum likelihood improves by less than some threshold
-	const int maxit = 200;
-	const double threshold = 1.0e-2;
-	double new_ML;
-	int it;
-	for(it=0;it<maxit;it++) {
+	int len;
+	for(len=1;len<max_block_length;len++) {
+		const int ncode = 1<<(2*len);
+		int code;
+		for(code=0;code<ncode;code++) {
+			const ScaledHMMBlock &B = block[block_offset[len]+code];
+			for(l=0;l<4;l++) {
+				// Append a site with nucleotide l to block B
+				ScaledHMMBlock &Bl = block[block_offset[len+1]+code+l*ncode];
+				const double (&Sl)[2][2] = S[l];
+				int m,n;
+				for(j=0;j<2;j++) {
+					for(k=0;k<2;k++) {
+						Bl.P[j][k] = B.P[j][0]*Sl[0][k]+B.P[j][1]*Sl[1][k];
+						Bl.G[j][k] = B.G[j][0]*Sl[0][k]+B.G[j][1]*Sl[1][k];
+						for(m=0;m<2;m++) {
+							for(n=0;n<2;n++) {
+								Bl.H[m][n][j][k] = B.H[m][n][j][0]*Sl[0][k]+B.H[m][n][j][1]*Sl[1][k];
+							}
+						}
+					}
+					Bl.G[j][0] += Bl.P[j][0];
+					for(m=0;m<2;m++) {
+						for(n=0;n<2;n++) {
+							Bl.H[m][n][j][n] += B.P[j][m]*Sl[m][n];
+						}
+					}
+				}
+			}
+		}
+	}
+	// Storage for the scaled forward calculations, which are recorded at the end of each step: step_site[s] is the last site of step s,
+	// step_block[s] the block it traverses (or -1 for a single site) and step_prnotrans[s] and step_prtrans[s] the probability of no
+	// transition/any transition into a single site
+	vector<double> A(0);
+	vector<int> step_site(0), step_block(0);
+	vector<double> step_prnotrans(0), step_prtrans(0);
+	A.reserve(2*npos);
+	step_site.reserve(npos);
+	step_block.reserve(npos);
+	step_prnotrans.reserve(npos);
+	step_prtrans.reserve(npos);
+	double logscale = 0.0;
+	double a0, a1;
+	// Beginning at the first variable site, calculate the subsequence marginal likelihood
+	for(i=0;i<npos;) {
+		// Find the longest block of adjacent matching sites starting at site i
+		int code = 0;
+		for(len=0;len<max_block_length && i+len<npos && i+len>0;len++) {
+			const unsigned char c = obs_class[ipat[i+len]];
+			if(emission_class_differs(c) || position[i+len]-position[i+len-1]!=1.0) break;
+			code += ((int)emission_class_dec(c))<<(2*len);
+		}
+		if(len>0) {
+			const ScaledHMMBlock &B = block[block_offset[len]+code];
+			const double aprev0 = a0, aprev1 = a1;
+			a0 = aprev0*B.P[0][0]+aprev1*B.P[1][0];
+			a1 = aprev0*B.P[0][1]+aprev1*B.P[1][1];
+			step_block.push_back(block_offset[len]+code);
+			step_prnotrans.push_back(prnotrans1);
+			step_prtrans.push_back(prtrans1);
+			i += len;
+		} else {
+			const unsigned char c = obs_class[ipat[i]];
+			double prnotrans = 1.0, prtrans = 0.0;
+			if(i==0) {
+				a0 = pi[0]*pemisUnimported[c];
+				a1 = pi[1]*  pemisImported[c];
+			} else {
+				const double x = -totrecrate*(position[i]-position[i-1]);
+				prnotrans = exp(x);
+				prtrans = -expm1(x);
+				const double aprev0 = a0, aprev1 = a1;
+				const double sumaprev = aprev0+aprev1;
+				a0 = (aprev0*prnotrans+sumaprev*pi[0]*prtrans)*pemisUnimported[c];
+				a1 = (aprev1*prnotrans+sumaprev*pi[1]*prtrans)*  pemisImported[c];
+			}
+			step_block.push_back(-1);
+			step_prnotrans.push_back(prnotrans);
+			step_prtrans.push_back(prtrans);
+			i++;
+		}
+		step_site.push_back(i-1);
+		const double suma = a0+a1;
+		if((step_site.size()-1)%scaling_interval==0 || suma<min_scale) {
+			a0 /= suma;
+			a1 /= suma;
+			logscale += log(suma);
+		}
+		A.push_back(a0);
+		A.push_back(a1);
+	}
+	const int nsteps = step_site.size();
+	// Record the marginal likelihood for output later
+	mydouble ML;
+	ML.setlog(logscale+log(a0+a1));
+	// Second pass: backward algorithm
+	double b0 = 1.0, b1 = 1.0;
+	int s;
+	for(s=nsteps-1;s>=0;s--) {
+		// Forward variables at the 3prime end of the step
+		const double a30 = A[2*s], a31 = A[2*s+1];
+		const double bnext0 = b0, bnext1 = b1;
+		if(step_block[s]>=0) {
+			// Forward variables at the 5prime end of the step
+			const double a0 = A[2*s-2], a1 = A[2*s-1];
+			const ScaledHMMBlock &B = block[step_block[s]];
+			const int len = step_site[s]-step_site[s-1];
+			b0 = B.P[0][0]*bnext0+B.P[0][1]*bnext1;
+			b1 = B.P[1][0]*bnext0+B.P[1][1]*bnext1;
+			const double MLi = a0*b0+a1*b1;
+			// Increment the numerator and denominator of the expected number of emissions: every site in the block is a match
+			const double nU = (a0*(B.G[0][0]*bnext0+B.G[0][1]*bnext1)+a1*(B.G[1][0]*bnext0+B.G[1][1]*bnext1))/MLi;
+			numEmis[0][0] += nU;
+			numEmis[1][0] += len-nU;
+			denEmis[0] += nU;
+			denEmis[1] += len-nU;
+			// Increment the numerator and denominator of the expected number of transitions from state j to state k
+			// Adjacent sites in a block are a distance 1 apart
+			for(j=0;j<2;j++) {
+				for(k=0;k<2;k++) {
+					const double (&H)[2][2] = B.H[j][k];
+					const double ntrans = (a0*(H[0][0]*bnext0+H[0][1]*bnext1)+a1*(H[1][0]*bnext0+H[1][1]*bnext1))/MLi;
+					numTrans[j][k] += ntrans;
+					denTrans[j] += ntrans;
+				}
+			}
+		} else {
+			i = step_site[s];
+			// Calculate the marginal probabilities that the hidden state is Unimported or Imported
+			const double pU = a30*bnext0/(a30*bnext0+a31*bnext1);
+			const double ppost[2] = {pU,1.0-pU};
+			// Increment the numerator and denominator of the expected number of emissions from state j to observation k
+			// NB:- *** obs refers to the PRESENT site !!! ***
+			const int obs = (int)emission_class_differs(obs_class[ipat[i]]);		// 0 = same, 1 = different
+			for(j=0;j<2;j++) {
+				numEmis[j][obs] += ppost[j];
+				denEmis[j]      += ppost[j];
+			}
+			if(i==0) break;
+			// Forward variables at the 5prime adjacent site
+			const double a0 = A[2*s-2], a1 = A[2*s-1];
+			const double prnotrans = step_prnotrans[s], prtrans = step_prtrans[s];
+			const unsigned char c = obs_class[ipat[i]];
+			const double pemisU = pemisUnimported[c];
+			const double pemisI = pemisImported[c];
+			const double sumbnext = prtrans*(pi[0]*pemisU*bnext0 + pi[1]*pemisI*bnext1);
+			b0 = prnotrans*pemisU*bnext0+sumbnext;
+			b1 = prnotrans*pemisI*bnext1+sumbnext;
+			const double MLi = a0*b0+a1*b1;
+			// Increment the numerator and denominator of the expected number of transitions from state j to state k
+			// Impose maximum adjacent site distance of 1kb (needed for small-p Poisson approximation to heterogeneous bernoulli)
+			const double dist = position[i]-position[i-1];
+			if(dist<=1000.) {
+				// Probability of transition from j to k given the data equals the joint likelihood of the data and transition from j to k, divided by marginal likelihood of the data
+				numTrans[0][0] += a0*(prnotrans+prtrans*pi[0])*pemisU*bnext0/MLi;
+				numTrans[0][1] += a0*prtrans*pi[1]*pemisI*bnext1/MLi;
+				numTrans[1][0] += a1*prtrans*pi[0]*pemisU*bnext0/MLi;
+				numTrans[1][1] += a1*(prnotrans+prtrans*pi[1])*pemisI*bnext1/MLi;
+				// Expected distance between sites equals actual distance weighted by the probability the 5prime site was in state j
+				const double pU = a0*b0/MLi;
+				denTrans[0] += dist*pU;
+				denTrans[1] += dist*(1.0-pU);
+			}
+		}
+		// Rescale the backward variables
+		if((s-1)%scaling_interval==0 || b0+b1<min_scale) {
+			const double sumb = b0+b1;
+			b0 /= sumb;
+			b1 /= sumb;
+		}
+	}
+	return ML;
+}
+
+// Run the forward-backward algorithm for one branch using the requested kernel. With HMMKernelCheck both kernels are run, a warning is
+// issued if they disagree on the log-likelihood or expected counts, and the mydouble results are returned.
+double forward_backward_expectations_ClonalFrame_branch(const HMMKernel kernel, const int dec_id, const Matrix<unsigned char> &emission_class, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const double branch_length, const double rho_over_theta, const double mean_import_length, const double import_divergence, Matrix<double> &numEmis, vector<double> &denEmis, Matrix<double> &numTrans, vector<double> &denTrans) {
+	if(kernel==HMMKernelScaled) {
+		return scaled_forward_backward_expectations_ClonalFrame_branch(dec_id,emission_class,position,ipat,kappa,pinuc,branch_length,rho_over_theta,mean_import_length,import_divergence,numEmis,denEmis,numTrans,denTrans).LOG();
+	}
+	const double loglik = mydouble_forward_backward_expectations_ClonalFrame_branch(dec_id,emission_class,position,ipat,kappa,pinuc,branch_length,rho_over_theta,mean_import_length,import_divergence,numEmis,denEmis,numTrans,denTrans).LOG();
+	if(kernel==HMMKernelCheck) {
+		Matrix<double> snumEmis, snumTrans;
+		vector<double> sdenEmis, sdenTrans;
+		const double sloglik = scaled_forward_backward_expectations_ClonalFrame_branch(dec_id,emission_class,position,ipat,kappa,pinuc,branch_length,rho_over_theta,mean_import_length,import_divergence,snumEmis,sdenEmis,snumTrans,sdenTrans).LOG();
+		const double tol = 1.0e-6;
+		double maxdiff = fabs(sloglik-loglik)/MAX(1.0,fabs(loglik));
+		int j,k;
+		for(j=0;j<2;j++) {
+			for(k=0;k<2;k++) {
+				maxdiff = MAX(maxdiff,fabs(snumEmis[j][k]-numEmis[j][k])/MAX(1.0,fabs(numEmis[j][k])));
+				maxdiff = MAX(maxdiff,fabs(snumTrans[j][k]-numTrans[j][k])/MAX(1.0,fabs(numTrans[j][k])));
+			}
+			maxdiff = MAX(maxdiff,fabs(sdenEmis[j]-denEmis[j])/MAX(1.0,fabs(denEmis[j])));
+			maxdiff = MAX(maxdiff,fabs(sdenTrans[j]-denTrans[j])/MAX(1.0,fabs(denTrans[j])));
+		}
+		if(maxdiff>tol) {
+			stringstream wrnTxt;
+			wrnTxt << "forward_backward_expectations_ClonalFrame_branch(): scaled and mydouble kernels differ by " << maxdiff << " for node " << dec_id << " (log-likelihood " << sloglik << " vs " << loglik << ")";
+			warning(wrnTxt.str().c_str());
+		}
+	}
+	return loglik;
+}
+
+// Run the forward-backward algorithm for every informative branch, storing the expected number of transitions and emissions
+// and the marginal log-likelihood of each branch in expectations[i]. Branches are independent given their parameters, so
+// they are shared among nthreads threads, longest branch first so that the most expensive branches are started earliest.
+// Results are stored per branch so that the caller can sum them in branch order, giving identical results for any number of threads.
+void forward_backward_expectations_ClonalFrame_allbranches(const marginal_tree &tree, const Matrix<unsigned char> &emission_class, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const vector<bool> &informative, const vector<double> &branch_length, const vector<double> &rho_over_theta, const vector<double> &mean_import_length, const vector<double> &import_divergence, const int nthreads, const HMMKernel kernel, vector<BranchExpectations> &expectations) {
+	if(expectations.size()!=informative.size()) expectations = vector<BranchExpectations>(informative.size());
+	vector< pair<double,int> > order(0);
+	int i;
+	for(i=0;i<informative.size();i++) {
+		if(informative[i]) order.push_back(pair<double,int>(-branch_length[i],i));
+	}
+	std::stable_sort(order.begin(),order.end());
+	parallel_for(order.size(),nthreads,[&](const int j) {
+		const int i = order[j].second;
+		const int dec_id = tree.node[i].id;
+		BranchExpectations &ex = expectations[i];
+		ex.loglik = forward_backward_expectations_ClonalFrame_branch(kernel,dec_id,emission_class,position,ipat,kappa,pinuc,branch_length[i],rho_over_theta[i],mean_import_length[i],import_divergence[i],ex.numEmis,ex.denEmis,ex.numTrans,ex.denTrans);
+	});
+}
+
+double Baum_Welch(const marginal_tree &tree, const Matrix<unsigned char> &emission_class, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const vector<bool> &informative, const vector<double> &prior_a, const vector<double> &prior_b, vector<double> &full_param, vector<double> &posterior_a, int &neval, const bool coutput, double &priorL, EMIterations &em_iterations, const int nthreads, const HMMKernel kernel, const EMAccelerator accel, EMCheckpoint *checkpoint) {
+	if(coutput) cout << setprecision(9);
+	posterior_a = vector<double>(3+informative.size());
+	// Storage for the expected number of transitions and emissions in the HMM per branch
+	vector<BranchExpectations> expectations(informative.size());
+	// Parameters per branch
+	vector<double> branch_length(informative.size());
+	vector<double> rho_over_theta_br(informative.size()), mean_import_length_br(informative.size()), import_divergence_br(informative.size());
+	// One EM step: calculate the marginal likelihood (including the effect of the prior) and expected number of transitions and emissions
+	// by the forward-backward algorithm at param, and update the estimates of the parameters in new_param
+	auto em_step = [&](const vector<double> &param, vector<double> &new_param) -> double {
+		TimedPhase timed("em_iteration");
+		int i;
 		// Identify the model parameters
-		rho_over_theta = full_param[0];
-		mean_import_length = full_param[1];
-		import_divergence = full_param[2];
-		// Update the likelihood
-		mutI=0.0; numU=0.0; numI=0.0; nsiI=0.0; lenU=0.0; lenI=0.0;
-		priorL = gamma_loglikelihood(full_param[0], prior_a[0], prior_b[0]) + gamma_loglikelihood(1.0/full_param[1], prior_a[1], prior_b[1]) + gamma_loglikelihood(full_param[2], prior_a[2], prior_b[2]);
-		new_ML = 0.;
+		const double rho_over_theta = param[0];
+		const double mean_import_length = param[1];
+		const double import_divergence = param[2];
+		new_param = param;
+		// Counters
+		double mutI=0.0;			// Running total divergence at imported sites
+		double numU=0.0, numI=0.0;	// Running total number of transitions *to* unimported, imported regions
+		double nsiI=0.0;			// Running total number of imported sites
+		double lenU=0.0, lenI=0.0;	// Running total length of unimported, imported regions
+		priorL = gamma_loglikelihood(param[0], prior_a[0], prior_b[0]) + gamma_loglikelihood(1.0/param[1], prior_a[1], prior_b[1]) + gamma_loglikelihood(param[2], prior_a[2], prior_b[2]);
+		double ML = 0.0;
 		for(i=0;i<informative.size();i++) {
 			if(informative[i]) {
-				priorL += gamma_loglikelihood(full_param[3+i], prior_a[3], prior_b[3]);
-				const int dec_id = tree.node[i].id;
-				const int anc_id = tree.node[i].ancestor->id;
-				const double branch_length = full_param[3+i];
-				new_ML += mydouble_forward_backward_expectations_ClonalFrame_branch(dec_id,anc_id,node_nuc,position,ipat,kappa,pinuc,branch_length,rho_over_theta,mean_import_length,import_divergence,numEmiss,denEmiss,numTrans,denTrans).LOG();
+				priorL += gamma_loglikelihood(param[3+i], prior_a[3], prior_b[3]);
+				branch_length[i] = param[3+i];
+				rho_over_theta_br[i] = rho_over_theta;
+				mean_import_length_br[i] = mean_import_length;
+				import_divergence_br[i] = import_divergence;
+			}
+		}
+		forward_backward_expectations_ClonalFrame_allbranches(tree,emission_class,position,ipat,kappa,pinuc,informative,branch_length,rho_over_theta_br,mean_import_length_br,import_divergence_br,nthreads,kernel,expectations);
+		for(i=0;i<informative.size();i++) {
+			if(informative[i]) {
+				const Matrix<double> &numEmiss = expectations[i].numEmis, &numTrans = expectations[i].numTrans;
+				const vector<double> &denEmiss = expectations[i].denEmis, &denTrans = expectations[i].denTrans;
+				ML += expectations[i].loglik;
 				// Update estimate of the branch length
 				const double mutU_br = numEmiss[0][1];
 				const double nsiU_br = denEmiss[0];
-				full_param[3+i] = (prior_a[3]+mutU_br)/(prior_b[3]+nsiU_br);
+				new_param[3+i] = (prior_a[3]+mutU_br)/(prior_b[3]+nsiU_br);
 				posterior_a[3+i] = (prior_a[3]+mutU_br);
 				// Increment counters for the other expectations
 				mutI += numEmiss[1][1];
@@ -2210,7 +3510,7 @@ double Baum_Welch(const marginal_tree &tree, const Matrix<Nucleotide> &node_nuc,
 				const double numI_br = numTrans[0][1];
 				const double lenU_br = denTrans[0];
 				numI += numI_br;
-				lenU += full_param[3+i]*lenU_br;
+				lenU += new_param[3+i]*lenU_br;
 				numU += numTrans[1][0];
 				lenI += denTrans[1];
 				if(coutput) {
@@ -2220,50 +3520,51 @@ double Baum_Welch(const marginal_tree &tree, const Matrix<Nucleotide> &node_nuc,
 				}
 			}
 		}
-		new_ML += priorL;
+		ML += priorL;
 		++neval;
 		// Update estimates of the recombination parameters
-		full_param[0] = (prior_a[0]+numI)/(prior_b[0]+lenU);
-		full_param[1] = (prior_b[1]+lenI)/(prior_a[1]+numU);
-		full_param[2] = (prior_a[2]+mutI)/(prior_b[2]+nsiI);
+		new_param[0] = (prior_a[0]+numI)/(prior_b[0]+lenU);
+		new_param[1] = (prior_b[1]+lenI)/(prior_a[1]+numU);
+		new_param[2] = (prior_a[2]+mutI)/(prior_b[2]+nsiI);
 		posterior_a[0] = (prior_a[0]+numI);
 		posterior_a[1] = (prior_a[1]+numU);
 		posterior_a[2] = (prior_a[2]+mutI);
 		if(coutput) {
 			cout << "params =";
-			for(int j=0;j<full_param.size();j++) cout << " " << full_param[j];
-			cout << " ML = " << new_ML << endl;
-		}
-		// Test for no further improvement
-		if(new_ML-ML< -threshold) {
-			//cout << "Old likelihood = " << ML << " delta = " << new_ML-ML << endl;
-			//warning("Likelihood got worse in Baum_Welch");
-		} else if(fabs(new_ML-ML)<threshold) {
-			ML = new_ML;
-			break;
+			for(int j=0;j<new_param.size();j++) cout << " " << new_param[j];
+			cout << " ML = " << ML << endl;
 		}
-		// Otherwise continue
-		ML = new_ML;
-	}
-	if(it==maxit) warning("Baum_Welch(): maximum number of iterations reached");
+		return ML;
+	};
+	// Iterate until the maximum likelihood improves by less than some threshold
+	const int maxit = 200;
+	const double threshold = 1.0e-2;
+	if(checkpoint!=NULL) {
+		checkpoint->label = "Baum_Welch";
+		checkpoint->input_checksum = checksum_EM_inputs("Baum_Welch",tree,emission_class,position,ipat,kappa,pinuc,informative,prior_a,prior_b,full_param,kernel,accel);
+	}
+	// When resuming from a checkpoint, neval counts the EM steps taken before the interruption too
+	const int neval0 = neval;
+	const double ML = em_iterate(em_step,full_param,accel,1+maxit,threshold,em_iterations,checkpoint);
+	neval = neval0 + em_iterations.steps;
+	if(!em_iterations.converged) warning("Baum_Welch(): maximum number of iterations reached");
 	// Once more for debugging purposes
-	// mydouble_forward_backward_expectations_ClonalFrame_branch(dec_id,anc_id,node_nuc,position,ipat,kappa,pinuc,branch_length,rho_over_theta,mean_import_length,import_divergence,numEmiss,denEmiss,numTrans,denTrans);
+	// mydouble_forward_backward_expectations_ClonalFrame_branch(dec_id,emission_class,position,ipat,kappa,pinuc,branch_length,rho_over_theta,mean_import_length,import_divergence,numEmiss,denEmiss,numTrans,denTrans);
 	if(coutput) {
 		cout << "MAP = " << ML << " priorL = " << priorL << " ML = " << ML-priorL << endl;
 	}
 	return ML;
 }
 
-double Baum_Welch0(const marginal_tree &tree, const Matrix<Nucleotide> &node_nuc, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const vector<bool> &informative, const vector<double> &prior_a, const vector<double> &prior_b, const vector<double> &full_param, const vector<double> &posterior_a, const bool coutput) {
+double Baum_Welch0(const marginal_tree &tree, const Matrix<unsigned char> &emission_class, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const vector<bool> &informative, const vector<double> &prior_a, const vector<double> &prior_b, const vector<double> &full_param, const vector<double> &posterior_a, const bool coutput, const int nthreads, const HMMKernel kernel) {
 	int i;
 	if(coutput) cout << setprecision(9);
 	// Initial parameters: use constants corresponding to zero recombination to avoid numerical inconsistencies
 	const double rho_over_theta = 0.0;
 	const double mean_import_length = 100.;
 	const double import_divergence = .01;
-	// Storage for the expected number of transitions and emissions in the HMM
-	Matrix<double> numEmiss(2,2), numTrans(2,2);
-	vector<double> denEmiss(2),   denTrans(2);
+	// Storage for the expected number of transitions and emissions in the HMM per branch
+	vector<BranchExpectations> expectations(informative.size());
 	// Counters
 	double mutI=0.0;			// Running total divergence at imported sites
 	double numU=0.0, numI=0.0;	// Running total number of transitions *to* unimported, imported regions
@@ -2272,13 +3573,15 @@ double Baum_Welch0(const marginal_tree &tree, const Matrix<Nucleotide> &node_nuc
 	// Calculate the marginal likelihood and expected number of transitions and emissions by the forward-backward algorithm
 	// Include no effect of the prior
 	double ML = 0;
+	// Utilize branch lengths from input tree
+	vector<double> branch_length(informative.size());
+	for(i=0;i<informative.size();i++) branch_length[i] = tree.node[i].edge_time;
+	forward_backward_expectations_ClonalFrame_allbranches(tree,emission_class,position,ipat,kappa,pinuc,informative,branch_length,vector<double>(informative.size(),rho_over_theta),vector<double>(informative.size(),mean_import_length),vector<double>(informative.size(),import_divergence),nthreads,kernel,expectations);
 	for(i=0;i<informative.size();i++) {
 		if(informative[i]) {
-			const int dec_id = tree.node[i].id;
-			const int anc_id = tree.node[i].ancestor->id;
-			// Utilize branch lengths from input tree
-			const double branch_length = tree.node[i].edge_time;
-			ML += mydouble_forward_backward_expectations_ClonalFrame_branch(dec_id,anc_id,node_nuc,position,ipat,kappa,pinuc,branch_length,rho_over_theta,mean_import_length,import_divergence,numEmiss,denEmiss,numTrans,denTrans).LOG();
+			const Matrix<double> &numEmiss = expectations[i].numEmis, &numTrans = expectations[i].numTrans;
+			const vector<double> &denEmiss = expectations[i].denEmis, &denTrans = expectations[i].denTrans;
+			ML += expectations[i].loglik;
 			// Do not update estimate of the branch length
 			const double mutU_br = numEmiss[0][1];
 			const double nsiU_br = denEmiss[0];
@@ -2308,7 +3611,7 @@ double gamma_loglikelihood(const double x, const double a, const double b) {
 	return a*log(b)-lgamma(a)+(a-1)*log(x)-b*x;
 }
 
-void forward_backward_simulate_expectations_ClonalFrame_branch(const int dec_id, const int anc_id, const Matrix<Nucleotide> &node_nuc, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const double branch_length, const double rho_over_theta, const double mean_import_length, const double import_divergence, const int nsim, vector<double> &mutU, vector<double> &nsiU, vector<double> &mutI, vector<double> &nsiI, vector<double> &numUI, vector<double> &lenU, vector<double> &numIU, vector<double> &lenI) {
+void forward_backward_simulate_expectations_ClonalFrame_branch(const int dec_id, const Matrix<unsigned char> &emission_class, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const double branch_length, const double rho_over_theta, const double mean_import_length, const double import_divergence, const int nsim, vector<double> &mutU, vector<double> &nsiU, vector<double> &mutI, vector<double> &nsiI, vector<double> &numUI, vector<double> &lenU, vector<double> &numIU, vector<double> &lenI) {
 	const int npos = position.size();
 	// Define an HKY85 emission probability matrix for Unimported sites
 	Matrix<mydouble> pemisUnimported;
@@ -2336,8 +3639,9 @@ void forward_backward_simulate_expectations_ClonalFrame_branch(const int dec_id,
 	// Beginning at the first variable site, do the forward algorithm
 	int i;
 	for(i=0;i<npos;i++) {
-		Nucleotide dec = node_nuc[dec_id][ipat[i]];
-		Nucleotide anc = node_nuc[anc_id][ipat[i]];
+		const unsigned char c = emission_class[dec_id][ipat[i]];
+		const Nucleotide dec = emission_class_dec(c);
+		const Nucleotide anc = emission_class_anc(c);
 		if(i==0) {
 			a[0] = pi[0]*pemisUnimported[anc][dec];
 			a[1] = pi[1]*  pemisImported[anc][dec];
@@ -2379,8 +3683,9 @@ void forward_backward_simulate_expectations_ClonalFrame_branch(const int dec_id,
 			bnext[0] = b[0];
 			bnext[1] = b[1];
 			// Note that these retrieve the ancestral and descendant nucleotides at the 3prime adjacent site
-			Nucleotide dec = node_nuc[dec_id][ipat[i+1]];
-			Nucleotide anc = node_nuc[anc_id][ipat[i+1]];
+			const unsigned char c = emission_class[dec_id][ipat[i+1]];
+			const Nucleotide dec = emission_class_dec(c);
+			const Nucleotide anc = emission_class_anc(c);
 			const mydouble pemisU = pemisUnimported[anc][dec];
 			const mydouble pemisI = pemisImported[anc][dec];
 			mydouble prnotrans;
@@ -2442,7 +3747,7 @@ void forward_backward_simulate_expectations_ClonalFrame_branch(const int dec_id,
 	}
 }
 
-Matrix<double> Baum_Welch_simulate_posterior(const marginal_tree &tree, const Matrix<Nucleotide> &node_nuc, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const vector<bool> &informative, const vector<double> &prior_a, const vector<double> &prior_b, const vector<double> &full_param, int &neval, const bool coutput, const int nsim) {
+Matrix<double> Baum_Welch_simulate_posterior(const marginal_tree &tree, const Matrix<unsigned char> &emission_class, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const vector<bool> &informative, const vector<double> &prior_a, const vector<double> &prior_b, const vector<double> &full_param, int &neval, const bool coutput, const int nsim) {
 	// Storage for output: for each parameter, simulated values
 	Matrix<double> post(3,nsim,0.0);
 	// Storage for the simulated counts of transitions and emissions
@@ -2459,9 +3764,8 @@ Matrix<double> Baum_Welch_simulate_posterior(const marginal_tree &tree, const Ma
 	for(i=0;i<informative.size();i++) {
 		if(informative[i]) {
 			const int dec_id = tree.node[i].id;
-			const int anc_id = tree.node[i].ancestor->id;
 			const double branch_length = full_param[3+i];
-			forward_backward_simulate_expectations_ClonalFrame_branch(dec_id,anc_id,node_nuc,position,ipat,kappa,pinuc,branch_length,rho_over_theta,mean_import_length,import_divergence,nsim,mutU_br,nsiU_br,mutI_br,nsiI_br,numUI_br,lenU_br,numIU_br,lenI_br);
+			forward_backward_simulate_expectations_ClonalFrame_branch(dec_id,emission_class,position,ipat,kappa,pinuc,branch_length,rho_over_theta,mean_import_length,import_divergence,nsim,mutU_br,nsiU_br,mutI_br,nsiI_br,numUI_br,lenU_br,numIU_br,lenI_br);
 			// Update the running totals for each simulation
 			int sim;
 			for(sim=0;sim<nsim;sim++) {
@@ -2498,147 +3802,58 @@ Matrix<double> Baum_Welch_simulate_posterior(const marginal_tree &tree, const Ma
 }
 
 
-double Baum_Welch_Rho_Per_Branch(const marginal_tree &tree, const Matrix<Nucleotide> &node_nuc, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const vector<bool> &informative, const vector<double> &prior_a, const vector<double> &prior_b, vector<double> &mean_param, Matrix<double> &full_param, Matrix<double> &posterior_a, int &neval, const bool coutput) {
+double Baum_Welch_Rho_Per_Branch(const marginal_tree &tree, const Matrix<unsigned char> &emission_class, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const vector<bool> &informative, const vector<double> &prior_a, const vector<double> &prior_b, vector<double> &mean_param, Matrix<double> &full_param, Matrix<double> &posterior_a, int &neval, const bool coutput, EMIterations &em_iterations, const int nthreads, const HMMKernel kernel, const EMAccelerator accel, EMCheckpoint *checkpoint) {
 	int i;
 	if(coutput) cout << setprecision(9);
+	const int nbranch = informative.size();
 	// Resize as necessary
-	posterior_a = Matrix<double>(informative.size(),4);
+	posterior_a = Matrix<double>(nbranch,4);
 	// Storage for the expected number of transitions and emissions in the HMM per branch
-	Matrix<double> numEmiss(2,2), numTrans(2,2);
-	vector<double> denEmiss(2),   denTrans(2);
+	vector<BranchExpectations> expectations(nbranch);
+	// Parameters per branch
+	vector<double> branch_length(nbranch);
+	vector<double> rho_over_theta(nbranch), mean_import_length(nbranch), import_divergence(nbranch);
 	// Counters per branch
-	vector<double> mutU_br(informative.size(),0.0), mutI_br(informative.size(),0.0);
-	vector<double> nsiU_br(informative.size(),0.0), nsiI_br(informative.size(),0.0);
-	vector<double> numI_br(informative.size(),0.0), numU_br(informative.size(),0.0);
-	vector<double> lenU_br(informative.size(),0.0), lenI_br(informative.size(),0.0);
-	// Calculate the marginal likelihood and expected number of transitions and emissions by the forward-backward algorithm
-	// Include the effect of the prior (this is dubious - should instead compute loglikelihood of the pseudocounts)
-	double ML = gamma_loglikelihood(mean_param[0], prior_a[0], prior_b[0]) + gamma_loglikelihood(mean_param[1], prior_a[1], prior_b[1]) + gamma_loglikelihood(mean_param[2], prior_a[2], prior_b[2]) + gamma_loglikelihood(mean_param[3], prior_a[3], prior_b[3]);
-	for(i=0;i<informative.size();i++) {
-		if(informative[i]) {
-			// Include the effect of the prior (this is dubious - should instead compute loglikelihood of the pseudocounts)
-			ML += gamma_loglikelihood(full_param[i][0], prior_a[4], prior_b[4]) + gamma_loglikelihood(full_param[i][1], prior_a[4], prior_b[4])
-			+ gamma_loglikelihood(full_param[i][2], prior_a[4], prior_b[4]) + gamma_loglikelihood(full_param[i][3], prior_a[4], prior_b[4]);
-			const int dec_id = tree.node[i].id;
-			const int anc_id = tree.node[i].ancestor->id;
-			// Initial parameters
-			const double rho_over_theta = mean_param[0]*full_param[i][0];
-			const double mean_import_length = 1.0/(mean_param[1]*full_param[i][1]);	// NB internal definition
-			const double import_divergence = mean_param[2]*full_param[i][2];
-			const double branch_length = mean_param[3]*full_param[i][3];
-			ML += mydouble_forward_backward_expectations_ClonalFrame_branch(dec_id,anc_id,node_nuc,position,ipat,kappa,pinuc,branch_length,rho_over_theta,mean_import_length,import_divergence,numEmiss,denEmiss,numTrans,denTrans).LOG();
-			// Store counters per branch
-			mutU_br[i] = numEmiss[0][1];
-			nsiU_br[i] = denEmiss[0];
-			mutI_br[i] = numEmiss[1][1];
-			nsiI_br[i] = denEmiss[1];
-			numI_br[i] = numTrans[0][1];
-			lenU_br[i] = denTrans[0];
-			numU_br[i] = numTrans[1][0];
-			lenI_br[i] = denTrans[1];
-			//			if(coutput) {
-			//				cout << "nmut = " << mutU_br << " nU = " << nsiU_br << " nsub = " << numEmiss[1][1] << " nI = " << denEmiss[1] << endl;
-			//				cout << "nU>I = " << numI_br << " dU = " << lenU_br << " nI>U = " << numTrans[1][0] << " dI = " << denTrans[1] << endl;
-			//				cout << "numTrans = " << numTrans[0][0] << " " << numTrans[0][1] << " " << numTrans[1][0] << " " << numTrans[0][0] << endl;
-			//			}
-		}
-	}
-	++neval;
-	// Update estimates of all the parameters: start with the branch lengths
-	double mean_param_num, mean_param_den;
-	// First, iterate to update the mean branch length parameter (max 3 times)
-	int j;
-	for(j=0;j<3;j++) {
-		mean_param_num = prior_a[3];
-		mean_param_den = prior_b[3];
-		for(i=0;i<informative.size();i++) {
-			if(informative[i]) {
-				mean_param_num += mutU_br[i];
-				mean_param_den += (prior_a[4]+mutU_br[i])*nsiU_br[i]/(prior_b[4]+mean_param[3]*nsiU_br[i]);
-			}
-		}
-		mean_param[3] = mean_param_num/mean_param_den;
-	}
-	// Second, update the individual branch length factors
-	for(i=0;i<informative.size();i++) {
-		if(informative[i]) {
-			full_param[i][3] = (prior_a[4]+mutU_br[i])/(prior_b[4]+mean_param[3]*nsiU_br[i]);
-			posterior_a[i][3] = (prior_a[4]+mutU_br[i]);
-		}
-	}
-	// Next update the recombination parameters
+	vector<double> mutU_br(nbranch,0.0), mutI_br(nbranch,0.0);
+	vector<double> nsiU_br(nbranch,0.0), nsiI_br(nbranch,0.0);
+	vector<double> numI_br(nbranch,0.0), numU_br(nbranch,0.0);
+	vector<double> lenU_br(nbranch,0.0), lenI_br(nbranch,0.0);
+	// The EM iterates on a single vector holding the four mean parameters followed by the four factors for every branch
+	vector<double> em_param(4+4*nbranch);
 	int p;
-	for(p=0;p<3;p++) {
-		// First, iterate to update the mean branch length parameter (max 3 times)
-		for(j=0;j<3;j++) {
-			mean_param_num = prior_a[p];
-			mean_param_den = prior_b[p];
-			for(i=0;i<informative.size();i++) {
-				if(informative[i]) {
-					double num, den;
-					if(p==0) {
-						num = numI_br[i];
-						// Adjust the counts for R/M according to the estimated branch lengths
-						den = lenU_br[i]*mean_param[3]*full_param[i][3];
-					} else if(p==1) {
-						num = numU_br[i];
-						den = lenI_br[i];
-					} else {
-						num = mutI_br[i];
-						den = nsiI_br[i];
-					}
-					mean_param_num += num;
-					mean_param_den += (prior_a[4]+num)*den/(prior_b[4]+mean_param[p]*den);
-				}
-			}
-			mean_param[p] = mean_param_num/mean_param_den;
-		}
-		// Second, update the individual per branch factors
-		for(i=0;i<informative.size();i++) {
+	for(p=0;p<4;p++) em_param[p] = mean_param[p];
+	for(i=0;i<nbranch;i++) {
+		for(p=0;p<4;p++) em_param[4+4*i+p] = full_param[i][p];
+	}
+	// One EM step: calculate the marginal likelihood and expected number of transitions and emissions by the forward-backward algorithm
+	// at param, and update the estimates of the parameters in new_param
+	auto em_step = [&](const vector<double> &param, vector<double> &new_param) -> double {
+		TimedPhase timed("em_iteration");
+		int i,j,p;
+		for(p=0;p<4;p++) mean_param[p] = param[p];
+		for(i=0;i<nbranch;i++) {
+			for(p=0;p<4;p++) full_param[i][p] = param[4+4*i+p];
+		}
+		// Include the effect of the prior (this is dubious - should instead compute loglikelihood of the pseudocounts)
+		double ML = gamma_loglikelihood(mean_param[0], prior_a[0], prior_b[0]) + gamma_loglikelihood(mean_param[1], prior_a[1], prior_b[1]) + gamma_loglikelihood(mean_param[2], prior_a[2], prior_b[2]) + gamma_loglikelihood(mean_param[3], prior_a[3], prior_b[3]);
+		for(i=0;i<nbranch;i++) {
 			if(informative[i]) {
-				double num, den;
-				if(p==0) {
-					num = numI_br[i];
-					// Adjust the counts for R/M according to the estimated branch lengths
-					den = lenU_br[i]*mean_param[3]*full_param[i][3];
-				} else if(p==1) {
-					num = numU_br[i];
-					den = lenI_br[i];
-				} else {
-					num = mutI_br[i];
-					den = nsiI_br[i];
-				}
-				full_param[i][p] = (prior_a[4]+num)/(prior_b[4]+mean_param[p]*den);
-				posterior_a[i][p] = (prior_a[4]+num);
+				// Initial parameters
+				rho_over_theta[i] = mean_param[0]*full_param[i][0];
+				mean_import_length[i] = 1.0/(mean_param[1]*full_param[i][1]);	// NB internal definition
+				import_divergence[i] = mean_param[2]*full_param[i][2];
+				branch_length[i] = mean_param[3]*full_param[i][3];
 			}
 		}
-	}
-	if(coutput) {
-		cout << "mean params =";
-		for(int j=0;j<mean_param.size();j++) cout << " " << mean_param[j];
-		cout << " ML = " << ML << endl;
-	}
-	
-	// Iterate until the maximum likelihood improves by less than some threshold
-	const int maxit = 200;
-	const double threshold = 1.0e-2;
-	int it;
-	for(it=0;it<maxit;it++) {
-		// Update the likelihood
-		double new_ML = gamma_loglikelihood(mean_param[0], prior_a[0], prior_b[0]) + gamma_loglikelihood(mean_param[1], prior_a[1], prior_b[1]) + gamma_loglikelihood(mean_param[2], prior_a[2], prior_b[2]) + gamma_loglikelihood(mean_param[3], prior_a[3], prior_b[3]);
-		for(i=0;i<informative.size();i++) {
+		forward_backward_expectations_ClonalFrame_allbranches(tree,emission_class,position,ipat,kappa,pinuc,informative,branch_length,rho_over_theta,mean_import_length,import_divergence,nthreads,kernel,expectations);
+		for(i=0;i<nbranch;i++) {
 			if(informative[i]) {
+				const Matrix<double> &numEmiss = expectations[i].numEmis, &numTrans = expectations[i].numTrans;
+				const vector<double> &denEmiss = expectations[i].denEmis, &denTrans = expectations[i].denTrans;
 				// Include the effect of the prior (this is dubious - should instead compute loglikelihood of the pseudocounts)
-				new_ML += gamma_loglikelihood(full_param[i][0], prior_a[4], prior_b[4]) + gamma_loglikelihood(full_param[i][1], prior_a[4], prior_b[4])
+				ML += gamma_loglikelihood(full_param[i][0], prior_a[4], prior_b[4]) + gamma_loglikelihood(full_param[i][1], prior_a[4], prior_b[4])
 				+ gamma_loglikelihood(full_param[i][2], prior_a[4], prior_b[4]) + gamma_loglikelihood(full_param[i][3], prior_a[4], prior_b[4]);
-				const int dec_id = tree.node[i].id;
-				const int anc_id = tree.node[i].ancestor->id;
-				// Initial parameters
-				const double rho_over_theta = mean_param[0]*full_param[i][0];
-				const double mean_import_length = 1.0/(mean_param[1]*full_param[i][1]);	// NB internal definition
-				const double import_divergence = mean_param[2]*full_param[i][2];
-				const double branch_length = mean_param[3]*full_param[i][3];
-				new_ML += mydouble_forward_backward_expectations_ClonalFrame_branch(dec_id,anc_id,node_nuc,position,ipat,kappa,pinuc,branch_length,rho_over_theta,mean_import_length,import_divergence,numEmiss,denEmiss,numTrans,denTrans).LOG();
+				ML += expectations[i].loglik;
 				// Store counters per branch
 				mutU_br[i] = numEmiss[0][1];
 				nsiU_br[i] = denEmiss[0];
@@ -2652,12 +3867,12 @@ double Baum_Welch_Rho_Per_Branch(const marginal_tree &tree, const Matrix<Nucleot
 		}
 		++neval;
 		// Update estimates of all the parameters: start with the branch lengths
+		double mean_param_num, mean_param_den;
 		// First, iterate to update the mean branch length parameter (max 3 times)
-		int j;
 		for(j=0;j<3;j++) {
 			mean_param_num = prior_a[3];
 			mean_param_den = prior_b[3];
-			for(i=0;i<informative.size();i++) {
+			for(i=0;i<nbranch;i++) {
 				if(informative[i]) {
 					mean_param_num += mutU_br[i];
 					mean_param_den += (prior_a[4]+mutU_br[i])*nsiU_br[i]/(prior_b[4]+mean_param[3]*nsiU_br[i]);
@@ -2666,7 +3881,7 @@ double Baum_Welch_Rho_Per_Branch(const marginal_tree &tree, const Matrix<Nucleot
 			mean_param[3] = mean_param_num/mean_param_den;
 		}
 		// Second, update the individual branch length factors
-		for(i=0;i<informative.size();i++) {
+		for(i=0;i<nbranch;i++) {
 			if(informative[i]) {
 				full_param[i][3] = (prior_a[4]+mutU_br[i])/(prior_b[4]+mean_param[3]*nsiU_br[i]);
 				posterior_a[i][3] = (prior_a[4]+mutU_br[i]);
@@ -2678,7 +3893,7 @@ double Baum_Welch_Rho_Per_Branch(const marginal_tree &tree, const Matrix<Nucleot
 			for(j=0;j<3;j++) {
 				mean_param_num = prior_a[p];
 				mean_param_den = prior_b[p];
-				for(i=0;i<informative.size();i++) {
+				for(i=0;i<nbranch;i++) {
 					if(informative[i]) {
 						double num, den;
 						if(p==0) {
@@ -2698,8 +3913,8 @@ double Baum_Welch_Rho_Per_Branch(const marginal_tree &tree, const Matrix<Nucleot
 				}
 				mean_param[p] = mean_param_num/mean_param_den;
 			}
-			// Second, update the individual branch length factors
-			for(i=0;i<informative.size();i++) {
+			// Second, update the individual per branch factors
+			for(i=0;i<nbranch;i++) {
 				if(informative[i]) {
 					double num, den;
 					if(p==0) {
@@ -2720,19 +3935,31 @@ double Baum_Welch_Rho_Per_Branch(const marginal_tree &tree, const Matrix<Nucleot
 		}
 		if(coutput) {
 			cout << "mean params =";
-			for(int j=0;j<mean_param.size();j++) cout << " " << mean_param[j];
-			cout << " ML = " << new_ML << endl;
+			for(j=0;j<mean_param.size();j++) cout << " " << mean_param[j];
+			cout << " ML = " << ML << endl;
 		}
-		// Test for no further improvement
-		if(new_ML-ML< -threshold) {
-			//cout << "Old likelihood = " << ML << " delta = " << new_ML-ML << endl;
-			//warning("Likelihood got worse in Baum_Welch");
-		} else if(fabs(new_ML-ML)<threshold) {
-			break;
+		new_param = param;
+		for(p=0;p<4;p++) new_param[p] = mean_param[p];
+		for(i=0;i<nbranch;i++) {
+			for(p=0;p<4;p++) new_param[4+4*i+p] = full_param[i][p];
 		}
-		// Otherwise continue
-		ML = new_ML;
+		return ML;
+	};
+	// Iterate until the maximum likelihood improves by less than some threshold
+	const int maxit = 200;
+	const double threshold = 1.0e-2;
+	if(checkpoint!=NULL) {
+		checkpoint->label = "Baum_Welch_Rho_Per_Branch";
+		checkpoint->input_checksum = checksum_EM_inputs("Baum_Welch_Rho_Per_Branch",tree,emission_class,position,ipat,kappa,pinuc,informative,prior_a,prior_b,em_param,kernel,accel);
+	}
+	// When resuming from a checkpoint, neval counts the EM steps taken before the interruption too
+	const int neval0 = neval;
+	const double ML = em_iterate(em_step,em_param,accel,1+maxit,threshold,em_iterations,checkpoint);
+	neval = neval0 + em_iterations.steps;
+	if(!em_iterations.converged) warning("Baum_Welch_Rho_Per_Branch(): maximum number of iterations reached");
+	for(p=0;p<4;p++) mean_param[p] = em_param[p];
+	for(i=0;i<nbranch;i++) {
+		for(p=0;p<4;p++) full_param[i][p] = em_param[4+4*i+p];
 	}
-	if(it==maxit) warning("Baum_Welch_Rho_Per_Branch(): maximum number of iterations reached");
 	return ML;
 }
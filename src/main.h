@@ -29,6 +29,11 @@
 #include "myutils/DNA.h"
 #include "myutils/mydouble.h"
 #include "powell.h"
+#include "threadpool.h"
+#include "squarem.h"
+#include "alignment.h"
+#include "timings.h"
+#include "outfile.h"
 #include "myutils/argumentwizard.h"
 #include <time.h>
 #include "myutils/random.h"
@@ -48,34 +53,146 @@ Random ran;
 
 enum Nucleotide {Adenine=0, Guanine, Cytosine, Thymine, N_ambiguous};
 enum ImportationState {Unimported=0, Imported};
+enum HMMKernel {HMMKernelMydouble=0, HMMKernelScaled, HMMKernelCheck};
+enum BranchOptimizer {BranchOptimizerNewton=0, BranchOptimizerPowell};
+
+// A run of imported sites on a branch, from beg up to but not including end (0-based alignment positions)
+struct ImportedInterval {
+	int beg, end;
+	ImportedInterval() : beg(0), end(0) {}
+	ImportedInterval(const int _beg, const int _end) : beg(_beg), end(_end) {}
+};
+
+// The observation emitted at a site by the ClonalFrame HMM on a branch is the pair of ancestral and descendant nucleotides,
+// packed into a single byte as 4*anc+dec so that the HMM routines need read only one stream per branch
+inline unsigned char pack_emission_class(const Nucleotide anc, const Nucleotide dec) { return (unsigned char)(4*anc+dec); }
+inline Nucleotide emission_class_anc(const unsigned char c) { return (Nucleotide)(c>>2); }
+inline Nucleotide emission_class_dec(const unsigned char c) { return (Nucleotide)(c&3); }
+inline bool emission_class_differs(const unsigned char c) { return (c>>2)!=(c&3); }
+
+// What every analysis needs to know of the ancestral and descendant sequences of one branch, computed once by summarize_branches
+struct BranchSummary {
+	Matrix<double> count;			// Substitution counts over the sites in use (see substitution_counts)
+	double differences;				// Number of those sites at which the ancestral and descendant nucleotides differ
+	double initial_branch_length;	// Crude estimate of the branch length (see crude_branch_length)
+	bool informative;				// Whether any site differs, without which the branch is not analysed by the EM algorithms
+};
+
+// Expected number of transitions and emissions, and the marginal log-likelihood, from the forward-backward algorithm for one branch
+struct BranchExpectations {
+	double loglik;
+	Matrix<double> numEmis, numTrans;
+	vector<double> denEmis, denTrans;
+};
+
+// A block of adjacent matching sites in the scaled forward-backward algorithm. P is its transfer matrix, so that the forward variables
+// at its end are the product of those at the preceding site with P. The expected number of Unimported sites in the block, and of
+// transitions from state j to state k within it, are the bilinear forms of G and H[j][k] with the flanking forward and backward variables
+struct ScaledHMMBlock {
+	double P[2][2], G[2][2], H[2][2][2][2];
+};
+
+// The site patterns and joint maximum likelihood ancestral sequences computed for one set of sites and value of kappa
+struct AncestralReconstruction {
+	double kappa;
+	vector<bool> usesite;
+	vector<int> pat1, cpat, ipat;
+	vector<double> pi;
+	Matrix<Nucleotide> node_nuc;
+	double loglik;
+};
+
+/*	Binary sidecar file (-cache_file) holding the preprocessed alignment so that repeated runs on the same data can skip
+	straight to branch length correction: the encoded alignment, any sites to ignore read from an XMFA file, the results of
+	compute_compatibility and the ancestral reconstructions used by the most recent run. The file is versioned and tied to
+	the FASTA and Newick files by checksums of their contents and ends with a checksum of its own, and the cached indices are
+	range-checked on reading, so a stale or damaged file is rebuilt rather than used.											*/
+class AlignmentCache {
+public:
+	static const unsigned int version = 2;
+	string filename;
+	unsigned long long fasta_checksum, newick_checksum;
+	unsigned int input_type;
+	vector<AncestralReconstruction> reconstruction;
+	// Whether each reconstruction has been used by the current run
+	vector<bool> used;
+	// Whether the contents differ from the file
+	bool modified;
+
+	AlignmentCache(const string &_filename, const unsigned int _input_type);
+	bool read(const char* fasta_file, const char* newick_file, EncodedAlignment &aln, vector<SiteInterval> &sites_to_ignore, vector<int> &compat, vector<bool> &anyN);
+	const AncestralReconstruction* find_reconstruction(const vector<bool> &usesite, const double kappa);
+	void add_reconstruction(const AncestralReconstruction &recon);
+	void write(const EncodedAlignment &aln, const vector<SiteInterval> &sites_to_ignore, const vector<int> &compat, const vector<bool> &anyN);
+};
+
+/*	Checkpoint of the EM algorithm, written every every_steps EM steps or every_seconds seconds (whichever is set) so that
+	a long run can be resumed after an interruption. The file identifies the EM routine and its inputs by a checksum,
+	so that it is only resumed by a run that would have reached the same state.										*/
+class EMCheckpoint : public EMStateStore {
+public:
+	static const unsigned int version = 1;
+	string filename;
+	int every_steps;
+	double every_seconds;
+	bool resume;
+	// Set by the EM routine before iterating
+	string label;
+	unsigned long long input_checksum;
+	// Steps and wall time at the last checkpoint
+	int last_steps;
+	double last_time;
+
+	EMCheckpoint(const string &_filename, const int _every_steps, const double _every_seconds, const bool _resume);
+	bool load(EMState &state);
+	void save(const EMState &state);
+	void write(const EMState &state);
+	void remove();
+};
 
 marginal_tree convert_rooted_NewickTree_to_marginal_tree(NewickTree &newick, vector<string> &tip_labels, vector<string> &all_node_labels);
 marginal_tree convert_unrooted_NewickTree_to_marginal_tree(NewickTree &newick, vector<string> &tip_labels, vector<string> &all_node_labels);
-vector<int> compute_compatibility(DNA &fa, marginal_tree &tree, vector<bool> &anyN, bool purge_singletons=true);
+vector<int> compute_compatibility(const EncodedAlignment &fa, marginal_tree &tree, vector<bool> &anyN, bool purge_singletons=true, const int nthreads=1);
 NewickTree read_Newick(const char* newick_file);
-Matrix<Nucleotide> FASTA_to_nucleotide(DNA &fa, vector<double> &empirical_nucleotide_frequencies, vector<bool> usesite);
-void find_alignment_patterns(Matrix<Nucleotide> &nuc, vector<bool> &iscompat, vector<string> &pat, vector<int> &pat1, vector<int> &cpat, vector<int> &ipat);
+Matrix<Nucleotide> FASTA_to_nucleotide(const EncodedAlignment &fa, vector<double> &empirical_nucleotide_frequencies, const vector<bool> &usesite);
+unsigned long long hash_pattern_key(const unsigned long long *key, const int nwords);
+void find_alignment_patterns(const EncodedAlignment &fa, const vector<bool> &usesite, vector<string> &pat, vector<int> &pat1, vector<int> &cpat, vector<int> &ipat);
 vector< Matrix<double> > compute_HKY85_ptrans(const marginal_tree &ctree, const double kappa, const vector<double> &pi);
 Matrix<mydouble> compute_HKY85_ptrans(const double x, const double k, const vector<double> &pi);
-Matrix<double> dcompute_HKY85_ptrans(const double x, const double kappa, const vector<double> &pi);
+void dcompute_HKY85_ptrans(const double x, const double kappa, const vector<double> &pi, Matrix<double> &ptrans, Matrix<double> &dptrans, Matrix<double> &d2ptrans);
 double HKY85_expected_rate(const vector<double> &n, const double kappa, const vector<double> &pi);
-mydouble maximum_likelihood_ancestral_sequences(Matrix<Nucleotide> &nuc, marginal_tree &ctree, const double kappa, const vector<double> &pi, vector<int> &pat1, vector<int> &cpat, Matrix<Nucleotide> &node_sequence);
+mydouble reconstruct_ancestral_sequences(const EncodedAlignment &fa, const vector<bool> &usesite, marginal_tree &ctree, const double kappa, AlignmentCache *cache, vector<int> &pat1, vector<int> &cpat, vector<int> &ipat, vector<double> &empirical_nucleotide_frequencies, Matrix<Nucleotide> &node_nuc, const int nthreads=1);
+mydouble maximum_likelihood_ancestral_sequences(Matrix<Nucleotide> &nuc, marginal_tree &ctree, const double kappa, const vector<double> &pi, vector<int> &cpat, Matrix<Nucleotide> &node_sequence, const int nthreads=1);
+mydouble marginal_ancestral_posteriors(const Matrix<Nucleotide> &nuc, const marginal_tree &ctree, const double kappa, const vector<double> &pi, const vector<int> &cpat, Matrix<Nucleotide> &max_base, Matrix<float> &max_posterior, vector<double> &pattern_loglik, const int nthreads=1);
+void write_marginal_posteriors(const Matrix<Nucleotide> &max_base, const Matrix<float> &max_posterior, const vector<string> &all_node_names, const char* file_name);
+void write_site_loglik(const vector<bool> &iscompat, const vector<int> &ipat, const vector<double> &pattern_loglik, const char* file_name);
 void write_newick(const marginal_tree &ctree, const vector<string> &all_node_names, const char* file_name);
 void write_newick(const marginal_tree &ctree, const vector<string> &all_node_names, ofstream &fout);
 void write_newick_node(const mt_node *node, const vector<string> &all_node_names, ofstream &fout);
-void write_ancestral_fasta(Matrix<Nucleotide> &nuc, vector<string> &all_node_names, const char* file_name);
-void write_filtered_fasta(vector< vector<ImportationState> > &imported, DNA * fa,vector<bool> & ignore_site, const char* file_name);
+void write_ancestral_fasta(Matrix<Nucleotide> &nuc, vector<string> &all_node_names, const char* file_name, const int nthreads=1);
+void write_filtered_fasta(vector< vector<ImportedInterval> > &imported, EncodedAlignment * fa,vector<bool> & ignore_site, const char* file_name);
 void write_position_cross_reference(vector<bool> &iscompat, vector<int> &ipat, const char* file_name);
-void write_position_cross_reference(vector<bool> &iscompat, vector<int> &ipat, ofstream &fout);
-mydouble likelihood_branch(const int dec_id, const int anc_id, const Matrix<Nucleotide> &node_nuc, const vector<int> &pat1, const vector<int> &cpat, const double kappa, const vector<double> &pinuc, const double branch_length);
+Matrix<unsigned char> compute_emission_classes(const marginal_tree &tree, const Matrix<Nucleotide> &node_nuc);
+Matrix<double> substitution_counts(const int dec_id, const int anc_id, const Matrix<Nucleotide> &node_nuc, const vector<int> &cpat);
+double substitution_differences(const Matrix<double> &count);
+double crude_branch_length(const Matrix<double> &count);
+vector<BranchSummary> summarize_branches(const marginal_tree &tree, const Matrix<Nucleotide> &node_nuc, const vector<int> &cpat, const int nbranch, const int nthreads=1);
+mydouble likelihood_branch(const Matrix<double> &count, const double kappa, const vector<double> &pinuc, const double branch_length);
+double maximum_likelihood_branch_length(const Matrix<double> &count, const double kappa, const vector<double> &pi, const double initial_branch_length, const double min_branch_length, const double max_branch_length, double &loglik, int &niter, const double tolerance=1.0e-10);
 bool string_to_bool(const string s, const string label="");
-void write_importation_status_intervals(vector< vector<ImportationState> > &imported, vector<string> &all_node_names, vector<bool> &isBLC, vector<int> &compat, const char* file_name, const int root_node,const char* chr_name);
-double Baum_Welch(const marginal_tree &tree, const Matrix<Nucleotide> &node_nuc, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const vector<bool> &informative, const vector<double> &prior_a, const vector<double> &prior_b, vector<double> &full_param, vector<double> &posterior_a, int &neval, const bool coutput, double &priorL);
-double Baum_Welch0(const marginal_tree &tree, const Matrix<Nucleotide> &node_nuc, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const vector<bool> &informative, const vector<double> &prior_a, const vector<double> &prior_b, const vector<double> &full_param, const vector<double> &posterior_a, const bool coutput);
+unsigned long long checksum_bytes(const void* data, const size_t len, unsigned long long h);
+unsigned long long checksum_file(const char* filename);
+unsigned long long checksum_EM_inputs(const char* label, const marginal_tree &tree, const Matrix<unsigned char> &emission_class, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const vector<bool> &informative, const vector<double> &prior_a, const vector<double> &prior_b, const vector<double> &param, const HMMKernel kernel, const EMAccelerator accel);
+void write_importation_status_intervals(vector< vector<ImportedInterval> > &imported, vector<string> &all_node_names, vector<bool> &isBLC, vector<int> &compat, const char* file_name, const int root_node,const char* chr_name);
+double Baum_Welch(const marginal_tree &tree, const Matrix<unsigned char> &emission_class, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const vector<bool> &informative, const vector<double> &prior_a, const vector<double> &prior_b, vector<double> &full_param, vector<double> &posterior_a, int &neval, const bool coutput, double &priorL, EMIterations &em_iterations, const int nthreads=1, const HMMKernel kernel=HMMKernelScaled, const EMAccelerator accel=EMAcceleratorSQUAREM, EMCheckpoint *checkpoint=NULL);
+double Baum_Welch0(const marginal_tree &tree, const Matrix<unsigned char> &emission_class, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const vector<bool> &informative, const vector<double> &prior_a, const vector<double> &prior_b, const vector<double> &full_param, const vector<double> &posterior_a, const bool coutput, const int nthreads=1, const HMMKernel kernel=HMMKernelScaled);
 double gamma_loglikelihood(const double x, const double a, const double b);
-Matrix<double> Baum_Welch_simulate_posterior(const marginal_tree &tree, const Matrix<Nucleotide> &node_nuc, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const vector<bool> &informative, const vector<double> &prior_a, const vector<double> &prior_b, const vector<double> &full_param, int &neval, const bool coutput, const int nsim);
-double Baum_Welch_Rho_Per_Branch(const marginal_tree &tree, const Matrix<Nucleotide> &node_nuc, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const vector<bool> &informative, const vector<double> &prior_a, const vector<double> &prior_b, vector<double> &mean_param, Matrix<double> &full_param, Matrix<double> &posterior_a, int &neval, const bool coutput);
-mydouble maximum_likelihood_ClonalFrame_branch_allsites(const int dec_id, const int anc_id, const Matrix<Nucleotide> &node_nuc, const vector<bool> &iscompat, const vector<int> &ipat, const double kappa, const vector<double> &pi, const double branch_length, const double rho_over_theta, const double mean_import_length, const double import_divergence, vector<ImportationState> &is_imported);
+Matrix<double> Baum_Welch_simulate_posterior(const marginal_tree &tree, const Matrix<unsigned char> &emission_class, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const vector<bool> &informative, const vector<double> &prior_a, const vector<double> &prior_b, const vector<double> &full_param, int &neval, const bool coutput, const int nsim);
+double Baum_Welch_Rho_Per_Branch(const marginal_tree &tree, const Matrix<unsigned char> &emission_class, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const vector<bool> &informative, const vector<double> &prior_a, const vector<double> &prior_b, vector<double> &mean_param, Matrix<double> &full_param, Matrix<double> &posterior_a, int &neval, const bool coutput, EMIterations &em_iterations, const int nthreads=1, const HMMKernel kernel=HMMKernelScaled, const EMAccelerator accel=EMAcceleratorSQUAREM, EMCheckpoint *checkpoint=NULL);
+mydouble scaled_forward_backward_expectations_ClonalFrame_branch(const int dec_id, const Matrix<unsigned char> &emission_class, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const double branch_length, const double rho_over_theta, const double mean_import_length, const double import_divergence, Matrix<double> &numEmis, vector<double> &denEmis, Matrix<double> &numTrans, vector<double> &denTrans);
+double forward_backward_expectations_ClonalFrame_branch(const HMMKernel kernel, const int dec_id, const Matrix<unsigned char> &emission_class, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const double branch_length, const double rho_over_theta, const double mean_import_length, const double import_divergence, Matrix<double> &numEmis, vector<double> &denEmis, Matrix<double> &numTrans, vector<double> &denTrans);
+void forward_backward_expectations_ClonalFrame_allbranches(const marginal_tree &tree, const Matrix<unsigned char> &emission_class, const vector<double> &position, const vector<int> &ipat, const double kappa, const vector<double> &pinuc, const vector<bool> &informative, const vector<double> &branch_length, const vector<double> &rho_over_theta, const vector<double> &mean_import_length, const vector<double> &import_divergence, const int nthreads, const HMMKernel kernel, vector<BranchExpectations> &expectations);
+mydouble maximum_likelihood_ClonalFrame_branch_allsites(const int dec_id, const Matrix<unsigned char> &emission_class, const vector<double> &position, const int nsites, const vector<int> &ipat, const double kappa, const vector<double> &pi, const double branch_length, const double rho_over_theta, const double mean_import_length, const double import_divergence, vector<ImportedInterval> &imported);
 
 class orderNewickNodesByStatusLabelAndAge {
 public:
@@ -119,21 +236,19 @@ class ClonalFrameRescaleBranchFunction : public PowellFunction {
 public:
 	// References to non-member variables
 	const mt_node &node;
-	const Matrix<Nucleotide> &node_nuc;
-	const vector<int> &pat1;
-	const vector<int> &cpat;
 	const double kappa;
 	const vector<double> &pi;
 	// True member variable
+	const Matrix<double> count;
 	mydouble ML;
 	int neval;
 	const bool multithread;
 	double crude_branch_length;
 	double min_branch_length;
 public:
-	ClonalFrameRescaleBranchFunction(const mt_node &_node, const Matrix<Nucleotide> &_node_nuc, const vector<int> &_pat1, const vector<int> &_cpat, const double _kappa,
+	ClonalFrameRescaleBranchFunction(const mt_node &_node, const Matrix<double> &_count, const double _kappa,
 									const vector<double> &_pi, const bool _multithread, const double _crude_branch_length, const double _min_branch_length) :
-	node(_node), node_nuc(_node_nuc), pat1(_pat1), cpat(_cpat), kappa(_kappa), pi(_pi), neval(0),
+	node(_node), kappa(_kappa), pi(_pi), count(_count), neval(0),
 	multithread(_multithread), crude_branch_length(_crude_branch_length), min_branch_length(_min_branch_length) {};
 	double f(const vector<double>& x) {
 		++neval;
@@ -141,10 +256,8 @@ public:
 		if(!(x.size()==1)) error("ClonalFrameRescaleBranchFunction::f(): 1 argument required");
 		double branch_length = pow(10.,x[0]);
 		if(branch_length<min_branch_length) branch_length = min_branch_length;
-		const int dec_id = node.id;
-		const int anc_id = node.ancestor->id;
 		// Calculate likelihood
-		ML = likelihood_branch(dec_id,anc_id,node_nuc,pat1,cpat,kappa,pi,branch_length);
+		ML = likelihood_branch(count,kappa,pi,branch_length);
 		return -ML.LOG();
 	}
 };
@@ -157,12 +270,14 @@ class ClonalFrameBaumWelch {
 public:
 	// References to non-member variables
 	const marginal_tree &tree;
-	const Matrix<Nucleotide> &node_nuc;
+	// Observations for the HMM on every branch, computed once from the ancestral sequences
+	const Matrix<unsigned char> emission_class;
 	const vector<bool> &iscompat;
 	const vector<int> &ipat;
 	const double kappa;
 	const vector<double> &pi;
-	vector< vector<ImportationState> > &is_imported;
+	// Imported intervals per branch
+	vector< vector<ImportedInterval> > &is_imported;
 	// True member variable
 	double ML,ML0,priorL;
 	double PR;
@@ -177,14 +292,20 @@ public:
 	vector<double> posterior_a;
 	bool guess_initial_m;
 	bool coutput;
+	int nthreads;
+	HMMKernel kernel;
+	EMAccelerator accel;
+	EMIterations em_iterations;
+	// Checkpoint for the EM iterations, if any
+	EMCheckpoint *checkpoint;
 public:
-	ClonalFrameBaumWelch(const marginal_tree &_tree, const Matrix<Nucleotide> &_node_nuc, const vector<bool> &_iscompat, const vector<int> &_ipat, const double _kappa,
-							   const vector<double> &_pi, vector< vector<ImportationState> > &_is_imported,
-							   const vector<double> &_prior_a, const vector<double> &_prior_b, const int _root_node, const bool _guess_initial_m, const bool _coutput=false) :
-	tree(_tree), node_nuc(_node_nuc), iscompat(_iscompat), ipat(_ipat), kappa(_kappa),
+	ClonalFrameBaumWelch(const marginal_tree &_tree, const Matrix<Nucleotide> &_node_nuc, const vector<bool> &_iscompat, const vector<int> &_ipat, const vector<BranchSummary> &branch_summary, const double _kappa,
+							   const vector<double> &_pi, vector< vector<ImportedInterval> > &_is_imported,
+							   const vector<double> &_prior_a, const vector<double> &_prior_b, const int _root_node, const bool _guess_initial_m, const bool _coutput=false, const int _nthreads=1, const HMMKernel _kernel=HMMKernelScaled, const EMAccelerator _accel=EMAcceleratorSQUAREM) :
+	tree(_tree), emission_class(compute_emission_classes(_tree,_node_nuc)), iscompat(_iscompat), ipat(_ipat), kappa(_kappa),
 	pi(_pi), neval(0), is_imported(_is_imported),
 	prior_a(_prior_a), prior_b(_prior_b), root_node(_root_node), initial_branch_length(_root_node), informative(_root_node), guess_initial_m(_guess_initial_m),
-	coutput(_coutput) {
+	coutput(_coutput), nthreads(_nthreads), kernel(_kernel), accel(_accel), checkpoint(NULL) {
 		if(prior_a.size()!=4) error("ClonalFrameBaumWelch: prior a must have length 4");
 		if(prior_b.size()!=4) error("ClonalFrameBaumWelch: prior b must have length 4");
 		int i;
@@ -195,24 +316,12 @@ public:
 				which_compat.push_back((double)i);
 			}
 		}
-		int j,k;
+		if(branch_summary.size()<root_node) error("ClonalFrameBaumWelch: a summary of every branch is required");
 		for(i=0;i<root_node;i++) {
 			// Crudely re-estimate branch length: use this as the mean of the prior on branch length ????
-			double pd = 1.0, pd_den = 2.0;
-			const int dec_id = tree.node[i].id;
-			const int anc_id = tree.node[i].ancestor->id;
-			for(j=0,k=0;j<iscompat.size();j++) {
-				if(iscompat[j]) {
-					Nucleotide dec = node_nuc[dec_id][ipat[k]];
-					Nucleotide anc = node_nuc[anc_id][ipat[k]];
-					if(dec!=anc) ++pd;
-					++pd_den;
-					++k;
-				}
-			}
-			initial_branch_length[i] = pd/pd_den;
+			initial_branch_length[i] = branch_summary[i].initial_branch_length;
 //			initial_branch_length[i] = tree.node[i].edge_time;
-			informative[i] = (pd>=2.0) ? true : false;
+			informative[i] = branch_summary[i].informative;
 		}
 	}
 	vector<double> maximize_likelihood(const vector<double> &param) {
@@ -243,23 +352,24 @@ public:
 			full_param.push_back(ibl);
 		}
 		// Iterate
-		ML = Baum_Welch(tree,node_nuc,which_compat,ipat,kappa,pi,informative,prior_a,prior_b,full_param,posterior_a,neval,coutput,priorL);
-		// Update importation status for all branches **for ALL SITES**, including uninformative ones
-		for(i=0;i<initial_branch_length.size();i++) {
+		ML = Baum_Welch(tree,emission_class,which_compat,ipat,kappa,pi,informative,prior_a,prior_b,full_param,posterior_a,neval,coutput,priorL,em_iterations,nthreads,kernel,accel,checkpoint);
+		// Update importation status for all branches **for ALL SITES**, including uninformative ones, in parallel over branches
+		TimedPhase timed("importation_viterbi");
+		parallel_for(initial_branch_length.size(),nthreads,[&](const int i) {
 			const int dec_id = tree.node[i].id;
-			const int anc_id = tree.node[i].ancestor->id;
 			const double rho_over_theta = full_param[0];
 			const double mean_import_length = full_param[1];
 			const double import_divergence = full_param[2];
 			const double branch_length = (informative[i]) ? full_param[3+i] : initial_branch_length[i];
-			maximum_likelihood_ClonalFrame_branch_allsites(dec_id,anc_id,node_nuc,iscompat,ipat,kappa,pi,branch_length,rho_over_theta,mean_import_length,import_divergence,is_imported[i]);
-		}
-		ML0 = Baum_Welch0(tree,node_nuc,which_compat,ipat,kappa,pi,informative,prior_a,prior_b,full_param,posterior_a,coutput);
+			maximum_likelihood_ClonalFrame_branch_allsites(dec_id,emission_class,which_compat,iscompat.size(),ipat,kappa,pi,branch_length,rho_over_theta,mean_import_length,import_divergence,is_imported[i]);
+		});
+		timed.stop();
+		ML0 = Baum_Welch0(tree,emission_class,which_compat,ipat,kappa,pi,informative,prior_a,prior_b,full_param,posterior_a,coutput,nthreads,kernel);
 		return full_param;
 	}
 	Matrix<double> simulate_posterior(const vector<double> &param, const int nsim) {
 		if(!(param.size()==3+informative.size())) error("ClonalFrameBaumWelch::simulate_posterior(): 3 arguments required");
-		return Baum_Welch_simulate_posterior(tree,node_nuc,which_compat,ipat,kappa,pi,informative,prior_a,prior_b,param,neval,coutput,nsim);
+		return Baum_Welch_simulate_posterior(tree,emission_class,which_compat,ipat,kappa,pi,informative,prior_a,prior_b,param,neval,coutput,nsim);
 	}
 };
 
@@ -274,12 +384,14 @@ class ClonalFrameBaumWelchRhoPerBranch {
 public:
 	// References to non-member variables
 	const marginal_tree &tree;
-	const Matrix<Nucleotide> &node_nuc;
+	// Observations for the HMM on every branch, computed once from the ancestral sequences
+	const Matrix<unsigned char> emission_class;
 	const vector<bool> &iscompat;
 	const vector<int> &ipat;
 	const double kappa;
 	const vector<double> &pi;
-	vector< vector<ImportationState> > &is_imported;
+	// Imported intervals per branch
+	vector< vector<ImportedInterval> > &is_imported;
 	// True member variable
 	double ML;
 	double PR;
@@ -295,14 +407,20 @@ public:
 	Matrix<double> posterior_a;
 	bool guess_initial_m;
 	bool coutput;
+	int nthreads;
+	HMMKernel kernel;
+	EMAccelerator accel;
+	EMIterations em_iterations;
+	// Checkpoint for the EM iterations, if any
+	EMCheckpoint *checkpoint;
 public:
-	ClonalFrameBaumWelchRhoPerBranch(const marginal_tree &_tree, const Matrix<Nucleotide> &_node_nuc, const vector<bool> &_iscompat, const vector<int> &_ipat, const double _kappa,
-						 const vector<double> &_pi, vector< vector<ImportationState> > &_is_imported,
-						 const vector<double> &_prior_a, const vector<double> &_prior_b, const int _root_node, const bool _guess_initial_m, const bool _coutput=false) :
-	tree(_tree), node_nuc(_node_nuc), iscompat(_iscompat), ipat(_ipat), kappa(_kappa),
+	ClonalFrameBaumWelchRhoPerBranch(const marginal_tree &_tree, const Matrix<Nucleotide> &_node_nuc, const vector<bool> &_iscompat, const vector<int> &_ipat, const vector<BranchSummary> &branch_summary, const double _kappa,
+						 const vector<double> &_pi, vector< vector<ImportedInterval> > &_is_imported,
+						 const vector<double> &_prior_a, const vector<double> &_prior_b, const int _root_node, const bool _guess_initial_m, const bool _coutput=false, const int _nthreads=1, const HMMKernel _kernel=HMMKernelScaled, const EMAccelerator _accel=EMAcceleratorSQUAREM) :
+	tree(_tree), emission_class(compute_emission_classes(_tree,_node_nuc)), iscompat(_iscompat), ipat(_ipat), kappa(_kappa),
 	pi(_pi), neval(0), is_imported(_is_imported),
 	prior_a(_prior_a), prior_b(_prior_b), root_node(_root_node), initial_branch_length(_root_node), informative(_root_node), guess_initial_m(_guess_initial_m),
-	coutput(_coutput) {
+	coutput(_coutput), nthreads(_nthreads), kernel(_kernel), accel(_accel), checkpoint(NULL) {
 		if(prior_a.size()!=5) error("ClonalFrameBaumWelchRhoPerBranch: prior a must have length 5");
 		if(prior_b.size()!=5) error("ClonalFrameBaumWelchRhoPerBranch: prior b must have length 5");
 		int i;
@@ -313,23 +431,11 @@ public:
 				which_compat.push_back((double)i);
 			}
 		}
-		int j,k;
+		if(branch_summary.size()<root_node) error("ClonalFrameBaumWelchRhoPerBranch: a summary of every branch is required");
 		for(i=0;i<root_node;i++) {
 			// Crudely re-estimate branch length: use this as the mean of the prior on branch length ????
-			double pd = 1.0, pd_den = 2.0;
-			const int dec_id = tree.node[i].id;
-			const int anc_id = tree.node[i].ancestor->id;
-			for(j=0,k=0;j<iscompat.size();j++) {
-				if(iscompat[j]) {
-					Nucleotide dec = node_nuc[dec_id][ipat[k]];
-					Nucleotide anc = node_nuc[anc_id][ipat[k]];
-					if(dec!=anc) ++pd;
-					++pd_den;
-					++k;
-				}
-			}
-			initial_branch_length[i] = pd/pd_den;
-			informative[i] = (pd>=2.0) ? true : false;
+			initial_branch_length[i] = branch_summary[i].initial_branch_length;
+			informative[i] = branch_summary[i].informative;
 		}
 	}
 	void maximize_likelihood(const vector<double> &param) {
@@ -371,23 +477,23 @@ public:
 			full_param[i][3] = ibl/mean_param[3];
 		}
 		// Iterate
-		ML = Baum_Welch_Rho_Per_Branch(tree,node_nuc,which_compat,ipat,kappa,pi,informative,prior_a,prior_b,mean_param,full_param,posterior_a,neval,coutput);
-		// Update importation status for all branches **for ALL SITES**, including uninformative ones
-		for(i=0;i<initial_branch_length.size();i++) {
+		ML = Baum_Welch_Rho_Per_Branch(tree,emission_class,which_compat,ipat,kappa,pi,informative,prior_a,prior_b,mean_param,full_param,posterior_a,neval,coutput,em_iterations,nthreads,kernel,accel,checkpoint);
+		// Update importation status for all branches **for ALL SITES**, including uninformative ones, in parallel over branches
+		TimedPhase timed("importation_viterbi");
+		parallel_for(initial_branch_length.size(),nthreads,[&](const int i) {
 			const int dec_id = tree.node[i].id;
-			const int anc_id = tree.node[i].ancestor->id;
 			const double rho_over_theta = mean_param[0]*full_param[i][0];
 			const double mean_import_length = 1.0/(mean_param[1]*full_param[i][1]);
 			const double import_divergence = mean_param[2]*full_param[i][2];
 			const double branch_length = (informative[i]) ? mean_param[3]*full_param[i][3] : initial_branch_length[i];
-			maximum_likelihood_ClonalFrame_branch_allsites(dec_id,anc_id,node_nuc,iscompat,ipat,kappa,pi,branch_length,rho_over_theta,mean_import_length,import_divergence,is_imported[i]);
-		}
+			maximum_likelihood_ClonalFrame_branch_allsites(dec_id,emission_class,which_compat,iscompat.size(),ipat,kappa,pi,branch_length,rho_over_theta,mean_import_length,import_divergence,is_imported[i]);
+		});
 		return;
 	}
 	Matrix<double> simulate_posterior(const vector<double> &param, const int nsim) {
 		error("Not implemented yet");
 //		if(!(param.size()==3+informative.size())) error("ClonalFrameBaumWelchRhoPerBranch::simulate_posterior(): 3 arguments required");
-//		return Baum_Welch_simulate_posterior(tree,node_nuc,which_compat,ipat,kappa,pi,informative,prior_a,prior_b,param,neval,coutput,nsim);
+//		return Baum_Welch_simulate_posterior(tree,emission_class,which_compat,ipat,kappa,pi,informative,prior_a,prior_b,param,neval,coutput,nsim);
 		return Matrix<double>(0,0,0);
 	}
 };
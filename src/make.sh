@@ -1 +1 @@
-g++ main.cpp -o ClonalFrameML -O3
+g++ main.cpp -o ClonalFrameML -O3 -pthread -lz
@@ -0,0 +1,175 @@
+/*
+ *  outfile.h
+ *  Part of ClonalFrameML
+ *
+ *
+ *  ClonalFrameML is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ClonalFrameML is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with ClonalFrameML. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _OUTFILE_H_
+#define _OUTFILE_H_
+
+#include <string>
+#include <cstring>
+#include <sstream>
+#include <fstream>
+#include <zlib.h>
+#ifdef CFML_ZSTD
+#include <zstd.h>
+#endif
+
+enum OutputCompression {OutputCompressionNone=0, OutputCompressionGzip, OutputCompressionZstd};
+
+// The compression implied by the extension of a file name: ".gz" for gzip and ".zst" for Zstandard
+inline OutputCompression output_compression(const string &file_name) {
+	const size_t len = file_name.size();
+	if(len>=3 && file_name.compare(len-3,3,".gz")==0) return OutputCompressionGzip;
+	if(len>=4 && file_name.compare(len-4,4,".zst")==0) return OutputCompressionZstd;
+	return OutputCompressionNone;
+}
+
+// File name extension for a compression
+inline const char* output_compression_extension(const OutputCompression compression) {
+	if(compression==OutputCompressionGzip) return ".gz";
+	if(compression==OutputCompressionZstd) return ".zst";
+	return "";
+}
+
+// Whether this build can write a compression
+inline bool output_compression_available(const OutputCompression compression) {
+#ifndef CFML_ZSTD
+	if(compression==OutputCompressionZstd) return false;
+#endif
+	return true;
+}
+
+/*	Compress n bytes of data into a self-contained gzip member or Zstandard frame, or copy them if compression is none.
+	Both formats allow members or frames to be concatenated into one file, so blocks of a file may be compressed
+	independently, and in parallel, and written in order. Safe to call concurrently.	*/
+inline void output_encode(const OutputCompression compression, const char* data, const size_t n, string &out) {
+	out.clear();
+	if(n==0) return;
+	if(compression==OutputCompressionNone) {
+		out.assign(data,n);
+	} else if(compression==OutputCompressionGzip) {
+		z_stream zs;
+		memset(&zs,0,sizeof(zs));
+		// 15+16 window bits: the largest window, with a gzip header and trailer
+		if(deflateInit2(&zs,Z_DEFAULT_COMPRESSION,Z_DEFLATED,15+16,8,Z_DEFAULT_STRATEGY)!=Z_OK) error("output_encode(): could not initialize gzip compression");
+		out.resize(deflateBound(&zs,n));
+		zs.next_in = (Bytef*)data;
+		zs.avail_in = n;
+		zs.next_out = (Bytef*)&out[0];
+		zs.avail_out = out.size();
+		const int ret = deflate(&zs,Z_FINISH);
+		const size_t len = zs.total_out;
+		deflateEnd(&zs);
+		if(ret!=Z_STREAM_END) error("output_encode(): gzip compression failed");
+		out.resize(len);
+	} else {
+#ifdef CFML_ZSTD
+		out.resize(ZSTD_compressBound(n));
+		const size_t len = ZSTD_compress(&out[0],out.size(),data,n,ZSTD_CLEVEL_DEFAULT);
+		if(ZSTD_isError(len)) {
+			stringstream errTxt;
+			errTxt << "output_encode(): Zstandard compression failed: " << ZSTD_getErrorName(len);
+			error(errTxt.str().c_str());
+		}
+		out.resize(len);
+#else
+		error("output_encode(): this build of ClonalFrameML does not support Zstandard compression");
+#endif
+	}
+}
+
+/*	An output file written through a large buffer. The buffer is compressed, according to the extension of the file
+	name, and written whenever it fills, so that the text is formatted without the overhead of a stream per character.	*/
+class OutputFile {
+public:
+	string file_name;
+	OutputCompression compression;
+protected:
+	ofstream fout;
+	string buffer;
+	size_t buffer_size;
+	string encoded;
+public:
+	OutputFile(const string &_file_name, const size_t _buffer_size=(1<<22)) : file_name(_file_name), compression(output_compression(_file_name)), fout(_file_name.c_str(),std::ios::binary), buffer_size(_buffer_size) {
+		buffer.reserve(buffer_size);
+	}
+	~OutputFile() {
+		if(fout.is_open()) close();
+	}
+	bool operator!() const {
+		return !fout;
+	}
+	void write(const char* data, const size_t n) {
+		buffer.append(data,n);
+		if(buffer.size()>=buffer_size) flush();
+	}
+	void write(const string &s) {
+		write(s.data(),s.size());
+	}
+	void put(const char c) {
+		buffer.push_back(c);
+		if(buffer.size()>=buffer_size) flush();
+	}
+	// Append the decimal representation of an integer
+	void write_int(const long long x) {
+		char text[24];
+		char *end = text+sizeof(text), *p = end;
+		unsigned long long u = (x<0) ? -(unsigned long long)x : (unsigned long long)x;
+		do {
+			*--p = '0'+(char)(u%10);
+			u /= 10;
+		} while(u>0);
+		if(x<0) *--p = '-';
+		write(p,end-p);
+	}
+	// Write a block that output_encode() has already compressed with this file's compression
+	void write_encoded(const string &block) {
+		flush();
+		write_raw(block.data(),block.size());
+	}
+	void flush() {
+		if(buffer.empty()) return;
+		if(compression==OutputCompressionNone) {
+			write_raw(buffer.data(),buffer.size());
+		} else {
+			output_encode(compression,buffer.data(),buffer.size(),encoded);
+			write_raw(encoded.data(),encoded.size());
+		}
+		buffer.clear();
+	}
+	void close() {
+		flush();
+		fout.close();
+		if(!fout) {
+			stringstream errTxt;
+			errTxt << "OutputFile::close(): could not write file " << file_name;
+			error(errTxt.str().c_str());
+		}
+	}
+protected:
+	void write_raw(const char* data, const size_t n) {
+		fout.write(data,n);
+		if(!fout) {
+			stringstream errTxt;
+			errTxt << "OutputFile: could not write file " << file_name;
+			error(errTxt.str().c_str());
+		}
+	}
+};
+
+#endif // _OUTFILE_H_
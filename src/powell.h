@@ -45,6 +45,7 @@ public:
 	Brent brent;
 
 	bool coutput;
+	ostream *outstream;			// where the progress is written if coutput is true
 	int ITMAX;					// maximum number of iterations
 	double TINY;				// a small number
 	double TOL;					// tolerance
@@ -62,7 +63,7 @@ public:
 	bool fail;
 
 public:
-	Powell(PowellFunction &PowFunc_in) : PowFunc(PowFunc_in), ITMAX(200), TINY(1.0e-25), TOL(1.0e-8), coutput(false), brent(*this) {}
+	Powell(PowellFunction &PowFunc_in) : PowFunc(PowFunc_in), ITMAX(200), TINY(1.0e-25), TOL(1.0e-8), coutput(false), outstream(&cout), brent(*this) {}
 
 	const vector<double>& minimize(const vector<double>& parameters, const double tol) {
 		fail = false;
@@ -74,11 +75,11 @@ public:
 		for(i=0;i<N;i++) xi[i][i] = 1.;
 		powell(tol, n_iterations, function_minimum);
 		if(coutput) {
-			if(fail) cout << "Minimization failed" << endl;
+			if(fail) *outstream << "Minimization failed" << endl;
 			else {
-				cout << "Function is minimized at f(";
-				for(i=0;i<N;i++) cout << p[i] << " ";
-				cout << "\b) = " << function_minimum << endl;
+				*outstream << "Function is minimized at f(";
+				for(i=0;i<N;i++) *outstream << p[i] << " ";
+				*outstream << "\b) = " << function_minimum << endl;
 			}
 		}
 		return p;
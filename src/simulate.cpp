@@ -0,0 +1,287 @@
+/*
+ *  simulate.cpp
+ *  Part of ClonalFrameML
+ *
+ *  ClonalFrameML is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ClonalFrameML is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with ClonalFrameML. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+/*	cfml_simulate: simulate benchmark data under the ClonalFrame model. A clonal genealogy is drawn from the Kingman
+	coalescent, and along every branch the genome alternates between unimported and imported stretches exactly as in the
+	hidden Markov model of ClonalFrameML: imports begin at rate R/theta times the branch length per site and have mean
+	length delta. Unimported sites evolve under HKY85 for the length of the branch and imported sites for a distance nu.
+	The genealogy and the substitution model are those of the coalesce library in bank/ (coalescent and HKY85), without
+	recombination in the coalescent since imports come from outside the sample in the ClonalFrame model.
+	The outputs are a Newick tree, a FASTA alignment of the tips and the true importation intervals, in the same format
+	as the importation status file of ClonalFrameML so that inferences can be scored against them.				*/
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+using namespace std;
+
+#include "coalesce/coalescent_process.h"
+#include "coalesce/mutation.h"
+#include "myutils/argumentwizard.h"
+
+using namespace myutils;
+
+// A stretch of sites [beg,end) imported on one branch
+struct ImportedInterval {
+	int beg, end;
+};
+
+void evolve_branch(const string &anc, string &dec, Mutation_Matrix &mut, const double branch_length, const double import_divergence, const double recrate, const double endrecrate, vector<ImportedInterval> &imports, Random &ran);
+void evolve_stretch(string &dec, const int beg, const int end, Mutation_Matrix &mut, const double distance, Random &ran);
+string node_label(const marginal_tree &tree, const int id);
+void write_newick_node(const marginal_tree &tree, const mt_node *node, const double time_scale, ofstream &fout);
+
+int main(const int argc, const char* argv[]) {
+	if(argc<2) {
+		stringstream errTxt;
+		errTxt << "Syntax: cfml_simulate output_prefix [OPTIONS]" << endl;
+		errTxt << endl;
+		errTxt << "Writes output_prefix.newick, output_prefix.fasta and output_prefix.importation_status.txt" << endl;
+		errTxt << endl;
+		errTxt << "Options:" << endl;
+		errTxt << "-n                             value > 1 (default 20)       Number of genomes." << endl;
+		errTxt << "-length                        value > 0 (default 100000)   Number of sites." << endl;
+		errTxt << "-theta                         value > 0 (default 0.01)     Population mutation rate per site, so that branch lengths are theta/2 per coalescent unit." << endl;
+		errTxt << "-rho_over_theta                value >= 0 (default 0.1)     Ratio of the rates of recombination and mutation, R/theta." << endl;
+		errTxt << "-mean_import_length            value > 0 (default 500)      Mean length of imported DNA, delta." << endl;
+		errTxt << "-import_divergence             value > 0 (default 0.05)     Divergence of imported DNA, nu." << endl;
+		errTxt << "-kappa                         value > 0 (default 2.0)      Relative rate of transitions vs transversions." << endl;
+		errTxt << "-pi                            df \"0.25 0.25 0.25 0.25\"     Equilibrium frequencies of A, G, C and T." << endl;
+		errTxt << "-seed                          value (default 0)            Random number seed, or 0 to seed from the clock." << endl;
+		cout << errTxt.str().c_str() << endl;
+		return 0;
+	}
+	const char* out_prefix = argv[1];
+	string tree_out_file = string(out_prefix) + ".newick";
+	string fasta_out_file = string(out_prefix) + ".fasta";
+	string import_out_file = string(out_prefix) + ".importation_status.txt";
+	// Set default options
+	ArgumentWizard arg;
+	arg.case_sensitive = false;
+	int n = 20, length = 100000, seed = 0;
+	double theta = 0.01, rho_over_theta = 0.1, mean_import_length = 500.0, import_divergence = 0.05, kappa = 2.0;
+	string string_pi = "0.25 0.25 0.25 0.25";
+	arg.add_item("n",							TP_INT,		&n);
+	arg.add_item("length",						TP_INT,		&length);
+	arg.add_item("theta",						TP_DOUBLE,	&theta);
+	arg.add_item("rho_over_theta",				TP_DOUBLE,	&rho_over_theta);
+	arg.add_item("mean_import_length",			TP_DOUBLE,	&mean_import_length);
+	arg.add_item("import_divergence",			TP_DOUBLE,	&import_divergence);
+	arg.add_item("kappa",						TP_DOUBLE,	&kappa);
+	arg.add_item("pi",							TP_STRING,	&string_pi);
+	arg.add_item("seed",						TP_INT,		&seed);
+	arg.read_input(argc-1,argv+1);
+	if(n<2) error("-n must be at least 2");
+	if(length<1) error("-length must be positive");
+	if(theta<=0.0) error("-theta must be positive");
+	if(rho_over_theta<0.0) error("-rho_over_theta cannot be negative");
+	if(mean_import_length<=0.0) error("-mean_import_length must be positive");
+	if(import_divergence<=0.0) error("-import_divergence must be positive");
+	if(kappa<=0.0) error("-kappa must be positive");
+	vector<double> pi(0);
+	stringstream sstream_pi;
+	sstream_pi << string_pi;
+	int i;
+	for(i=0;i<4;i++) {
+		double pi_elem;
+		sstream_pi >> pi_elem;
+		if(sstream_pi.fail() || pi_elem<=0.0) error("Could not interpret value specified by pi");
+		pi.push_back(pi_elem);
+	}
+	const double pi_total = pi[0]+pi[1]+pi[2]+pi[3];
+	for(i=0;i<4;i++) pi[i] /= pi_total;
+	Random ran;
+	if(seed!=0) ran.setseed((seed<0) ? seed : -seed);
+	cout << "cfml_simulate: n = " << n << " length = " << length << " theta = " << theta << " R/theta = " << rho_over_theta;
+	cout << " delta = " << mean_import_length << " nu = " << import_divergence << " kappa = " << kappa << " seed = " << ran.getseed() << endl;
+
+	// Simulate the clonal genealogy from the Kingman coalescent for a single site, so without recombination. Its times are in
+	// coalescent units, and are converted to expected substitutions per site by the factor theta/2
+	Control con;
+	con.coutput = false;
+	con.nsamp = n;
+	con.ntimes = vector<double>(n,0.0);
+	con.seq_len = 1;
+	con.len = vector<int>(1,1);
+	coalescent co;
+	co.initialize(&con,&ran);
+	co.go();
+	marginal_tree &tree = co.tree[0];
+	const double time_scale = theta/2.0;
+	const int nnodes = tree.size;
+	const int root = nnodes-1;
+	ofstream tout(tree_out_file.c_str());
+	if(!tout) {
+		stringstream errTxt;
+		errTxt << "could not open file " << tree_out_file << " for writing";
+		error(errTxt.str().c_str());
+	}
+	write_newick_node(tree,&tree.node[root],time_scale,tout);
+	tout << ";" << endl;
+	tout.close();
+	cout << "Wrote tree of height " << tree.height()*time_scale << " and total branch length " << tree.branch_length()*time_scale << " to " << tree_out_file << endl;
+
+	// Evolve the sequences from the root, depth first, so that only the sequences of the ancestors of the current node are held in memory
+	ofstream fout(fasta_out_file.c_str());
+	if(!fout) {
+		stringstream errTxt;
+		errTxt << "could not open file " << fasta_out_file << " for writing";
+		error(errTxt.str().c_str());
+	}
+	// HKY85 rate matrix scaled to one expected substitution per unit time, so that times are distances
+	HKY85 unscaled(1.0,kappa,pi,&ran);
+	HKY85 mut(1.0/unscaled.expected_rate(),kappa,pi,&ran);
+	vector< vector<ImportedInterval> > imports(nnodes);
+	vector<string> sequence(nnodes);
+	sequence[root] = string(length,'A');
+	const char AGCT[4] = {'A','G','C','T'};
+	int pos;
+	for(pos=0;pos<length;pos++) sequence[root][pos] = AGCT[mut.draw()];
+	vector<int> stack(1,root);
+	long long nimported = 0;
+	while(!stack.empty()) {
+		const int id = stack.back();
+		stack.pop_back();
+		const mt_node &node = tree.node[id];
+		if(id!=root) {
+			const int anc_id = node.ancestor->id;
+			const double branch_length = node.edge_time*time_scale;
+			evolve_branch(sequence[anc_id],sequence[id],mut,branch_length,import_divergence,rho_over_theta*branch_length,1.0/mean_import_length,imports[id],ran);
+			for(i=0;i<imports[id].size();i++) nimported += imports[id][i].end-imports[id][i].beg;
+		}
+		if(id<n) {
+			fout << ">" << node_label(tree,id) << endl << sequence[id] << endl;
+			sequence[id] = string();
+		} else {
+			stack.push_back(node.descendant[1]->id);
+			stack.push_back(node.descendant[0]->id);
+		}
+		// Release the ancestor once both its descendants have been evolved
+		if(id!=root && node.ancestor->descendant[1]==&node) sequence[node.ancestor->id] = string();
+	}
+	fout.close();
+	cout << "Wrote " << n << " sequences of length " << length << " to " << fasta_out_file << endl;
+
+	// Output the true importation intervals in the format of the ClonalFrameML importation status file
+	ofstream iout(import_out_file.c_str());
+	if(!iout) {
+		stringstream errTxt;
+		errTxt << "could not open file " << import_out_file << " for writing";
+		error(errTxt.str().c_str());
+	}
+	const char tab = '\t';
+	iout << "Node" << tab << "Beg" << tab << "End" << endl;
+	int nintervals = 0;
+	for(i=0;i<root;i++) {
+		int j;
+		for(j=0;j<imports[i].size();j++) {
+			iout << node_label(tree,i) << tab << imports[i][j].beg+1 << tab << imports[i][j].end << endl;
+			++nintervals;
+		}
+	}
+	iout.close();
+	cout << "Wrote " << nintervals << " imported intervals covering " << nimported << " sites in total to " << import_out_file << endl;
+	return 0;
+}
+
+/*	Evolve the sequence along one branch. The importation state follows the continuous-time two-state process of the
+	ClonalFrameML hidden Markov model along the genome, starting from its equilibrium.								*/
+void evolve_branch(const string &anc, string &dec, Mutation_Matrix &mut, const double branch_length, const double import_divergence, const double recrate, const double endrecrate, vector<ImportedInterval> &imports, Random &ran) {
+	const int length = anc.length();
+	dec = anc;
+	imports.clear();
+	bool imported = (recrate>0.0) && ran.U()<recrate/(recrate+endrecrate);
+	double pos = 0.0;
+	while(pos<length) {
+		double next = (imported) ? pos+ran.exponential(1.0/endrecrate) : ((recrate>0.0) ? pos+ran.exponential(1.0/recrate) : (double)length);
+		// Sites are at the integer positions in [pos,next)
+		const int beg = (int)ceil(pos);
+		const int end = (next<length) ? (int)ceil(next) : length;
+		if(end>beg) {
+			evolve_stretch(dec,beg,end,mut,(imported) ? import_divergence : branch_length,ran);
+			if(imported) {
+				// Merge with an import that ended at the previous site
+				if(!imports.empty() && imports.back().end==beg) {
+					imports.back().end = end;
+				} else {
+					ImportedInterval interval;
+					interval.beg = beg;
+					interval.end = end;
+					imports.push_back(interval);
+				}
+			}
+		}
+		pos = next;
+		imported = !imported;
+	}
+}
+
+/*	Substitute the sites in [beg,end) over the given distance by uniformization of the rate matrix: at every site, events
+	occur at the largest of the substitution rates of the four bases, and an event at a site with base a is a substitution,
+	drawn from the jump chain of the rate matrix, with probability the rate of a over the largest. The events are visited
+	by exponential gaps along the stretch, in units of sites times the expected number of events per site, so that the
+	cost is proportional to the number of events rather than of sites.												*/
+void evolve_stretch(string &dec, const int beg, const int end, Mutation_Matrix &mut, const double distance, Random &ran) {
+	static const char AGCT[4] = {'A','G','C','T'};
+	int base_index[256];
+	int i;
+	for(i=0;i<256;i++) base_index[i] = -1;
+	for(i=0;i<4;i++) base_index[(unsigned char)AGCT[i]] = i;
+	double rate_max = 0.0;
+	for(i=0;i<4;i++) {
+		if(mut.mutation_rate[i]>rate_max) rate_max = mut.mutation_rate[i];
+	}
+	const double events_per_site = rate_max*distance;
+	if(events_per_site<=0.0) return;
+	const double total = events_per_site*(double)(end-beg);
+	double u;
+	for(u=ran.exponential(1.0);u<total;u+=ran.exponential(1.0)) {
+		const int site = beg+(int)(u/events_per_site);
+		if(site>=end) break;
+		const int a = base_index[(unsigned char)dec[site]];
+		if(ran.U()*rate_max<mut.mutation_rate[a]) dec[site] = AGCT[mut.mutate(a)];
+	}
+}
+
+/*	Internal nodes of the marginal tree are numbered in order of age, which is the order in which ClonalFrameML numbers
+	them when it reads a rooted tree, so the labels below coincide with those of its output files.					*/
+string node_label(const marginal_tree &tree, const int id) {
+	stringstream label;
+	if(id<tree.n) label << "S" << id+1;
+	else label << "NODE_" << id+1;
+	return label.str();
+}
+
+void write_newick_node(const marginal_tree &tree, const mt_node *node, const double time_scale, ofstream &fout) {
+	if(node->descendant[0]!=NULL) {
+		fout << "(";
+		write_newick_node(tree,node->descendant[0],time_scale,fout);
+		fout << ",";
+		write_newick_node(tree,node->descendant[1],time_scale,fout);
+		fout << ")";
+	}
+	fout << node_label(tree,node->id);
+	if(node->ancestor!=NULL) fout << ":" << std::setprecision(12) << node->edge_time*time_scale;
+}
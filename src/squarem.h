@@ -0,0 +1,175 @@
+/*
+ *  squarem.h
+ *  Part of ClonalFrameML
+ *
+ *
+ *  ClonalFrameML is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ClonalFrameML is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with ClonalFrameML. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _SQUAREM_H_
+#define _SQUAREM_H_
+
+#include <vector>
+#include <math.h>
+
+enum EMAccelerator {EMAcceleratorNone=0, EMAcceleratorSQUAREM};
+
+// Counts of the work done by em_iterate()
+struct EMIterations {
+	int steps;				// EM steps, i.e. E-steps over all branches
+	int extrapolations;		// SQUAREM extrapolations accepted
+	int rejected;			// SQUAREM extrapolations rejected by the safeguard
+	bool converged;
+	EMIterations() : steps(0), extrapolations(0), rejected(0), converged(false) {}
+};
+
+// The state of em_iterate() at the start of a cycle, from which it continues exactly as it would have done uninterrupted
+struct EMState {
+	std::vector<double> p0, p1;		// Current parameters and the result of their EM step
+	double L0;						// Objective at p0
+	double step_max;
+	EMIterations iter;
+};
+
+// Storage through which em_iterate() offers its state at the start of every cycle, and from which it may resume
+class EMStateStore {
+public:
+	virtual bool load(EMState &state) = 0;
+	virtual void save(const EMState &state) = 0;
+	virtual ~EMStateStore() {}
+};
+
+/*	Iterate an EM algorithm to convergence. em_step(param,new_param) performs one E-step at param, returning the objective
+	(the log-posterior) at param, and one M-step, storing the updated parameters in new_param. As for plain EM, iteration
+	stops once one step changes the objective by less than threshold, with param set to the result of that step, so the
+	caller's state (posterior counts, prior) is that of the last call to em_step. maxit limits the number of steps.
+
+	With EMAcceleratorSQUAREM, every cycle takes two EM steps from p0 to p1 and p2 and extrapolates along them
+	(Varadhan and Roland 2008, Scand J Stat 35:335, scheme S3) to p' = p0 - 2a r + a^2 v, with r = p1-p0, v = p2-2p1+p0 and
+	a = -|r|/|v|. All parameters are positive, so the extrapolation is done on their logarithms. The next cycle starts from
+	p' if its EM step moves the parameters less than the step from p1 to p2 did, and otherwise the extrapolation is
+	rejected and the cycle restarts from p2. The safeguard is on this residual rather than on the objective because the
+	priors enter the M-steps as pseudocounts, so even plain EM does not increase the objective monotonically close to
+	its fixed point, and it is the fixed point of plain EM that is sought.
+
+	If store is not NULL, iteration resumes from the state it loads, if any, and the state is offered to it every cycle.	*/
+template<typename F>
+double em_iterate(F em_step, std::vector<double> &param, const EMAccelerator accel, const int maxit, const double threshold, EMIterations &iter, EMStateStore *store=NULL) {
+	const int n = param.size();
+	std::vector<double> p0 = param, p1(n), p2(n), pext(n), next(n);
+	double L0;
+	// Maximum step length, expanded while it limits the extrapolation and contracted when an extrapolation is rejected
+	double step_max = 1.0;
+	EMState state;
+	if(store!=NULL && store->load(state) && state.p0.size()==n && state.p1.size()==n) {
+		p0 = state.p0;
+		p1 = state.p1;
+		L0 = state.L0;
+		step_max = state.step_max;
+		iter = state.iter;
+	} else {
+		L0 = em_step(p0,p1);
+		++iter.steps;
+	}
+	int i;
+	while(iter.steps<maxit) {
+		if(store!=NULL) {
+			state.p0 = p0;
+			state.p1 = p1;
+			state.L0 = L0;
+			state.step_max = step_max;
+			state.iter = iter;
+			store->save(state);
+		}
+		const double L1 = em_step(p1,p2);
+		++iter.steps;
+		if(fabs(L1-L0)<threshold) {
+			param = p2;
+			iter.converged = true;
+			return L1;
+		}
+		if(accel==EMAcceleratorNone) {
+			p0 = p1;
+			p1 = p2;
+			L0 = L1;
+			continue;
+		}
+		// Extrapolate from p0, p1 and p2 on the log scale
+		bool valid = true;
+		double rr = 0.0, vv = 0.0, res2 = 0.0;
+		for(i=0;i<n;i++) {
+			if(!(p0[i]>0.0 && p1[i]>0.0 && p2[i]>0.0)) {
+				valid = false;
+				break;
+			}
+			const double r = log(p1[i])-log(p0[i]);
+			const double v = log(p2[i])-2.0*log(p1[i])+log(p0[i]);
+			rr += r*r;
+			vv += v*v;
+			res2 += (log(p2[i])-log(p1[i]))*(log(p2[i])-log(p1[i]));
+		}
+		// Leave room for the EM step from p2 should the extrapolation be rejected
+		if(valid && vv>0.0 && iter.steps+1<maxit) {
+			double alpha = -sqrt(rr/vv);
+			if(alpha>-1.0) alpha = -1.0;
+			if(alpha< -step_max) alpha = -step_max;
+			if(alpha==-step_max) step_max *= 4.0;
+			for(i=0;i<n;i++) {
+				const double r = log(p1[i])-log(p0[i]);
+				const double v = log(p2[i])-2.0*log(p1[i])+log(p0[i]);
+				pext[i] = exp(log(p0[i])-2.0*alpha*r+alpha*alpha*v);
+				if(!(pext[i]>0.0 && pext[i]<HUGE_VAL)) valid = false;
+			}
+			if(valid) {
+				const double Lext = em_step(pext,next);
+				++iter.steps;
+				double resext2 = 0.0;
+				for(i=0;i<n;i++) {
+					if(!(next[i]>0.0)) {
+						resext2 = HUGE_VAL;
+						break;
+					}
+					resext2 += (log(next[i])-log(pext[i]))*(log(next[i])-log(pext[i]));
+				}
+				if(resext2<=res2) {
+					++iter.extrapolations;
+					p0 = pext;
+					p1 = next;
+					L0 = Lext;
+					continue;
+				}
+				++iter.rejected;
+				step_max = (step_max>4.0) ? step_max/4.0 : 1.0;
+			}
+		}
+		// Fall back on the EM step from p2, unless out of steps (in which case em_step was last called at p1)
+		if(iter.steps>=maxit) {
+			param = p2;
+			return L1;
+		}
+		p0 = p2;
+		L0 = em_step(p0,p1);
+		++iter.steps;
+		// p2 followed p1 by one EM step, so this is also a test of convergence
+		if(fabs(L0-L1)<threshold) {
+			param = p1;
+			iter.converged = true;
+			return L0;
+		}
+	}
+	param = p1;
+	return L0;
+}
+
+#endif // _SQUAREM_H_
@@ -0,0 +1,51 @@
+/*
+ *  threadpool.h
+ *  Part of ClonalFrameML
+ *
+ *
+ *  ClonalFrameML is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ClonalFrameML is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with ClonalFrameML. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+#include <vector>
+#include <thread>
+#include <atomic>
+
+/*	Call f(i) for every i in 0..n-1 using up to nthreads threads (including the
+	calling thread). Items are handed out one at a time in index order from a
+	shared counter, so a thread that finishes early picks up the next waiting
+	item. f must be safe to call concurrently for different i, and any results
+	should be written to per-item storage and reduced afterwards by the caller. */
+template<typename F>
+void parallel_for(const int n, const int nthreads, F f) {
+	int i;
+	if(nthreads<=1 || n<=1) {
+		for(i=0;i<n;i++) f(i);
+		return;
+	}
+	std::atomic<int> next(0);
+	auto worker = [&]() {
+		int item;
+		while((item=next++)<n) f(item);
+	};
+	const int nworkers = (nthreads<n) ? nthreads : n;
+	std::vector<std::thread> threads;
+	for(i=1;i<nworkers;i++) threads.push_back(std::thread(worker));
+	worker();
+	for(i=0;i<threads.size();i++) threads[i].join();
+}
+
+#endif // _THREADPOOL_H_
@@ -0,0 +1,137 @@
+/*
+ *  timings.h
+ *  Part of ClonalFrameML
+ *
+ *
+ *  ClonalFrameML is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  ClonalFrameML is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with ClonalFrameML. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef _TIMINGS_H_
+#define _TIMINGS_H_
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <chrono>
+#include <mutex>
+#include <time.h>
+#include <sys/resource.h>
+
+/*	Lightweight instrumentation of the phases of an analysis. Every phase records its number of calls, wall-clock
+	time, CPU time summed over all threads, and the peak resident set size of the process when it last finished.
+	Phases may be nested, in which case the time of the inner phase is included in that of the outer one. */
+struct PhaseTiming {
+	std::string name;
+	int calls;
+	double wall;
+	double cpu;
+	long peak_rss_kb;
+};
+
+class PhaseTimings {
+public:
+	std::vector<PhaseTiming> phase;
+	std::chrono::steady_clock::time_point wall_start;
+	clock_t cpu_start;
+protected:
+	std::mutex lock;
+public:
+	PhaseTimings() : wall_start(std::chrono::steady_clock::now()), cpu_start(clock()) {}
+	// Wall-clock seconds since the program started
+	double wall_time() const {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now()-wall_start).count();
+	}
+	// CPU seconds used by all threads since the program started
+	double cpu_time() const {
+		return (double)(clock()-cpu_start)/CLOCKS_PER_SEC;
+	}
+	// Peak resident set size of the process so far, in kilobytes
+	static long peak_rss_kb() {
+		struct rusage usage;
+		if(getrusage(RUSAGE_SELF,&usage)!=0) return 0;
+		return usage.ru_maxrss;
+	}
+	void record(const char* name, const double wall, const double cpu) {
+		const long rss = peak_rss_kb();
+		std::lock_guard<std::mutex> guard(lock);
+		int i;
+		for(i=0;i<phase.size();i++) {
+			if(phase[i].name==name) break;
+		}
+		if(i==phase.size()) {
+			PhaseTiming p;
+			p.name = name;
+			p.calls = 0;
+			p.wall = p.cpu = 0.0;
+			p.peak_rss_kb = 0;
+			phase.push_back(p);
+		}
+		++phase[i].calls;
+		phase[i].wall += wall;
+		phase[i].cpu += cpu;
+		phase[i].peak_rss_kb = rss;
+	}
+	// Write the phases in the order in which they were first entered, and the totals for the whole run
+	bool write_json(const char* file_name, const char* version, const int nthreads) {
+		std::ofstream fout(file_name);
+		if(!fout) return false;
+		std::lock_guard<std::mutex> guard(lock);
+		fout << "{" << std::endl;
+		fout << "  \"version\": \"" << version << "\"," << std::endl;
+		fout << "  \"threads\": " << nthreads << "," << std::endl;
+		fout << "  \"total\": {\"wall_s\": " << wall_time() << ", \"cpu_s\": " << cpu_time() << ", \"peak_rss_kb\": " << peak_rss_kb() << "}," << std::endl;
+		fout << "  \"phases\": [" << std::endl;
+		int i;
+		for(i=0;i<phase.size();i++) {
+			fout << "    {\"name\": \"" << phase[i].name << "\", \"calls\": " << phase[i].calls;
+			fout << ", \"wall_s\": " << phase[i].wall << ", \"cpu_s\": " << phase[i].cpu << ", \"peak_rss_kb\": " << phase[i].peak_rss_kb << "}";
+			fout << ((i+1<phase.size()) ? "," : "") << std::endl;
+		}
+		fout << "  ]" << std::endl;
+		fout << "}" << std::endl;
+		fout.close();
+		return true;
+	}
+};
+
+// The timings for the whole program
+inline PhaseTimings& phase_timings() {
+	static PhaseTimings timings;
+	return timings;
+}
+
+// Records the time from its construction to stop() or its destruction, whichever comes first, as one call of the named phase
+class TimedPhase {
+public:
+	const char* name;
+	std::chrono::steady_clock::time_point wall_start;
+	clock_t cpu_start;
+	bool running;
+	// Wall-clock seconds between construction and stop()
+	double wall;
+public:
+	TimedPhase(const char* _name) : name(_name), wall_start(std::chrono::steady_clock::now()), cpu_start(clock()), running(true), wall(0.0) {}
+	~TimedPhase() {
+		stop();
+	}
+	double stop() {
+		if(!running) return wall;
+		wall = std::chrono::duration<double>(std::chrono::steady_clock::now()-wall_start).count();
+		phase_timings().record(name,wall,(double)(clock()-cpu_start)/CLOCKS_PER_SEC);
+		running = false;
+		return wall;
+	}
+};
+
+#endif // _TIMINGS_H_
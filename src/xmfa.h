@@ -18,50 +18,127 @@
  *
  */
 
+
 #include "myutils/DNA.h"
+#include "infile.h"
+
+// A run of alignment sites, from beg up to but not including end (0-based positions)
+struct SiteInterval {
+	int beg, end;
+	SiteInterval() : beg(0), end(0) {}
+	SiteInterval(const int _beg, const int _end) : beg(_beg), end(_end) {}
+};
+
+// Number of N sites inserted between consecutive XMFA blocks, so that they are unlinked
+static const int xmfa_unlink_length = 1000;
 
-void readXMFA(const char *filename,DNA * dna,vector<int> * sites_to_ignore) {
-		string unlink=string(1000,'N');
-		ifstream in(filename);
-		if(!in.is_open()) {
+/*	One pass over the text of an XMFA file. The first pass (fill false) finds the labels, the length of every sequence
+	and the intervals of block padding; the second (fill true) copies the bases into the strings of dna->sequence, which
+	have been reserved to those lengths, so that no sequence is reallocated or copied as the blocks are joined. A record
+	is kept only once the next '>' or '=' line closes it, and the sequences of later blocks are taken in the order of the
+	first block.	*/
+void readXMFA_pass(const char *filename, const char *text, const size_t len, DNA *dna, vector<size_t> &length, vector<SiteInterval> *sites_to_ignore, const bool fill) {
+	size_t pos = 0;
+	bool first = true;
+	int block = 0, nseq = 0;
+	size_t newlen = 0, mark = 0;
+	string *target = NULL;
+	while(pos<len) {
+		const char *b = text+pos;
+		const char *e = (const char*)memchr(b,'\n',len-pos);
+		if(e==NULL) e = text+len;
+		pos = e-text+1;
+		if(b==e || *b=='#') continue;
+		if(*(e-1)=='\r') --e;
+		// Spaces are ignored, as is anything from the first colon (the coordinates of a record)
+		const char *colon = (const char*)memchr(b,':',e-b);
+		if(colon!=NULL) e = colon;
+		const char *c = b;
+		while(c<e && *c==' ') ++c;
+		if(first) {
+			if(c==e || *c!='>') {
+				string errmsg = "readXMFA(): File "+string(filename)+" did not begin with '>'";
+				error(errmsg.c_str());
+			}
+			if(!fill) {
+				string label;
+				for(++c;c<e;++c) if(*c!=' ') label.push_back(*c);
+				dna->label.push_back(label);
+			}
+			first = false;
+			target = (fill) ? &dna->sequence[0] : NULL;
+		} else if(c<e && (*c=='>' || *c=='=')) {
+			// Close the current record
+			if(block==0 && !fill) length.push_back(0);
+			if(nseq>=0 && !fill) {
+				if(block>0) {
+					if(nseq>=length.size()) {
+						stringstream errTxt;
+						errTxt << "readXMFA(): block " << block+1 << " of file " << filename << " has more sequences than the first block";
+						error(errTxt.str().c_str());
+					}
+					if(nseq==0) sites_to_ignore->push_back(SiteInterval(length[0],length[0]+xmfa_unlink_length));
+					length[nseq] += xmfa_unlink_length;
+				}
+				length[nseq] += newlen;
+			}
+			newlen = 0;
+			if(*c=='>') {
+				nseq++;
+				if(block==0 && !fill) {
+					string label;
+					for(++c;c<e;++c) if(*c!=' ') label.push_back(*c);
+					dna->label.push_back(label);
+				}
+			} else {
+				block++;
+				nseq = -1;
+			}
+			// Open the next record
+			target = (fill && nseq>=0 && nseq<dna->sequence.size()) ? &dna->sequence[nseq] : NULL;
+			if(target!=NULL) {
+				mark = target->size();
+				if(block>0) target->append(xmfa_unlink_length,'N');
+			}
+		} else {
+			for(;c<e;++c) {
+				if(*c==' ') continue;
+				++newlen;
+				if(target!=NULL) target->push_back(*c);
+			}
+		}
+	}
+	// A record that is not closed is discarded
+	if(target!=NULL) target->resize(mark);
+	if(first) {
+		string errmsg = "readXMFA(): File "+string(filename)+" did not begin with '>'";
+		error(errmsg.c_str());
+	}
+}
+
+/*	Read an XMFA file, joining its blocks into one alignment. Every block after the first is preceded by
+	xmfa_unlink_length sites of N, whose intervals are appended to sites_to_ignore. The file is held in memory and
+	parsed twice, first to size the sequences and then to fill them, so that reading takes time linear in its size.	*/
+void readXMFA(const char *filename,DNA * dna,vector<SiteInterval> * sites_to_ignore,const int nthreads=1) {
+		// The text of the file is mapped, or decompressed, into memory
+		InputFile file;
+		string msg;
+		if(!file.open(filename,nthreads,msg)) {
+			if(!msg.empty()) error(msg.c_str());
 			string errmsg = "readXMFA(): File "+string(filename)+" not found";
 			error(errmsg.c_str());
 		}
-		
-		dna->nseq = 0;
-		int block=0;
-		string s;
-		getline(in,s);while (s.empty()||*s.begin()=='#') getline(in,s); 
-		if (!s.empty()&&*s.rbegin()=='\r') s.erase(s.length()-1,1);
-		s.erase(remove(s.begin(),s.end(),' '),s.end());
-		s=s.substr(0,s.find(":"));
-		if(s.length()>0 && s[0]!='>') {
-			string errmsg = "readXMFA(): File "+string(filename)+" did not begin with '>'";
+		vector<size_t> length(0);
+		readXMFA_pass(filename,file.text,file.len,dna,length,sites_to_ignore,false);
+		if(length.empty()) {
+			string errmsg = "readXMFA(): File "+string(filename)+" contains no complete block";
 			error(errmsg.c_str());
 		}
-		dna->label.push_back(s.substr(1));
-		string newseq = "";
-		while(!in.eof()) {
-			getline(in,s);if (s.empty()||*s.begin()=='#') continue; 
-			if (!s.empty()&&*s.rbegin()=='\r') s.erase(s.length()-1,1);
-			s.erase(remove(s.begin(),s.end(),' '),s.end());
-			s=s.substr(0,s.find(":"));
-			if(s.length()>0 && (s[0]=='>'||s[0]=='=')) {
-				if (block==0) dna->sequence.push_back("");
-				if (dna->nseq>=0) {
-					if (block==0) dna->sequence[dna->nseq]+=newseq;
-					else {
-					if (dna->nseq==0) for (int i=0;i<unlink.length();i++) 
-					sites_to_ignore->push_back(dna->sequence[0].length()+i);
-					dna->sequence[dna->nseq]+=unlink+newseq;}
-					}
-				newseq = "";
-				if(s[0]=='>') {dna->nseq++;if (block==0) dna->label.push_back(s.substr(1));} 
-				else {block++;dna->nseq=-1;}
-				} else newseq += s;
-		}
+		dna->sequence = vector<string>(length.size());
+		int i;
+		for(i=0;i<length.size();i++) dna->sequence[i].reserve(length[i]);
+		readXMFA_pass(filename,file.text,file.len,dna,length,sites_to_ignore,true);
 		dna->nseq=dna->sequence.size();
 		dna->lseq=dna->sequence[0].length();
-		in.close();
 }
 